@@ -0,0 +1,239 @@
+#include <string.h>
+
+#include "AsyncDecoder.h"
+#include "PixelFormat.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static int64_t ElapsedUs(Clock::time_point since){
+	return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - since).count();
+}
+
+AsyncDecoder::~AsyncDecoder(){
+	Close();
+}
+
+bool AsyncDecoder::Open(VideoDecoder * decoder, const AsyncDecoderParams & params){
+	Close();
+	if (!decoder)
+		return false;
+	m_decoder = decoder;
+	m_params = params;
+	m_packets.Reset(m_params.packet_depth > 0 ? m_params.packet_depth : 1);
+	m_frames.Reset(m_params.frame_depth > 0 ? m_params.frame_depth : 1);
+	m_dumps = 0;
+	m_dumps_done = 0;
+	m_packet_count = 0;
+	m_frame_count = 0;
+	m_decode_errors = 0;
+	m_max_packet_queue = 0;
+	m_max_frame_queue = 0;
+	m_input_blocked_us = 0;
+	m_decode_busy_us = 0;
+	m_decode_blocked_us = 0;
+	m_deliver_busy_us = 0;
+	m_opened = Clock::now();
+
+	m_decoder->SetFrameCB(OnDecoded, this);
+	m_running = true;
+	m_worker = std::thread(&AsyncDecoder::WorkThread, this);
+	m_deliver = std::thread(&AsyncDecoder::DeliverThread, this);
+	return true;
+}
+
+// call before Open or while the pipeline is drained
+void AsyncDecoder::SetFrameCB(VideoFrameCB cb, void * user_data){
+	m_frame_cb = cb;
+	m_user_data = user_data;
+}
+
+/*
+blocks until pred holds or the decoder closes, returns the time spent waiting.
+the waiter count is raised before pred is checked under the lock, Notify
+publishes its change before reading the count, so a wakeup is never lost.
+*/
+template <class Pred>
+int64_t AsyncDecoder::Wait(Pred pred){
+	if (pred())
+		return 0;
+	Clock::time_point begin = Clock::now();
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_waiters++;
+	m_cond.wait(lock, [&]{ return !m_running || pred(); });
+	m_waiters--;
+	return ElapsedUs(begin);
+}
+
+void AsyncDecoder::Notify(){
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_waiters.load()){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_cond.notify_all();
+	}
+}
+
+bool AsyncDecoder::SetInputStream(unsigned char * buffer, int len, int64_t pts){
+	if (!m_running)
+		return false;
+	Packet * packet = m_packets.Back();
+	if (!packet){
+		m_input_blocked_us += Wait([this]{ return m_packets.Back() != nullptr; });
+		packet = m_packets.Back();
+		if (!packet)
+			return false;
+	}
+	packet->data.assign(buffer, buffer + len);
+	packet->pts = pts;
+	packet->dump = false;
+	m_packets.Push();
+	Notify();
+	int size = (int)m_packets.Size();
+	if (size > m_max_packet_queue.load(std::memory_order_relaxed))
+		m_max_packet_queue.store(size, std::memory_order_relaxed);
+	return true;
+}
+
+bool AsyncDecoder::Dump(){
+	if (!m_running)
+		return false;
+	Packet * packet = m_packets.Back();
+	if (!packet){
+		m_input_blocked_us += Wait([this]{ return m_packets.Back() != nullptr; });
+		packet = m_packets.Back();
+		if (!packet)
+			return false;
+	}
+	packet->data.clear();
+	packet->dump = true;
+	uint64_t dump = ++m_dumps;
+	m_packets.Push();
+	Notify();
+	Wait([this, dump]{ return m_dumps_done.load() >= dump; });
+	return m_dumps_done.load() >= dump;
+}
+
+/*
+worker side: a free frame slot, waiting for the delivery thread when all are
+taken. nullptr once the decoder closes.
+*/
+AsyncDecoder::Frame * AsyncDecoder::AcquireFrame(){
+	Frame * frame = m_frames.Back();
+	if (!frame){
+		m_decode_blocked_us += Wait([this]{ return m_frames.Back() != nullptr; });
+		frame = m_frames.Back();
+	}
+	return frame;
+}
+
+// runs on the worker inside VideoDecoder::SetInputStream/Dump, data is only valid during the call
+void AsyncDecoder::OnDecoded(VideoRawData *data, void * user_data){
+	AsyncDecoder * self = (AsyncDecoder*)user_data;
+	Frame * frame = self->AcquireFrame();
+	if (!frame)
+		return;
+	frame->pic = VideoRawData();
+	frame->pic.width = data->width;
+	frame->pic.height = data->height;
+	frame->pic.fmt = data->fmt;
+	frame->pic.pts = data->pts;
+	memcpy(frame->pic.hash, data->hash, sizeof(frame->pic.hash));
+	if (data->stats){
+		frame->stats = *data->stats;
+		frame->pic.stats = &frame->stats;
+	}
+	frame->data.resize(RawFrameSize(data->fmt, data->width, data->height));
+	SetRawPlanes(frame->pic, frame->data.data());
+	CopyRawFrame(*data, frame->pic);
+	frame->dump = false;
+	self->m_frames.Push();
+	self->Notify();
+	int size = (int)self->m_frames.Size();
+	if (size > self->m_max_frame_queue.load(std::memory_order_relaxed))
+		self->m_max_frame_queue.store(size, std::memory_order_relaxed);
+}
+
+void AsyncDecoder::WorkThread(){
+	while (m_running){
+		Packet * packet = m_packets.Front();
+		if (!packet){
+			Wait([this]{ return m_packets.Front() != nullptr; });
+			continue;
+		}
+		Clock::time_point begin = Clock::now();
+		if (packet->dump){
+			m_decoder->Dump();
+			m_decode_busy_us += ElapsedUs(begin);
+			// the marker follows the last frame of the dump through the frame queue
+			Frame * frame = AcquireFrame();
+			if (!frame)
+				break;
+			frame->dump = true;
+			m_frames.Push();
+		}else{
+			if (!m_decoder->SetInputStream(packet->data.data(), packet->data.size(), packet->pts))
+				m_decode_errors++;
+			m_decode_busy_us += ElapsedUs(begin);
+			m_packet_count++;
+		}
+		m_packets.Pop();
+		Notify();
+	}
+}
+
+void AsyncDecoder::DeliverThread(){
+	while (m_running){
+		Frame * frame = m_frames.Front();
+		if (!frame){
+			Wait([this]{ return m_frames.Front() != nullptr; });
+			continue;
+		}
+		if (frame->dump)
+			m_dumps_done++;
+		else{
+			Clock::time_point begin = Clock::now();
+			if (m_frame_cb)
+				m_frame_cb(&frame->pic, m_user_data);
+			m_deliver_busy_us += ElapsedUs(begin);
+			m_frame_count++;
+		}
+		m_frames.Pop();
+		Notify();
+	}
+}
+
+void AsyncDecoder::Close(){
+	if (m_worker.joinable() || m_deliver.joinable()){
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_running = false;
+			m_cond.notify_all();
+		}
+		if (m_worker.joinable())
+			m_worker.join();
+		if (m_deliver.joinable())
+			m_deliver.join();
+	}
+	m_running = false;
+	if (m_decoder)
+		m_decoder->SetFrameCB(nullptr, nullptr);
+	m_decoder = nullptr;
+	m_packets.Reset(0);
+	m_frames.Reset(0);
+}
+
+void AsyncDecoder::GetStats(AsyncDecoderStats & stats){
+	stats = AsyncDecoderStats();
+	stats.packets = m_packet_count.load();
+	stats.frames = m_frame_count.load();
+	stats.decode_errors = m_decode_errors.load();
+	stats.packet_queue = m_packets.Size();
+	stats.frame_queue = m_frames.Size();
+	stats.max_packet_queue = m_max_packet_queue.load();
+	stats.max_frame_queue = m_max_frame_queue.load();
+	stats.wall_us = ElapsedUs(m_opened);
+	stats.input_blocked_us = m_input_blocked_us.load();
+	stats.decode_busy_us = m_decode_busy_us.load();
+	stats.decode_blocked_us = m_decode_blocked_us.load();
+	stats.deliver_busy_us = m_deliver_busy_us.load();
+	stats.parallelism = stats.wall_us ? (double)(stats.decode_busy_us + stats.deliver_busy_us) / stats.wall_us : 0;
+}
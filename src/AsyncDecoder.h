@@ -0,0 +1,105 @@
+#ifndef _H_ASYNCDECODER_
+#define _H_ASYNCDECODER_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Def.h"
+#include "SpscQueue.h"
+#include "VideoDecoder.h"
+
+struct AsyncDecoderParams{
+	int packet_depth = 64;	// packets waiting for the decode worker
+	int frame_depth = 4;	// decoded frames waiting for the delivery thread
+};
+
+struct AsyncDecoderStats{
+	uint64_t packets = 0;
+	uint64_t frames = 0;
+	uint64_t decode_errors = 0;
+	int packet_queue = 0;
+	int frame_queue = 0;
+	int max_packet_queue = 0;
+	int max_frame_queue = 0;
+	int64_t wall_us = 0;				// since Open
+	int64_t input_blocked_us = 0;		// SetInputStream waiting for a free packet slot
+	int64_t decode_busy_us = 0;			// worker inside the decoder
+	int64_t decode_blocked_us = 0;		// worker waiting for a free frame slot, a slow consumer
+	int64_t deliver_busy_us = 0;		// delivery thread inside the frame callback
+	double parallelism = 0;				// (decode_busy + deliver_busy) / wall, above 1 the threads overlap
+};
+
+/*
+Runs a VideoDecoder on threads of its own. SetInputStream copies the packet
+into a lock-free SPSC queue and returns, a worker drains it into the decoder
+and copies every frame into a second SPSC queue, a delivery thread hands those
+to the frame callback. Demux jitter, decode waits and a slow consumer only
+meet when a queue runs full.
+SetInputStream, Dump and Close belong to one producer thread, the decoder
+must be Init-ed and is only touched by the worker while open.
+*/
+class AsyncDecoder {
+public:
+	AsyncDecoder() = default;
+	~AsyncDecoder();
+	bool Open(VideoDecoder * decoder, const AsyncDecoderParams & params = AsyncDecoderParams());
+	void SetFrameCB(VideoFrameCB cb, void * user_data);
+	bool SetInputStream(unsigned char * buffer, int len, int64_t pts);
+	// returns once every frame of the packets given so far went through the callback
+	bool Dump();
+	// pending packets and frames are dropped, Dump first to keep them
+	void Close();
+	void GetStats(AsyncDecoderStats & stats);
+private:
+	struct Packet{
+		std::vector<unsigned char> data;
+		int64_t pts = 0;
+		bool dump = false;
+	};
+	struct Frame{
+		std::vector<unsigned char> data;
+		VideoRawData pic;
+		VideoFrameStats stats;
+		bool dump = false;
+	};
+	static void OnDecoded(VideoRawData *data, void * user_data);
+	void WorkThread();
+	void DeliverThread();
+	template <class Pred> int64_t Wait(Pred pred);
+	void Notify();
+	Frame * AcquireFrame();
+private:
+	VideoDecoder * m_decoder = nullptr;
+	AsyncDecoderParams m_params;
+	VideoFrameCB m_frame_cb = nullptr;
+	void * m_user_data = nullptr;
+private:
+	SpscQueue<Packet> m_packets;
+	SpscQueue<Frame> m_frames;
+	std::thread m_worker;
+	std::thread m_deliver;
+	std::atomic<bool> m_running{false};
+	// slow path for an empty or full queue, only taken while someone waits
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::atomic<int> m_waiters{0};
+	uint64_t m_dumps = 0;					// producer side
+	std::atomic<uint64_t> m_dumps_done{0};
+private:
+	std::chrono::steady_clock::time_point m_opened;
+	std::atomic<uint64_t> m_packet_count{0};
+	std::atomic<uint64_t> m_frame_count{0};
+	std::atomic<uint64_t> m_decode_errors{0};
+	std::atomic<int> m_max_packet_queue{0};	// written by the producer
+	std::atomic<int> m_max_frame_queue{0};	// written by the worker
+	std::atomic<int64_t> m_input_blocked_us{0};
+	std::atomic<int64_t> m_decode_busy_us{0};
+	std::atomic<int64_t> m_decode_blocked_us{0};
+	std::atomic<int64_t> m_deliver_busy_us{0};
+};
+#endif
@@ -0,0 +1,36 @@
+#ifndef _H_CODECBACKEND_
+#define _H_CODECBACKEND_
+
+#include "Def.h"
+
+/*
+The media sdk calls VideoDecoder/VideoEncoder depend on, one session per instance.
+HardwareBackend forwards them to libmfx on the render node, LoopbackBackend
+simulates them on the cpu so the pipeline can run without a gpu.
+*/
+class CodecBackend {
+public:
+	virtual ~CodecBackend() = default;
+	virtual bool Open() = 0;
+	virtual void Close() = 0;
+
+	virtual mfxStatus DecodeHeader(mfxBitstream *bs, mfxVideoParam *par) = 0;
+	virtual mfxStatus DecodeInit(mfxVideoParam *par) = 0;
+	virtual mfxStatus DecodeQueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest *request) = 0;
+	virtual mfxStatus DecodeFrameAsync(mfxBitstream *bs, mfxFrameSurface1 *surface_work,
+			mfxFrameSurface1 **surface_out, mfxSyncPoint *syncp) = 0;
+	// drops buffered input and pending frames, the surfaces stay allocated
+	virtual mfxStatus DecodeReset(mfxVideoParam *par) = 0;
+	virtual void DecodeClose() = 0;
+
+	virtual mfxStatus EncodeInit(mfxVideoParam *par) = 0;
+	virtual mfxStatus EncodeQueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest *request) = 0;
+	// parameters in effect after EncodeInit, defaults resolved
+	virtual mfxStatus EncodeGetVideoParam(mfxVideoParam *par) = 0;
+	virtual mfxStatus EncodeFrameAsync(mfxEncodeCtrl *ctrl, mfxFrameSurface1 *surface,
+			mfxBitstream *bs, mfxSyncPoint *syncp) = 0;
+	virtual void EncodeClose() = 0;
+
+	virtual mfxStatus SyncOperation(mfxSyncPoint syncp, mfxU32 wait) = 0;
+};
+#endif
@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <mutex>
+
+#include "Compositor.h"
+#include "PixelFormat.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// box levels per axis together, 2^7 summed 8 bit samples stay within a signed 16 bit lane
+#define SCALER_MAX_LEVELS 7
+#define CANVAS_UNKNOWN UINT64_MAX
+
+typedef std::chrono::steady_clock Clock;
+
+// dst[i] = sum of the pixel pairs of src per component, count output pixels
+static void SumPairs8(const uint8_t * src, uint16_t * dst, int count, int comps){
+	int n = count * comps;
+	int i = 0;
+#ifdef __SSE2__
+	if (comps == 1){
+		const __m128i mask = _mm_set1_epi16(0xFF);
+		for (; i + 8 <= n; i += 8){
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i * 2));
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi16(_mm_and_si128(v, mask), _mm_srli_epi16(v, 8)));
+		}
+	}else{
+		// one UV pair per 32 bit lane once widened, pairs of lanes are added
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 8 <= n; i += 8){
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i * 2));
+			__m128 lo = _mm_castsi128_ps(_mm_unpacklo_epi8(v, zero));
+			__m128 hi = _mm_castsi128_ps(_mm_unpackhi_epi8(v, zero));
+			__m128i even = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+			__m128i odd = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi16(even, odd));
+		}
+	}
+#endif
+	for (; i < n; i++){
+		int pixel = i / comps;
+		int c = i % comps;
+		dst[i] = src[pixel * 2 * comps + c] + src[(pixel * 2 + 1) * comps + c];
+	}
+}
+
+// the same on 16 bit sums, src and dst may be the same row
+static void SumPairs16(const uint16_t * src, uint16_t * dst, int count, int comps){
+	int n = count * comps;
+	int i = 0;
+#ifdef __SSE2__
+	if (comps == 1){
+		const __m128i ones = _mm_set1_epi16(1);
+		for (; i + 8 <= n; i += 8){
+			__m128i a = _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(src + i * 2)), ones);
+			__m128i b = _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(src + i * 2 + 8)), ones);
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(a, b));
+		}
+	}else{
+		for (; i + 8 <= n; i += 8){
+			__m128 a = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(src + i * 2)));
+			__m128 b = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(src + i * 2 + 8)));
+			__m128i even = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+			__m128i odd = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi16(even, odd));
+		}
+	}
+#endif
+	for (; i < n; i++){
+		int pixel = i / comps;
+		int c = i % comps;
+		dst[i] = src[pixel * 2 * comps + c] + src[(pixel * 2 + 1) * comps + c];
+	}
+}
+
+static void AddRow8(const uint8_t * src, uint16_t * sum, int n){
+	int i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16){
+		__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i lo = _mm_loadu_si128((const __m128i*)(sum + i));
+		__m128i hi = _mm_loadu_si128((const __m128i*)(sum + i + 8));
+		_mm_storeu_si128((__m128i*)(sum + i), _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero)));
+		_mm_storeu_si128((__m128i*)(sum + i + 8), _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero)));
+	}
+#endif
+	for (; i < n; i++)
+		sum[i] += src[i];
+}
+
+static void AddRow16(const uint16_t * src, uint16_t * sum, int n){
+	int i = 0;
+#ifdef __SSE2__
+	for (; i + 8 <= n; i += 8)
+		_mm_storeu_si128((__m128i*)(sum + i), _mm_add_epi16(_mm_loadu_si128((const __m128i*)(sum + i)),
+				_mm_loadu_si128((const __m128i*)(src + i))));
+#endif
+	for (; i < n; i++)
+		sum[i] += src[i];
+}
+
+// rounded sum >> shift back to 8 bit, shift >= 1
+static void Normalize(const uint16_t * sum, uint8_t * dst, int n, int shift){
+	int i = 0;
+	uint16_t round = (uint16_t)(1 << (shift - 1));
+#ifdef __SSE2__
+	const __m128i add = _mm_set1_epi16(round);
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	for (; i + 16 <= n; i += 16){
+		__m128i lo = _mm_srl_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i*)(sum + i)), add), count);
+		__m128i hi = _mm_srl_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i*)(sum + i + 8)), add), count);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; i < n; i++)
+		dst[i] = (uint8_t)((sum[i] + round) >> shift);
+}
+
+// dst = a + (b - a) * weight / 256
+static void LerpRows(const uint8_t * a, const uint8_t * b, uint8_t * dst, int n, int weight){
+	int i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i wa = _mm_set1_epi16(256 - weight);
+	const __m128i wb = _mm_set1_epi16(weight);
+	const __m128i round = _mm_set1_epi16(128);
+	for (; i + 16 <= n; i += 16){
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa), _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa), _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; i < n; i++)
+		dst[i] = (uint8_t)((a[i] * (256 - weight) + b[i] * weight + 128) >> 8);
+}
+
+// bilinear between the two taps of every output pixel, COMPS known so the inner loop unrolls
+template <int COMPS>
+static void LerpTaps(const uint8_t * line, uint8_t * out, int width, int step, const int * x0, const int * x1, const int * wx){
+	for (int x = 0; x < width; x++){
+		const uint8_t * a = line + x0[x];
+		const uint8_t * b = line + x1[x];
+		int w = wx[x];
+		for (int c = 0; c < COMPS; c++)
+			out[x * step + c] = (uint8_t)((a[c] * (256 - w) + b[c] * w + 128) >> 8);
+	}
+}
+
+/*
+downscales one plane into a rectangle of another. A box filter first sums
+2^kx x 2^ky source pixels into each prefiltered pixel, the largest power of
+two that does not go below the target size, so every source pixel counts.
+A bilinear pass covers the factor below 2 that is left. comps is 1 for a
+plane of its own, 2 for interleaved UV, dst_step the bytes between output
+pixels (2 writes a planar U or V into an interleaved UV plane).
+*/
+class PlaneScaler{
+public:
+	void Scale(const uint8_t * src, int src_pitch, int src_width, int src_height, int comps,
+			uint8_t * dst, int dst_pitch, int dst_width, int dst_height, int dst_step);
+private:
+	void Setup(int src_width, int src_height, int dst_width, int dst_height, int comps);
+	const uint8_t * Prefiltered(const uint8_t * src, int src_pitch, int row);
+private:
+	int m_src_width = 0;
+	int m_src_height = 0;
+	int m_dst_width = 0;
+	int m_dst_height = 0;
+	int m_comps = 0;
+	int m_kx = 0;
+	int m_ky = 0;
+	int m_width = 0;	// prefiltered
+	int m_height = 0;
+	std::vector<uint16_t> m_row;	// horizontal sums of one source row
+	std::vector<uint16_t> m_sum;
+	std::vector<uint8_t> m_cache[2];	// prefiltered rows by parity, neighbours never evict each other
+	int m_cached[2] = {-1, -1};
+	std::vector<uint8_t> m_line;
+	std::vector<int> m_x0;			// bilinear taps per output pixel, sample offsets
+	std::vector<int> m_x1;
+	std::vector<int> m_wx;
+};
+
+// source position of the centre of output sample i, 8 bit fraction
+static int SourcePosition(int i, int src, int dst){
+	int pos = (int)(((int64_t)(2 * i + 1) * src * 256) / (2 * dst)) - 128;
+	if (pos < 0)
+		pos = 0;
+	if (pos > (src - 1) * 256)
+		pos = (src - 1) * 256;
+	return pos;
+}
+
+void PlaneScaler::Setup(int src_width, int src_height, int dst_width, int dst_height, int comps){
+	m_src_width = src_width;
+	m_src_height = src_height;
+	m_dst_width = dst_width;
+	m_dst_height = dst_height;
+	m_comps = comps;
+	m_kx = 0;
+	while (m_kx < SCALER_MAX_LEVELS && (src_width >> (m_kx + 1)) >= dst_width)
+		m_kx++;
+	m_ky = 0;
+	while (m_kx + m_ky < SCALER_MAX_LEVELS && (src_height >> (m_ky + 1)) >= dst_height)
+		m_ky++;
+	m_width = src_width >> m_kx;
+	m_height = src_height >> m_ky;
+	m_row.resize((src_width >> 1) * comps);
+	m_sum.resize(m_width * comps);
+	m_cache[0].resize(m_width * comps);
+	m_cache[1].resize(m_width * comps);
+	m_line.resize(m_width * comps);
+	m_x0.resize(dst_width);
+	m_x1.resize(dst_width);
+	m_wx.resize(dst_width);
+	for (int x = 0; x < dst_width; x++){
+		int pos = SourcePosition(x, m_width, dst_width);
+		m_x0[x] = (pos >> 8) * comps;
+		m_x1[x] = ((pos >> 8) + 1 < m_width ? (pos >> 8) + 1 : m_width - 1) * comps;
+		m_wx[x] = pos & 0xFF;
+	}
+}
+
+const uint8_t * PlaneScaler::Prefiltered(const uint8_t * src, int src_pitch, int row){
+	if (!m_kx && !m_ky)
+		return src + row * src_pitch;
+	int slot = row & 1;
+	if (m_cached[slot] == row)
+		return m_cache[slot].data();
+	int n = m_width * m_comps;
+	memset(m_sum.data(), 0, n * sizeof(uint16_t));
+	for (int j = 0; j < (1 << m_ky); j++){
+		const uint8_t * line = src + ((row << m_ky) + j) * src_pitch;
+		if (!m_kx){
+			AddRow8(line, m_sum.data(), n);
+			continue;
+		}
+		SumPairs8(line, m_row.data(), m_src_width >> 1, m_comps);
+		for (int level = 2; level <= m_kx; level++)
+			SumPairs16(m_row.data(), m_row.data(), m_src_width >> level, m_comps);
+		AddRow16(m_row.data(), m_sum.data(), n);
+	}
+	Normalize(m_sum.data(), m_cache[slot].data(), n, m_kx + m_ky);
+	m_cached[slot] = row;
+	return m_cache[slot].data();
+}
+
+void PlaneScaler::Scale(const uint8_t * src, int src_pitch, int src_width, int src_height, int comps,
+		uint8_t * dst, int dst_pitch, int dst_width, int dst_height, int dst_step){
+	if (src_width <= 0 || src_height <= 0 || dst_width <= 0 || dst_height <= 0)
+		return;
+	if (src_width != m_src_width || src_height != m_src_height || dst_width != m_dst_width ||
+			dst_height != m_dst_height || comps != m_comps)
+		Setup(src_width, src_height, dst_width, dst_height, comps);
+	m_cached[0] = m_cached[1] = -1;
+	int n = m_width * comps;
+	for (int y = 0; y < dst_height; y++){
+		int pos = SourcePosition(y, m_height, dst_height);
+		int r0 = pos >> 8;
+		int weight = pos & 0xFF;
+		const uint8_t * line = Prefiltered(src, src_pitch, r0);
+		if (weight && r0 + 1 < m_height){
+			LerpRows(line, Prefiltered(src, src_pitch, r0 + 1), m_line.data(), n, weight);
+			line = m_line.data();
+		}
+		uint8_t * out = dst + y * dst_pitch;
+		if (m_width == dst_width && dst_step == comps){
+			memcpy(out, line, n);
+		}else if (m_width == dst_width){
+			for (int x = 0; x < dst_width; x++)
+				out[x * dst_step] = line[x];
+		}else if (comps == 1){
+			LerpTaps<1>(line, out, dst_width, dst_step, m_x0.data(), m_x1.data(), m_wx.data());
+		}else{
+			LerpTaps<2>(line, out, dst_width, dst_step, m_x0.data(), m_x1.data(), m_wx.data());
+		}
+	}
+}
+
+struct Compositor::Tile{
+	Compositor * owner = nullptr;
+	int index = 0;
+	int x = 0;
+	int y = 0;
+	int width = 0;
+	int height = 0;
+	std::mutex mutex;
+	Canvas * canvas = nullptr;	// where the next frame goes
+	Canvas * latest = nullptr;	// holds the last frame, nullptr while the tile is blank
+	uint64_t frame = 0;			// frames scaled so far, 0 is blank
+	bool fresh = false;			// scaled since the last Compose
+	bool warned = false;
+	PlaneScaler luma;
+	PlaneScaler chroma[2];
+};
+
+static int SurfacePitch(const mfxFrameSurface1 * surface){
+	return ((int)surface->Data.PitchHigh << 16) | surface->Data.PitchLow;
+}
+
+Compositor::~Compositor(){
+	Close();
+}
+
+bool Compositor::Open(VideoEncoder * encoder, const CompositorParams & params){
+	Close();
+	if (!encoder || params.columns <= 0 || params.rows <= 0)
+		return false;
+	const VideoParams & video = encoder->GetParams();
+	if (SurfaceFourCC(video.chroma_format, video.bit_depth) != MFX_FOURCC_NV12){
+		printf("compositor needs an initialised 8 bit 4:2:0 encoder\n");
+		return false;
+	}
+	mfxFrameSurface1 * surface = encoder->AcquireSurface();
+	if (!surface)
+		return false;
+	m_encoder = encoder;
+	// even tile edges keep the 4:2:0 chroma of neighbours apart
+	int width = video.width & ~1;
+	int height = video.height & ~1;
+	for (int r = 0; r < params.rows; r++){
+		for (int c = 0; c < params.columns; c++){
+			Tile * tile = new Tile();
+			tile->owner = this;
+			tile->index = (int)m_tiles.size();
+			tile->x = (c * width / params.columns) & ~1;
+			tile->y = (r * height / params.rows) & ~1;
+			tile->width = ((c + 1) * width / params.columns & ~1) - tile->x;
+			tile->height = ((r + 1) * height / params.rows & ~1) - tile->y;
+			m_tiles.push_back(tile);
+		}
+	}
+	m_canvas = FindCanvas(surface);
+	for (auto tile : m_tiles)
+		tile->canvas = m_canvas;
+	m_canvas_count = 0;
+	m_frame_count = 0;
+	m_replaced = 0;
+	m_rejected = 0;
+	m_stale_skipped = 0;
+	m_stale_copied = 0;
+	m_scale_us = 0;
+	m_compose_us = 0;
+	return true;
+}
+
+void * Compositor::TileUserData(int tile){
+	return tile >= 0 && tile < Tiles() ? m_tiles[tile] : nullptr;
+}
+
+void Compositor::FrameCB(VideoRawData *data, void * user_data){
+	Tile * tile = (Tile*)user_data;
+	if (tile)
+		tile->owner->PutFrame(tile->index, *data);
+}
+
+Compositor::Canvas * Compositor::FindCanvas(mfxFrameSurface1 * surface){
+	for (auto canvas : m_canvases){
+		if (canvas->surface == surface)
+			return canvas;
+	}
+	Canvas * canvas = new Canvas();
+	canvas->surface = surface;
+	canvas->tile_frame.assign(m_tiles.size(), CANVAS_UNKNOWN);
+	m_canvases.push_back(canvas);
+	return canvas;
+}
+
+bool Compositor::PutFrame(int index, const VideoRawData & pic){
+	if (index < 0 || index >= Tiles())
+		return false;
+	Tile & tile = *m_tiles[index];
+	std::lock_guard<std::mutex> lock(tile.mutex);
+	if ((pic.fmt != VideoBaseBandFmt::YUV420P && pic.fmt != VideoBaseBandFmt::NV12) || pic.width <= 0 || pic.height <= 0){
+		if (!tile.warned)
+			printf("compositor tile %d: source is not 8 bit 4:2:0\n", index);
+		tile.warned = true;
+		m_rejected++;
+		return false;
+	}
+	Clock::time_point begin = Clock::now();
+	mfxFrameSurface1 * surface = tile.canvas->surface;
+	int pitch = SurfacePitch(surface);
+	mfxU8 * luma = surface->Data.Y + tile.y * pitch + tile.x;
+	mfxU8 * chroma = surface->Data.UV + (tile.y >> 1) * pitch + tile.x;
+	int chroma_width = (pic.width + 1) >> 1;
+	int chroma_height = (pic.height + 1) >> 1;
+	tile.luma.Scale(pic.buffer[0], pic.line_size[0], pic.width, pic.height, 1,
+			luma, pitch, tile.width, tile.height, 1);
+	if (pic.fmt == VideoBaseBandFmt::NV12){
+		tile.chroma[0].Scale(pic.buffer[1], pic.line_size[1], chroma_width, chroma_height, 2,
+				chroma, pitch, tile.width >> 1, tile.height >> 1, 2);
+	}else{
+		tile.chroma[0].Scale(pic.buffer[1], pic.line_size[1], chroma_width, chroma_height, 1,
+				chroma, pitch, tile.width >> 1, tile.height >> 1, 2);
+		tile.chroma[1].Scale(pic.buffer[2], pic.line_size[2], chroma_width, chroma_height, 1,
+				chroma + 1, pitch, tile.width >> 1, tile.height >> 1, 2);
+	}
+	tile.canvas->tile_frame[index] = ++tile.frame;
+	tile.latest = tile.canvas;
+	if (tile.fresh)
+		m_replaced++;
+	tile.fresh = true;
+	m_frame_count++;
+	m_scale_us += std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - begin).count();
+	return true;
+}
+
+// brings the tile of canvas up to the tile's last frame, black while it has none
+void Compositor::RefreshTile(Tile & tile, Canvas * canvas){
+	mfxFrameSurface1 * dst = canvas->surface;
+	int pitch = SurfacePitch(dst);
+	for (int y = 0; y < tile.height; y++){
+		mfxU8 * luma = dst->Data.Y + (tile.y + y) * pitch + tile.x;
+		if (tile.latest)
+			memcpy(luma, tile.latest->surface->Data.Y + (tile.y + y) * pitch + tile.x, tile.width);
+		else
+			memset(luma, 16, tile.width);
+	}
+	for (int y = 0; y < tile.height >> 1; y++){
+		mfxU8 * chroma = dst->Data.UV + ((tile.y >> 1) + y) * pitch + tile.x;
+		if (tile.latest)
+			memcpy(chroma, tile.latest->surface->Data.UV + ((tile.y >> 1) + y) * pitch + tile.x, tile.width);
+		else
+			memset(chroma, 128, tile.width);
+	}
+	canvas->tile_frame[tile.index] = tile.frame;
+}
+
+bool Compositor::Compose(int64_t pts, VideoBitStream & stream, const VideoEncodeCtrl * ctrl){
+	if (!m_encoder || !m_canvas)
+		return false;
+	Clock::time_point begin = Clock::now();
+	mfxFrameSurface1 * surface = m_encoder->AcquireSurface();
+	if (!surface)
+		return false;
+	Canvas * next = FindCanvas(surface);
+	Canvas * canvas = m_canvas;
+	// one tile at a time, the other sources keep scaling
+	for (auto tile : m_tiles){
+		std::lock_guard<std::mutex> lock(tile->mutex);
+		if (canvas->tile_frame[tile->index] != tile->frame){
+			RefreshTile(*tile, canvas);
+			m_stale_copied++;
+		}else if (!tile->fresh)
+			m_stale_skipped++;
+		tile->fresh = false;
+		tile->canvas = next;
+	}
+	m_canvas = next;
+	m_canvas_count++;
+	m_compose_us += std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - begin).count();
+	return m_encoder->EncodeSurface(canvas->surface, pts, stream, ctrl);
+}
+
+void Compositor::Close(){
+	if (m_encoder && m_canvas)
+		m_encoder->ReleaseSurface(m_canvas->surface);
+	for (auto tile : m_tiles)
+		delete tile;
+	m_tiles.clear();
+	for (auto canvas : m_canvases)
+		delete canvas;
+	m_canvases.clear();
+	m_canvas = nullptr;
+	m_encoder = nullptr;
+}
+
+void Compositor::GetStats(CompositorStats & stats){
+	stats.canvases = m_canvas_count;
+	stats.frames = m_frame_count;
+	stats.replaced = m_replaced;
+	stats.rejected = m_rejected;
+	stats.stale_skipped = m_stale_skipped;
+	stats.stale_copied = m_stale_copied;
+	stats.scale_us = m_scale_us;
+	stats.compose_us = m_compose_us;
+}
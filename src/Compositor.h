@@ -0,0 +1,79 @@
+#ifndef _H_COMPOSITOR_
+#define _H_COMPOSITOR_
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#include "Def.h"
+#include "VideoEncoder.h"
+
+struct CompositorParams{
+	int columns = 4;
+	int rows = 4;
+};
+
+struct CompositorStats{
+	uint64_t canvases = 0;		// composed and handed to the encoder
+	uint64_t frames = 0;		// source frames scaled into a tile
+	uint64_t replaced = 0;		// scaled frames overwritten by a newer one before their canvas went out
+	uint64_t rejected = 0;		// source frames the scaler does not take
+	uint64_t stale_skipped = 0;	// tiles without a new frame that the canvas already held
+	uint64_t stale_copied = 0;	// tiles without a new frame copied over from the surface holding it, or blanked
+	int64_t scale_us = 0;		// summed over the source threads
+	int64_t compose_us = 0;		// Compose up to the encoder submit
+};
+
+/*
+Video wall compositor on top of a VideoEncoder. The encoder frame is split
+into a columns x rows grid, tile i belongs to source i (a decoder's frame
+callback). Sources downscale their frames straight into the pooled encoder
+surface that is being filled, on their own threads and under a lock of their
+own tile only, so tiles scale in parallel. Compose hands that surface to the
+encoder and moves every tile on to the next pooled surface: a tile whose
+source sent nothing since is skipped when that surface still holds its last
+frame, otherwise only the tile is copied over. There is no full frame buffer
+besides the encoder's surfaces.
+Sources are 8 bit 4:2:0 (YUV420P or NV12), the encoder must be 8 bit 4:2:0.
+Compose and Close belong to one thread, the encoder is only touched by it.
+*/
+class Compositor {
+public:
+	Compositor() = default;
+	~Compositor();
+	bool Open(VideoEncoder * encoder, const CompositorParams & params = CompositorParams());
+	int Tiles() const { return (int)m_tiles.size(); }
+	// SetFrameCB(Compositor::FrameCB, TileUserData(i)) feeds a decoder into tile i, row major
+	void * TileUserData(int tile);
+	static void FrameCB(VideoRawData *data, void * user_data);
+	// replaces the tile's picture for the next Compose
+	bool PutFrame(int tile, const VideoRawData & pic);
+	// encodes the canvas as it stands, stream as from VideoEncoder::EncodeSync
+	bool Compose(int64_t pts, VideoBitStream & stream, const VideoEncodeCtrl * ctrl = nullptr);
+	// gives the surface being filled back, before the encoder closes
+	void Close();
+	void GetStats(CompositorStats & stats);
+private:
+	struct Canvas{
+		mfxFrameSurface1 * surface = nullptr;
+		std::vector<uint64_t> tile_frame;	// frame number each tile holds, CANVAS_UNKNOWN before it was written
+	};
+	struct Tile;
+	Canvas * FindCanvas(mfxFrameSurface1 * surface);
+	void RefreshTile(Tile & tile, Canvas * canvas);
+private:
+	VideoEncoder * m_encoder = nullptr;
+	std::vector<Tile*> m_tiles;
+	std::vector<Canvas*> m_canvases;	// one per encoder surface seen, only used by Compose
+	Canvas * m_canvas = nullptr;		// surface being filled
+private:
+	std::atomic<uint64_t> m_canvas_count{0};
+	std::atomic<uint64_t> m_frame_count{0};
+	std::atomic<uint64_t> m_replaced{0};
+	std::atomic<uint64_t> m_rejected{0};
+	std::atomic<uint64_t> m_stale_skipped{0};
+	std::atomic<uint64_t> m_stale_copied{0};
+	std::atomic<int64_t> m_scale_us{0};
+	std::atomic<int64_t> m_compose_us{0};
+};
+#endif
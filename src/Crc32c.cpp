@@ -0,0 +1,165 @@
+#include <string.h>
+
+#include "Crc32c.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_HW 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78
+// rows shorter than three lanes of this many bytes are not split
+#define CRC32C_MIN_LANE 64
+
+struct Crc32cTable{
+	uint32_t t[8][256];
+	Crc32cTable(){
+		for (uint32_t i = 0; i < 256; i++){
+			uint32_t crc = i;
+			for (int k = 0; k < 8; k++)
+				crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+			t[0][i] = crc;
+		}
+		for (int k = 1; k < 8; k++){
+			for (int i = 0; i < 256; i++)
+				t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+		}
+	}
+};
+
+static const Crc32cTable & Table(){
+	static const Crc32cTable table;
+	return table;
+}
+
+/*
+the Update* functions advance the raw crc register, the pre and post inversion
+of the standard checksum is left to the callers
+*/
+static uint32_t UpdateTable(uint32_t crc, const uint8_t * p, size_t len){
+	const Crc32cTable & tab = Table();
+	// little endian loads
+	while (len >= 8){
+		uint64_t v;
+		memcpy(&v, p, 8);
+		v ^= crc;
+		crc = tab.t[7][v & 0xFF] ^ tab.t[6][(v >> 8) & 0xFF] ^ tab.t[5][(v >> 16) & 0xFF] ^ tab.t[4][(v >> 24) & 0xFF] ^
+				tab.t[3][(v >> 32) & 0xFF] ^ tab.t[2][(v >> 40) & 0xFF] ^ tab.t[1][(v >> 48) & 0xFF] ^ tab.t[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = tab.t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef CRC32C_HW
+__attribute__((target("sse4.2")))
+static uint32_t UpdateHw(uint32_t crc, const uint8_t * p, size_t len){
+	uint64_t c = crc;
+	while (len >= 8){
+		uint64_t v;
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	uint32_t c32 = (uint32_t)c;
+	while (len--)
+		c32 = _mm_crc32_u8(c32, *p++);
+	return c32;
+}
+
+// three independent chains, len is a multiple of 8
+__attribute__((target("sse4.2")))
+static void UpdateHw3(uint32_t & a, uint32_t & b, uint32_t & c, const uint8_t * p, size_t len){
+	uint64_t ca = a;
+	uint64_t cb = b;
+	uint64_t cc = c;
+	for (size_t i = 0; i < len; i += 8){
+		uint64_t va;
+		uint64_t vb;
+		uint64_t vc;
+		memcpy(&va, p + i, 8);
+		memcpy(&vb, p + len + i, 8);
+		memcpy(&vc, p + 2 * len + i, 8);
+		ca = _mm_crc32_u64(ca, va);
+		cb = _mm_crc32_u64(cb, vb);
+		cc = _mm_crc32_u64(cc, vc);
+	}
+	a = (uint32_t)ca;
+	b = (uint32_t)cb;
+	c = (uint32_t)cc;
+}
+#endif
+
+static bool HasHw(){
+#ifdef CRC32C_HW
+	static const bool hw = __builtin_cpu_supports("sse4.2");
+	return hw;
+#else
+	return false;
+#endif
+}
+
+static uint32_t UpdateCrc(uint32_t crc, const uint8_t * p, size_t len){
+#ifdef CRC32C_HW
+	if (HasHw())
+		return UpdateHw(crc, p, len);
+#endif
+	return UpdateTable(crc, p, len);
+}
+
+uint32_t Crc32c(uint32_t crc, const void * data, size_t len){
+	return ~UpdateCrc(~crc, (const uint8_t*)data, len);
+}
+
+void Crc32cRows::Reset(size_t row_bytes){
+	m_row_bytes = row_bytes;
+	m_crc = 0xFFFFFFFF;
+	m_lane_bytes = HasHw() && row_bytes >= 3 * CRC32C_MIN_LANE ? (row_bytes / 3) & ~(size_t)7 : 0;
+	if (!m_lane_bytes || m_lane_bytes == m_table_lane_bytes)
+		return;
+
+	// the register update over zeros is linear, tabulate it per byte of the crc
+	static const uint8_t zeros[256] = {0};
+	uint32_t basis[32];
+	for (int i = 0; i < 32; i++){
+		uint32_t crc = 1u << i;
+		for (size_t done = 0; done < m_lane_bytes; done += sizeof(zeros)){
+			size_t n = m_lane_bytes - done < sizeof(zeros) ? m_lane_bytes - done : sizeof(zeros);
+			crc = UpdateCrc(crc, zeros, n);
+		}
+		basis[i] = crc;
+	}
+	for (int k = 0; k < 4; k++){
+		m_shift[k][0] = 0;
+		for (int b = 1; b < 256; b++){
+			int low = __builtin_ctz(b);
+			m_shift[k][b] = m_shift[k][b & (b - 1)] ^ basis[k * 8 + low];
+		}
+	}
+	m_table_lane_bytes = m_lane_bytes;
+}
+
+uint32_t Crc32cRows::Shift(uint32_t crc) const{
+	return m_shift[0][crc & 0xFF] ^ m_shift[1][(crc >> 8) & 0xFF] ^
+			m_shift[2][(crc >> 16) & 0xFF] ^ m_shift[3][crc >> 24];
+}
+
+void Crc32cRows::Update(const void * row){
+	const uint8_t * p = (const uint8_t*)row;
+	if (!m_lane_bytes){
+		m_crc = UpdateCrc(m_crc, p, m_row_bytes);
+		return;
+	}
+#ifdef CRC32C_HW
+	// head | lane a | lane b | lane c, the head carries the remainder of the split
+	size_t head = m_row_bytes - 3 * m_lane_bytes;
+	uint32_t a = UpdateHw(m_crc, p, head);
+	uint32_t b = 0;
+	uint32_t c = 0;
+	UpdateHw3(a, b, c, p + head, m_lane_bytes);
+	m_crc = Shift(Shift(a) ^ b) ^ c;
+#endif
+}
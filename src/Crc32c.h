@@ -0,0 +1,35 @@
+#ifndef _H_CRC32C_
+#define _H_CRC32C_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+CRC32C (Castagnoli) with the sse4.2 crc32 instruction when the cpu has it and
+a slicing-by-8 table otherwise. Crc32c(0, data, len) is the standard checksum,
+passing the previous result back in continues it over the next piece.
+*/
+uint32_t Crc32c(uint32_t crc, const void * data, size_t len);
+
+/*
+Crc32c over rows of equal length fed one at a time, the same value as one
+Crc32c call over the rows concatenated. Long rows are split into three
+interleaved streams so the crc32 instruction runs at its throughput rather
+than its latency, the streams are joined with a shift table built by Reset.
+Reset with the same length keeps the table.
+*/
+class Crc32cRows {
+public:
+	void Reset(size_t row_bytes);
+	void Update(const void * row);
+	uint32_t Value() const { return ~m_crc; }
+private:
+	uint32_t Shift(uint32_t crc) const;
+private:
+	size_t m_row_bytes = 0;
+	size_t m_lane_bytes = 0;	// 0: rows are too short to split
+	size_t m_table_lane_bytes = 0;
+	uint32_t m_crc = 0xFFFFFFFF;
+	uint32_t m_shift[4][256];	// advances a crc over m_lane_bytes zero bytes
+};
+#endif
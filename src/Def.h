@@ -25,7 +25,21 @@ enum class VideoBaseBandFmt{
 	YUV420P,
 	YUV420P10LE,
 	NV12,
-	P010LE
+	P010LE,
+	YUV422P,
+	YUV422P10LE,
+	YUV444P,
+	YUV444P10LE,
+	P210,	// 16 bit semi-planar 4:2:2, msb aligned
+	Y210,	// 16 bit packed Y0 U Y1 V, msb aligned
+	AYUV,	// 8 bit packed V U Y A
+	Y410	// 32 bit packed U:10 Y:10 V:10 A:2
+};
+
+enum class VideoChromaFormat{
+	YUV420,
+	YUV422,
+	YUV444
 };
 
 struct VideoParams{
@@ -37,7 +51,18 @@ struct VideoParams{
 	int gop_size = 0;
 	int b_frames = 0;
 	int bit_rate = 0;
+	int qp = 0;				// > 0 selects constant qp rate control, per-frame qp needs it
 	int bit_depth = 8;
+	VideoChromaFormat chroma_format = VideoChromaFormat::YUV420;
+};
+
+// luma analytics of a frame, filled when frame statistics are on (see LumaStats)
+struct VideoFrameStats{
+	uint32_t histogram[256];	// 8 bit bins, deeper samples are binned by their top 8 bits
+	double mean = 0;			// luma, on the 8 bit scale whatever the bit depth
+	double variance = 0;
+	bool has_sad = false;		// false for the first frame and after a size change
+	double sad = 0;				// mean absolute luma difference per pixel to the previous frame, 8 bit scale
 };
 
 struct VideoRawData{
@@ -47,11 +72,28 @@ struct VideoRawData{
 	VideoBaseBandFmt fmt = VideoBaseBandFmt::NONE;
 	int64_t pts = 0;
 	unsigned char * buffer[3] = {0};
+	uint32_t hash[3] = {0};		// per plane crc32c, filled when frame hashing is on (see FrameHash)
+	const VideoFrameStats * stats = nullptr;	// only valid during the frame callback
+};
+
+enum VideoEncodeCtrlFlag{
+	VIDEO_CTRL_IDR = 1,
+	VIDEO_CTRL_QP = 2,
+	VIDEO_CTRL_NON_REFERENCE = 4
+};
+
+// per-frame overrides for EncodeSync, fields left at the default leave the frame to the encoder
+struct VideoEncodeCtrl{
+	bool force_idr = false;
+	int qp = 0;					// 1..51
+	bool non_reference = false;	// no later frame predicts from this one (RejectedRefList of the next frame), needs b_frames 1
 };
 
 struct VideoBitStream {
 	mfxBitstream *mfx_bit_stream = nullptr;
 	mfxSyncPoint * sync_p = nullptr;
+	uint32_t ctrl_requested = 0;	// VIDEO_CTRL_* asked for the frame in this packet
+	uint32_t ctrl_honoured = 0;		// the requested flags the coded frame shows
 };
 
 struct MFXSurface {
@@ -61,6 +103,7 @@ struct MFXSurface {
 };
 
 typedef void(*VideoFrameCB)(VideoRawData *data, void * user_data);
+typedef void(*VideoPacketCB)(VideoBitStream *stream, void * user_data);
 
 
 #endif /* SRC_DEF_H_ */
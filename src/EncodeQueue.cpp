@@ -0,0 +1,258 @@
+#include "EncodeQueue.h"
+#include "PixelFormat.h"
+
+EncodeQueue::~EncodeQueue(){
+	Close();
+}
+
+bool EncodeQueue::Open(VideoEncoder * encoder, const EncodeQueueParams & params){
+	Close();
+	if (!encoder)
+		return false;
+	m_encoder = encoder;
+	m_params = params;
+	if (m_params.depth < 1)
+		m_params.depth = 1;
+	if (m_params.max_frame_interval < 1)
+		m_params.max_frame_interval = 1;
+	// VideoParams::b_frames is handed to the sdk as GopRefDist
+	const VideoParams & video = encoder->GetParams();
+	m_gop_size = video.gop_size;
+	m_ref_dist = video.b_frames > 1 ? video.b_frames : 1;
+
+	m_stats = EncodeQueueStats();
+	m_latency_sum_us = 0;
+	m_sent = 0;
+	m_input = 0;
+	m_calm = 0;
+	m_encoding = 0;
+	m_carry_idr = false;
+	m_running = true;
+	m_thread = std::thread(&EncodeQueue::WorkThread, this);
+	return true;
+}
+
+void EncodeQueue::SetPacketCB(VideoPacketCB cb, void * user_data){
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_packet_cb = cb;
+	m_user_data = user_data;
+}
+
+bool EncodeQueue::IsKeyFrame(uint64_t position) const{
+	return m_gop_size > 0 ? position % m_gop_size == 0 : position == 0;
+}
+
+/*
+predicted from the gop the encoder was opened with, position is the frame's
+index among the frames handed to the encoder
+*/
+bool EncodeQueue::IsNonReference(uint64_t position) const{
+	if (m_ref_dist <= 1 || IsKeyFrame(position))
+		return false;
+	uint64_t in_gop = m_gop_size > 0 ? position % m_gop_size : position;
+	return in_gop % m_ref_dist != 0;
+}
+
+void EncodeQueue::Release(Frame * frame){
+	if (frame->ctrl.force_idr)
+		m_carry_idr = true;
+	m_free.push_back(frame);
+	m_stats.dropped++;
+}
+
+/*
+makes room for one frame under a full queue, false when Push has to wait (BLOCK)
+*/
+bool EncodeQueue::DropForOverflow(){
+	switch(m_params.policy){
+		case QueuePolicy::DROP_NON_REFERENCE:{
+			// newest predicted B frame first, then the oldest frame that does not start a gop
+			for (size_t i = m_queue.size(); i-- > 0;){
+				const VideoEncodeCtrl & ctrl = m_queue[i]->ctrl;
+				if (!ctrl.force_idr && (ctrl.non_reference || IsNonReference(m_sent + i))){
+					Release(m_queue[i]);
+					m_queue.erase(m_queue.begin() + i);
+					m_stats.dropped_non_reference++;
+					return true;
+				}
+			}
+			for (size_t i = 0; i < m_queue.size(); i++){
+				if (!IsKeyFrame(m_sent + i) && !m_queue[i]->ctrl.force_idr){
+					Release(m_queue[i]);
+					m_queue.erase(m_queue.begin() + i);
+					m_stats.dropped_non_reference++;
+					return true;
+				}
+			}
+			Release(m_queue.front());
+			m_queue.pop_front();
+			m_stats.dropped_oldest++;
+			return true;
+		}
+		case QueuePolicy::DEGRADE:
+			if (m_stats.frame_interval < m_params.max_frame_interval){
+				m_stats.frame_interval *= 2;
+				if (m_stats.frame_interval > m_params.max_frame_interval)
+					m_stats.frame_interval = m_params.max_frame_interval;
+			}
+			m_calm = 0;
+			Release(m_queue.front());
+			m_queue.pop_front();
+			m_stats.dropped_oldest++;
+			return true;
+		case QueuePolicy::DROP_OLDEST:
+			Release(m_queue.front());
+			m_queue.pop_front();
+			m_stats.dropped_oldest++;
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool EncodeQueue::Push(const VideoRawData & pic, const VideoEncodeCtrl * ctrl){
+	int size = RawFrameSize(pic.fmt, pic.width, pic.height);
+	if (size <= 0)
+		return false;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (!m_running)
+		return false;
+	m_stats.submitted++;
+	if (m_params.policy == QueuePolicy::DEGRADE && (m_input++ % m_stats.frame_interval) != 0){
+		if (ctrl && ctrl->force_idr)
+			m_carry_idr = true;
+		m_stats.degraded++;
+		m_stats.dropped++;
+		return true;
+	}
+	if ((int)m_queue.size() >= m_params.depth && !DropForOverflow()){
+		m_cond.wait(lock, [this]{ return !m_running || (int)m_queue.size() < m_params.depth; });
+		if (!m_running)
+			return false;
+	}
+
+	Frame * frame = nullptr;
+	if (!m_free.empty()){
+		frame = m_free.back();
+		m_free.pop_back();
+	}else
+		frame = new Frame();
+	lock.unlock();
+	// the copy runs outside the lock, the worker keeps encoding meanwhile
+	frame->pic = VideoRawData();
+	frame->pic.width = pic.width;
+	frame->pic.height = pic.height;
+	frame->pic.fmt = pic.fmt;
+	frame->pic.pts = pic.pts;
+	frame->ctrl = ctrl ? *ctrl : VideoEncodeCtrl();
+	frame->data.resize(size);
+	SetRawPlanes(frame->pic, frame->data.data());
+	bool ok = CopyRawFrame(pic, frame->pic);
+	frame->queued = std::chrono::steady_clock::now();
+	lock.lock();
+	if (!ok || !m_running){
+		m_free.push_back(frame);
+		return false;
+	}
+	// another producer may have filled the queue while this one copied
+	if ((int)m_queue.size() >= m_params.depth && !DropForOverflow()){
+		m_cond.wait(lock, [this]{ return !m_running || (int)m_queue.size() < m_params.depth; });
+		if (!m_running){
+			m_free.push_back(frame);
+			return false;
+		}
+	}
+	m_queue.push_back(frame);
+	if ((int)m_queue.size() > m_stats.max_queue_depth)
+		m_stats.max_queue_depth = m_queue.size();
+	m_cond.notify_all();
+	return true;
+}
+
+void EncodeQueue::WorkThread(){
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true){
+		m_cond.wait(lock, [this]{ return !m_running || !m_queue.empty(); });
+		if (m_queue.empty())
+			break;
+		Frame * frame = m_queue.front();
+		m_queue.pop_front();
+		m_sent++;
+		m_encoding = 1;
+		if (m_carry_idr){
+			frame->ctrl.force_idr = true;
+			m_carry_idr = false;
+		}
+		auto now = std::chrono::steady_clock::now();
+		int64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(now - frame->queued).count();
+		m_latency_sum_us += latency;
+		if (latency > m_stats.max_queue_latency_us)
+			m_stats.max_queue_latency_us = latency;
+		// wakes a blocked Push as soon as the slot is free, not after the encode
+		m_cond.notify_all();
+		VideoPacketCB cb = m_packet_cb;
+		void * user_data = m_user_data;
+		lock.unlock();
+
+		VideoBitStream stream;
+		bool ok = m_encoder->EncodeSync(frame->pic, stream, &frame->ctrl);
+		bool packet = ok && stream.mfx_bit_stream && stream.mfx_bit_stream->DataLength;
+		if (packet && cb)
+			cb(&stream, user_data);
+
+		lock.lock();
+		if (ok)
+			m_stats.encoded++;
+		else
+			m_stats.encode_errors++;
+		if (packet)
+			m_stats.packets++;
+		m_stats.busy_retries = m_encoder->GetBusyRetries();
+		m_free.push_back(frame);
+		// DEGRADE: back to a higher rate once the encoder kept up for a queue's worth of frames
+		if (m_stats.frame_interval > 1){
+			if (m_queue.empty() && ++m_calm >= m_params.depth){
+				m_stats.frame_interval /= 2;
+				m_calm = 0;
+			}else if (!m_queue.empty())
+				m_calm = 0;
+		}
+		m_encoding = 0;
+		m_cond.notify_all();
+	}
+}
+
+void EncodeQueue::Flush(){
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_cond.wait(lock, [this]{ return !m_running || (m_queue.empty() && m_encoding == 0); });
+}
+
+void EncodeQueue::Close(){
+	if (m_thread.joinable()){
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_running = false;
+			m_cond.notify_all();
+		}
+		m_thread.join();
+	}
+	m_running = false;
+	m_encoder = nullptr;
+
+	for (auto frame : m_queue)
+		delete frame;
+	m_queue.clear();
+	for (auto frame : m_free)
+		delete frame;
+	m_free.clear();
+}
+
+void EncodeQueue::GetStats(EncodeQueueStats & stats){
+	std::lock_guard<std::mutex> lock(m_mutex);
+	stats = m_stats;
+	stats.queue_depth = m_queue.size();
+	stats.queue_latency_us = m_queue.empty() ? 0 : std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - m_queue.front()->queued).count();
+	uint64_t started = m_sent;
+	stats.avg_queue_latency_us = started ? m_latency_sum_us / (int64_t)started : 0;
+}
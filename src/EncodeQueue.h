@@ -0,0 +1,97 @@
+#ifndef _H_ENCODEQUEUE_
+#define _H_ENCODEQUEUE_
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Def.h"
+#include "VideoEncoder.h"
+
+enum class QueuePolicy{
+	BLOCK,				// Push waits for a free slot, the caller absorbs the overload
+	DROP_OLDEST,		// the oldest queued frame makes room
+	DROP_NON_REFERENCE,	// frames that would be coded as B go first, GOP starts are kept
+	DEGRADE				// the input frame rate is halved until the queue drains
+};
+
+struct EncodeQueueParams{
+	int depth = 4;					// frames waiting for the encoder, bounds the added latency
+	QueuePolicy policy = QueuePolicy::BLOCK;
+	int max_frame_interval = 8;		// DEGRADE: keep at least 1 of this many input frames
+};
+
+struct EncodeQueueStats{
+	uint64_t submitted = 0;			// frames given to Push
+	uint64_t encoded = 0;
+	uint64_t packets = 0;
+	uint64_t encode_errors = 0;
+	uint64_t busy_retries = 0;		// encoder found the device busy and slept before retrying
+	uint64_t dropped = 0;			// all frames that never reached the encoder
+	uint64_t dropped_oldest = 0;
+	uint64_t dropped_non_reference = 0;
+	uint64_t degraded = 0;			// skipped by the lowered frame rate
+	int queue_depth = 0;
+	int max_queue_depth = 0;
+	int frame_interval = 1;			// DEGRADE: 1 of every frame_interval input frames is queued
+	int64_t queue_latency_us = 0;	// age of the oldest frame still waiting
+	int64_t avg_queue_latency_us = 0;	// Push() to the start of its encode
+	int64_t max_queue_latency_us = 0;
+};
+
+/*
+Bounded input queue in front of a VideoEncoder for live channels.
+Push() copies the frame and returns, a worker thread feeds the encoder and
+hands every packet to the packet callback. When the encoder falls behind the
+policy decides what happens to new frames, so the worst-case latency stays
+at depth frames instead of growing without bound.
+*/
+class EncodeQueue {
+public:
+	EncodeQueue() = default;
+	~EncodeQueue();
+	bool Open(VideoEncoder * encoder, const EncodeQueueParams & params = EncodeQueueParams());
+	void SetPacketCB(VideoPacketCB cb, void * user_data);
+	bool Push(const VideoRawData & pic, const VideoEncodeCtrl * ctrl = nullptr);
+	void Flush();
+	void Close();
+	void GetStats(EncodeQueueStats & stats);
+private:
+	struct Frame{
+		std::vector<unsigned char> data;
+		VideoRawData pic;
+		VideoEncodeCtrl ctrl;
+		std::chrono::steady_clock::time_point queued;
+	};
+	void WorkThread();
+	bool IsKeyFrame(uint64_t position) const;
+	bool IsNonReference(uint64_t position) const;
+	bool DropForOverflow();
+	void Release(Frame * frame);
+private:
+	VideoEncoder * m_encoder = nullptr;
+	EncodeQueueParams m_params;
+	int m_gop_size = 0;
+	int m_ref_dist = 1;
+	VideoPacketCB m_packet_cb = nullptr;
+	void * m_user_data = nullptr;
+private:
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<Frame*> m_queue;
+	std::vector<Frame*> m_free;
+	uint64_t m_sent = 0;		// frames handed to the encoder, the gop position of m_queue.front()
+	uint64_t m_input = 0;		// frames seen by Push, for the DEGRADE decimation
+	int m_calm = 0;				// DEGRADE: encodes in a row that left the queue empty
+	int m_encoding = 0;
+	bool m_carry_idr = false;	// a dropped frame asked for an IDR, the next encoded frame takes it over
+	bool m_running = false;
+	EncodeQueueStats m_stats;
+	int64_t m_latency_sum_us = 0;
+};
+#endif
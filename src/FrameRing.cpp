@@ -0,0 +1,559 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+
+#include "FrameRing.h"
+#include "PixelFormat.h"
+
+#define FRAME_RING_MAGIC 0x474E5246	// "FRNG"
+#define FRAME_RING_VERSION 1
+#define FRAME_RING_ALIGN(X) (((X) + 63) & ~(size_t)63)
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+		"the ring header is shared between processes, its atomics must not take a lock");
+
+typedef std::chrono::steady_clock Clock;
+
+enum ReaderState{
+	READER_FREE = 0,
+	READER_ATTACHING = 1,
+	READER_ATTACHED = 2
+};
+
+/*
+shared layout: header, then slots of FrameRingSlot followed by the planes.
+fields the writer and the readers both touch are atomics, each reader entry
+has its own cache line so readers do not share lines with each other.
+*/
+struct alignas(64) FrameRingReaderEntry{
+	std::atomic<uint32_t> state;
+	std::atomic<int32_t> pid;
+	std::atomic<uint32_t> waiting;		// reader is about to sleep on its eventfd
+	std::atomic<uint64_t> read_seq;		// next frame the reader will take, owned by the reader
+	std::atomic<uint64_t> frames;
+	std::atomic<uint64_t> dropped;
+	std::atomic<uint64_t> max_lag;		// owned by the writer
+};
+
+struct FrameRingHeader{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t max_readers;
+	uint32_t policy;
+	uint64_t slot_bytes;
+	uint64_t slot_stride;
+	uint64_t slot_offset;
+	alignas(64) std::atomic<uint64_t> write_seq;	// frames published
+	std::atomic<uint32_t> writer_waiting;
+	std::atomic<uint32_t> closed;
+	FrameRingReaderEntry readers[FRAME_RING_MAX_READERS];
+};
+
+struct FrameRingSlot{
+	std::atomic<uint64_t> seq;	// frame number + 1 once published, 0 while it is written
+	int32_t width;
+	int32_t height;
+	int32_t fmt;
+	int64_t pts;
+	uint32_t hash[3];
+	uint32_t has_stats;
+	VideoFrameStats stats;
+};
+
+static FrameRingSlot * SlotAt(unsigned char * map, const FrameRingHeader * header, uint64_t seq){
+	return (FrameRingSlot*)(map + header->slot_offset + (seq % header->slots) * header->slot_stride);
+}
+
+static unsigned char * SlotData(FrameRingSlot * slot){
+	return (unsigned char*)slot + FRAME_RING_ALIGN(sizeof(FrameRingSlot));
+}
+
+// an exited reader stays a zombie until its parent reaps it, kill alone still finds it
+static bool ProcessGone(int pid){
+	if (kill(pid, 0) < 0 && errno == ESRCH)
+		return true;
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE * file = fopen(path, "r");
+	if (!file)
+		return false;
+	// the state follows the last ')', the command name may contain one
+	char line[256];
+	bool zombie = false;
+	if (fgets(line, sizeof(line), file)){
+		char * name_end = strrchr(line, ')');
+		zombie = name_end && (name_end[1] == ' ') && (name_end[2] == 'Z' || name_end[2] == 'X');
+	}
+	fclose(file);
+	return zombie;
+}
+
+static void SignalFd(int fd){
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		printf("frame ring eventfd write failed %d\n", errno);
+}
+
+/*
+sleeps until fd is signalled or timeout_ms passes (-1 waits for ever), the
+counter is drained so the next wait starts clean
+*/
+static void WaitFd(int fd, int timeout_ms){
+	struct pollfd pfd = {fd, POLLIN, 0};
+	if (poll(&pfd, 1, timeout_ms) > 0){
+		uint64_t count;
+		if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			printf("frame ring eventfd read failed %d\n", errno);
+	}
+}
+
+static int RemainingMs(Clock::time_point deadline){
+	int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+	return ms > 0 ? (int)ms : 0;
+}
+
+FrameRingWriter::FrameRingWriter(){
+	for (int i = 0; i < FRAME_RING_MAX_READERS; i++)
+		m_reader_fds[i] = -1;
+}
+
+FrameRingWriter::~FrameRingWriter(){
+	Close();
+}
+
+bool FrameRingWriter::Create(const FrameRingParams & params){
+	Close();
+	if (params.slots < 2 || params.slot_bytes <= 0 || params.max_readers < 1 || params.max_readers > FRAME_RING_MAX_READERS)
+		return false;
+	m_params = params;
+	size_t header_size = FRAME_RING_ALIGN(sizeof(FrameRingHeader));
+	size_t stride = FRAME_RING_ALIGN(sizeof(FrameRingSlot)) + FRAME_RING_ALIGN((size_t)params.slot_bytes);
+	m_map_size = header_size + stride * params.slots;
+
+	m_memfd = memfd_create("imsdk_frame_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (m_memfd < 0 || ftruncate(m_memfd, m_map_size) < 0 ||
+			fcntl(m_memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0){
+		printf("frame ring memfd failed %d\n", errno);
+		Close();
+		return false;
+	}
+	void * map = mmap(nullptr, m_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_memfd, 0);
+	if (map == MAP_FAILED){
+		printf("frame ring mmap failed %d\n", errno);
+		map = nullptr;
+		Close();
+		return false;
+	}
+	m_map = (unsigned char*)map;
+	m_writer_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	for (int i = 0; i < FRAME_RING_MAX_READERS; i++)
+		m_reader_fds[i] = i < params.max_readers ? eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK) : -1;
+	for (int i = -1; i < params.max_readers; i++){
+		if ((i < 0 ? m_writer_fd : m_reader_fds[i]) < 0){
+			printf("frame ring eventfd failed %d\n", errno);
+			Close();
+			return false;
+		}
+	}
+
+	m_header = new (m_map) FrameRingHeader();
+	m_header->magic = FRAME_RING_MAGIC;
+	m_header->version = FRAME_RING_VERSION;
+	m_header->slots = params.slots;
+	m_header->max_readers = params.max_readers;
+	m_header->policy = (uint32_t)params.policy;
+	m_header->slot_bytes = params.slot_bytes;
+	m_header->slot_stride = stride;
+	m_header->slot_offset = header_size;
+	for (int i = 0; i < params.slots; i++)
+		new (SlotAt(m_map, m_header, i)) FrameRingSlot();
+	m_seq = 0;
+	m_skipped = 0;
+	m_detached = 0;
+	m_blocked_us = 0;
+	return true;
+}
+
+bool FrameRingWriter::SendFds(int unix_socket){
+	if (!m_header)
+		return false;
+	int fds[2 + FRAME_RING_MAX_READERS];
+	int count = 0;
+	fds[count++] = m_memfd;
+	fds[count++] = m_writer_fd;
+	for (int i = 0; i < m_params.max_readers; i++)
+		fds[count++] = m_reader_fds[i];
+
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	char tag = 'R';
+	struct iovec iov = {&tag, 1};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+	struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+	return sendmsg(unix_socket, &msg, MSG_NOSIGNAL) == 1;
+}
+
+/*
+true once no attached reader still holds frame seq - slots, the one the slot
+for seq carries. BLOCK waits for them, a reader whose process is gone is
+detached when the wait times out.
+*/
+bool FrameRingWriter::WaitForReaders(uint64_t seq){
+	if (seq < m_header->slots || m_params.policy == RingPolicy::OVERWRITE)
+		return true;
+	uint64_t oldest = seq - m_header->slots;
+	auto blocked = [&]{
+		for (int i = 0; i < m_params.max_readers; i++){
+			FrameRingReaderEntry & reader = m_header->readers[i];
+			if (reader.state.load() == READER_ATTACHED && reader.read_seq.load() <= oldest)
+				return true;
+		}
+		return false;
+	};
+	if (!blocked())
+		return true;
+	if (m_params.policy == RingPolicy::DROP_NEW)
+		return false;
+
+	Clock::time_point begin = Clock::now();
+	Clock::time_point deadline = begin + std::chrono::milliseconds(m_params.block_timeout_ms);
+	bool ok = false;
+	for (;;){
+		// announce the wait before the last look, a reader releasing after it sees the flag
+		m_header->writer_waiting.store(1);
+		if (!blocked()){
+			ok = true;
+			break;
+		}
+		int remaining = RemainingMs(deadline);
+		if (!remaining)
+			break;
+		WaitFd(m_writer_fd, remaining);
+	}
+	if (!ok){
+		for (int i = 0; i < m_params.max_readers; i++){
+			FrameRingReaderEntry & reader = m_header->readers[i];
+			if (reader.state.load() == READER_ATTACHED && reader.read_seq.load() <= oldest &&
+					ProcessGone(reader.pid.load())){
+				reader.state.store(READER_FREE);
+				m_detached++;
+			}
+		}
+		ok = !blocked();
+	}
+	m_header->writer_waiting.store(0);
+	m_blocked_us += std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - begin).count();
+	return ok;
+}
+
+VideoRawData * FrameRingWriter::BeginFrame(VideoBaseBandFmt fmt, int width, int height, int64_t pts){
+	if (!m_header || m_slot)
+		return nullptr;
+	int size = RawFrameSize(fmt, width, height);
+	if (size <= 0 || size > m_params.slot_bytes || !WaitForReaders(m_seq)){
+		m_skipped++;
+		return nullptr;
+	}
+	FrameRingSlot * slot = SlotAt(m_map, m_header, m_seq);
+	// a reader still on the old frame sees 0 when it checks and knows it was overwritten
+	slot->seq.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	m_pic = VideoRawData();
+	m_pic.width = width;
+	m_pic.height = height;
+	m_pic.fmt = fmt;
+	m_pic.pts = pts;
+	SetRawPlanes(m_pic, SlotData(slot));
+	m_slot = slot;
+	return &m_pic;
+}
+
+void FrameRingWriter::CommitFrame(){
+	if (!m_slot)
+		return;
+	m_slot->width = m_pic.width;
+	m_slot->height = m_pic.height;
+	m_slot->fmt = (int32_t)m_pic.fmt;
+	m_slot->pts = m_pic.pts;
+	memcpy(m_slot->hash, m_pic.hash, sizeof(m_slot->hash));
+	m_slot->has_stats = m_pic.stats != nullptr;
+	if (m_pic.stats)
+		m_slot->stats = *m_pic.stats;
+	m_slot->seq.store(m_seq + 1, std::memory_order_release);
+	m_slot = nullptr;
+	m_seq++;
+	m_header->write_seq.store(m_seq);
+
+	for (int i = 0; i < m_params.max_readers; i++){
+		FrameRingReaderEntry & reader = m_header->readers[i];
+		if (reader.state.load() != READER_ATTACHED)
+			continue;
+		uint64_t read_seq = reader.read_seq.load();
+		uint64_t lag = m_seq > read_seq ? m_seq - read_seq : 0;
+		if (lag > reader.max_lag.load(std::memory_order_relaxed))
+			reader.max_lag.store(lag, std::memory_order_relaxed);
+		if (reader.waiting.load())
+			SignalFd(m_reader_fds[i]);
+	}
+}
+
+// the slot stays at 0, a reader still on its old frame counts that as overwritten
+void FrameRingWriter::CancelFrame(){
+	if (m_slot)
+		m_skipped++;
+	m_slot = nullptr;
+}
+
+bool FrameRingWriter::PushFrame(const VideoRawData & pic){
+	VideoRawData * dst = BeginFrame(pic.fmt, pic.width, pic.height, pic.pts);
+	if (!dst)
+		return false;
+	if (!CopyRawFrame(pic, *dst)){
+		CancelFrame();
+		return false;
+	}
+	memcpy(dst->hash, pic.hash, sizeof(dst->hash));
+	dst->stats = pic.stats;
+	CommitFrame();
+	return true;
+}
+
+void FrameRingWriter::Close(){
+	if (m_header){
+		m_header->closed.store(1);
+		for (int i = 0; i < m_params.max_readers; i++)
+			SignalFd(m_reader_fds[i]);
+	}
+	if (m_map)
+		munmap(m_map, m_map_size);
+	m_map = nullptr;
+	m_header = nullptr;
+	m_slot = nullptr;
+	if (m_memfd >= 0)
+		close(m_memfd);
+	m_memfd = -1;
+	if (m_writer_fd >= 0)
+		close(m_writer_fd);
+	m_writer_fd = -1;
+	for (int i = 0; i < FRAME_RING_MAX_READERS; i++){
+		if (m_reader_fds[i] >= 0)
+			close(m_reader_fds[i]);
+		m_reader_fds[i] = -1;
+	}
+}
+
+void FrameRingWriter::GetStats(FrameRingStats & stats){
+	stats = FrameRingStats();
+	stats.frames = m_seq;
+	stats.skipped = m_skipped;
+	stats.detached = m_detached;
+	stats.blocked_us = m_blocked_us;
+	if (!m_header)
+		return;
+	stats.readers.resize(m_params.max_readers);
+	for (int i = 0; i < m_params.max_readers; i++){
+		FrameRingReaderEntry & reader = m_header->readers[i];
+		FrameRingReaderStats & out = stats.readers[i];
+		out.attached = reader.state.load() == READER_ATTACHED;
+		out.pid = reader.pid.load();
+		out.frames = reader.frames.load();
+		out.dropped = reader.dropped.load();
+		uint64_t read_seq = reader.read_seq.load();
+		out.lag = out.attached && m_seq > read_seq ? m_seq - read_seq : 0;
+		out.max_lag = reader.max_lag.load();
+	}
+}
+
+FrameRingReader::~FrameRingReader(){
+	Close();
+}
+
+bool FrameRingReader::Open(int unix_socket){
+	Close();
+	int fds[2 + FRAME_RING_MAX_READERS];
+	char control[CMSG_SPACE(sizeof(fds))];
+	char tag = 0;
+	struct iovec iov = {&tag, 1};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(unix_socket, &msg, MSG_CMSG_CLOEXEC) != 1)
+		return false;
+	struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		return false;
+	int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+	if (tag != 'R' || count < 3){
+		for (int i = 0; i < count; i++)
+			close(fds[i]);
+		return false;
+	}
+	m_memfd = fds[0];
+	m_writer_fd = fds[1];
+	int readers = count - 2;
+
+	struct stat st;
+	void * map = MAP_FAILED;
+	if (fstat(m_memfd, &st) == 0 && (size_t)st.st_size >= sizeof(FrameRingHeader))
+		map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_memfd, 0);
+	if (map != MAP_FAILED){
+		m_map = (unsigned char*)map;
+		m_map_size = st.st_size;
+		m_header = (FrameRingHeader*)m_map;
+	}
+	// the memfd is sealed against resizing, what the header describes has to fit the mapping
+	if (!m_header || m_header->magic != FRAME_RING_MAGIC || m_header->version != FRAME_RING_VERSION ||
+			(int)m_header->max_readers != readers || m_header->slots < 2 ||
+			m_header->slot_stride < FRAME_RING_ALIGN(sizeof(FrameRingSlot)) + m_header->slot_bytes ||
+			m_header->slot_offset + m_header->slot_stride * m_header->slots > m_map_size){
+		for (int i = 2; i < count; i++)
+			close(fds[i]);
+		Close();
+		return false;
+	}
+
+	for (int i = 0; i < readers && m_index < 0; i++){
+		uint32_t expected = READER_FREE;
+		if (m_header->readers[i].state.compare_exchange_strong(expected, READER_ATTACHING))
+			m_index = i;
+	}
+	for (int i = 0; i < readers; i++){
+		if (i == m_index)
+			m_event_fd = fds[2 + i];
+		else
+			close(fds[2 + i]);
+	}
+	if (m_index < 0){
+		printf("frame ring has no free reader slot\n");
+		Close();
+		return false;
+	}
+	FrameRingReaderEntry & entry = m_header->readers[m_index];
+	entry.pid.store(getpid());
+	entry.waiting.store(0);
+	entry.frames.store(0);
+	entry.dropped.store(0);
+	entry.max_lag.store(0);
+	// new readers start at the next frame published
+	entry.read_seq.store(m_header->write_seq.load());
+	entry.state.store(READER_ATTACHED);
+	m_closed = false;
+	return true;
+}
+
+bool FrameRingReader::Acquire(VideoRawData & pic, int timeout_ms){
+	if (!m_header || m_holding)
+		return false;
+	FrameRingReaderEntry & entry = m_header->readers[m_index];
+	Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeout_ms > 0 ? timeout_ms : 0);
+	for (;;){
+		uint64_t read_seq = entry.read_seq.load(std::memory_order_relaxed);
+		uint64_t write_seq = m_header->write_seq.load(std::memory_order_acquire);
+		if (read_seq < write_seq){
+			if (write_seq - read_seq > m_header->slots){
+				entry.dropped.fetch_add(write_seq - m_header->slots - read_seq, std::memory_order_relaxed);
+				read_seq = write_seq - m_header->slots;
+				entry.read_seq.store(read_seq);
+			}
+			FrameRingSlot * slot = SlotAt(m_map, m_header, read_seq);
+			uint64_t seq = slot->seq.load(std::memory_order_acquire);
+			VideoRawData view;
+			view.width = slot->width;
+			view.height = slot->height;
+			view.fmt = (VideoBaseBandFmt)slot->fmt;
+			view.pts = slot->pts;
+			memcpy(view.hash, slot->hash, sizeof(view.hash));
+			view.stats = slot->has_stats ? &slot->stats : nullptr;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			int size = RawFrameSize(view.fmt, view.width, view.height);
+			if (seq != read_seq + 1 || slot->seq.load(std::memory_order_relaxed) != seq ||
+					size <= 0 || (uint64_t)size > m_header->slot_bytes){
+				// lapped by the writer while looking at it
+				entry.dropped.fetch_add(1, std::memory_order_relaxed);
+				entry.read_seq.store(read_seq + 1);
+				continue;
+			}
+			SetRawPlanes(view, SlotData(slot));
+			pic = view;
+			m_held = read_seq;
+			m_holding = true;
+			return true;
+		}
+		if (m_header->closed.load()){
+			m_closed = true;
+			return false;
+		}
+		int remaining = timeout_ms < 0 ? -1 : RemainingMs(deadline);
+		if (!remaining)
+			return false;
+		// announce the wait before the last look, the writer signals after publishing if it sees the flag
+		entry.waiting.store(1);
+		if (m_header->write_seq.load() == read_seq && !m_header->closed.load())
+			WaitFd(m_event_fd, remaining);
+		entry.waiting.store(0);
+	}
+}
+
+bool FrameRingReader::Release(){
+	if (!m_holding)
+		return false;
+	m_holding = false;
+	FrameRingReaderEntry & entry = m_header->readers[m_index];
+	FrameRingSlot * slot = SlotAt(m_map, m_header, m_held);
+	std::atomic_thread_fence(std::memory_order_acquire);
+	bool ok = slot->seq.load(std::memory_order_relaxed) == m_held + 1;
+	(ok ? entry.frames : entry.dropped).fetch_add(1, std::memory_order_relaxed);
+	entry.read_seq.store(m_held + 1);
+	if (m_header->writer_waiting.load())
+		SignalFd(m_writer_fd);
+	return ok;
+}
+
+void FrameRingReader::Close(){
+	if (m_header && m_index >= 0){
+		m_header->readers[m_index].state.store(READER_FREE);
+		if (m_header->writer_waiting.load())
+			SignalFd(m_writer_fd);
+	}
+	if (m_map)
+		munmap(m_map, m_map_size);
+	m_map = nullptr;
+	m_map_size = 0;
+	m_header = nullptr;
+	m_index = -1;
+	m_holding = false;
+	if (m_memfd >= 0)
+		close(m_memfd);
+	if (m_writer_fd >= 0)
+		close(m_writer_fd);
+	if (m_event_fd >= 0)
+		close(m_event_fd);
+	m_memfd = -1;
+	m_writer_fd = -1;
+	m_event_fd = -1;
+}
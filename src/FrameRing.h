@@ -0,0 +1,120 @@
+#ifndef _H_FRAMERING_
+#define _H_FRAMERING_
+
+#include <stdint.h>
+#include <vector>
+
+#include "Def.h"
+
+#define FRAME_RING_MAX_READERS 8
+
+// what the writer does when the slot it needs is still unread by an attached reader
+enum class RingPolicy{
+	BLOCK,		// wait for the reader up to block_timeout_ms, then skip the frame; a dead reader is detached
+	DROP_NEW,	// skip the new frame, every reader keeps what it has not read yet
+	OVERWRITE	// reuse the slot, the slow reader loses its oldest frames
+};
+
+struct FrameRingParams{
+	int slots = 8;
+	int slot_bytes = 0;			// largest frame, RawFrameSize of the biggest format and size to expect
+	int max_readers = 4;		// up to FRAME_RING_MAX_READERS
+	RingPolicy policy = RingPolicy::BLOCK;
+	int block_timeout_ms = 100;
+};
+
+struct FrameRingReaderStats{
+	bool attached = false;
+	int pid = 0;
+	uint64_t frames = 0;		// released in time
+	uint64_t dropped = 0;		// overwritten before the reader got to them
+	uint64_t lag = 0;			// published but not yet released
+	uint64_t max_lag = 0;		// highest lag seen at a publish
+};
+
+struct FrameRingStats{
+	uint64_t frames = 0;		// published
+	uint64_t skipped = 0;		// not published, DROP_NEW or a BLOCK timeout
+	uint64_t detached = 0;		// dead readers dropped on a BLOCK timeout
+	int64_t blocked_us = 0;		// writer waiting for readers
+	std::vector<FrameRingReaderStats> readers;	// one per reader slot
+};
+
+struct FrameRingHeader;
+struct FrameRingSlot;
+
+/*
+Single producer frame ring in a memfd shared with other processes. The header
+and per-slot sequence numbers are lock-free atomics in the mapping, eventfds
+only carry wakeups to a side that announced it is waiting, so the steady state
+makes no system calls. Frames are written in place: BeginFrame hands out the
+planes of the next slot, the decoder converts into them, CommitFrame publishes.
+Readers get the memfd and eventfds through SendFds over a unix socket.
+*/
+class FrameRingWriter {
+public:
+	FrameRingWriter();
+	~FrameRingWriter();
+	bool Create(const FrameRingParams & params);
+	// memfd, then the writer eventfd, then one eventfd per reader slot
+	bool SendFds(int unix_socket);
+	// planes of the next slot, nullptr when the frame is skipped or does not fit
+	VideoRawData * BeginFrame(VideoBaseBandFmt fmt, int width, int height, int64_t pts);
+	// publishes the frame from BeginFrame with the hash and stats set on it
+	void CommitFrame();
+	// gives the slot from BeginFrame back unpublished
+	void CancelFrame();
+	// BeginFrame, CopyRawFrame and CommitFrame
+	bool PushFrame(const VideoRawData & pic);
+	// readers see the ring closed once they have read what is left
+	void Close();
+	void GetStats(FrameRingStats & stats);
+private:
+	bool WaitForReaders(uint64_t seq);
+	void Signal(int fd);
+private:
+	FrameRingParams m_params;
+	int m_memfd = -1;
+	int m_writer_fd = -1;
+	int m_reader_fds[FRAME_RING_MAX_READERS];
+	size_t m_map_size = 0;
+	unsigned char * m_map = nullptr;
+	FrameRingHeader * m_header = nullptr;
+	uint64_t m_seq = 0;
+	FrameRingSlot * m_slot = nullptr;	// between BeginFrame and CommitFrame
+	VideoRawData m_pic;
+	uint64_t m_skipped = 0;
+	uint64_t m_detached = 0;
+	int64_t m_blocked_us = 0;
+};
+
+class FrameRingReader {
+public:
+	FrameRingReader() = default;
+	~FrameRingReader();
+	// receives the fds sent by FrameRingWriter::SendFds and takes a free reader slot
+	bool Open(int unix_socket);
+	/*
+	the oldest unread frame, planes pointing into the ring. false on timeout or
+	once the writer closed and everything was read (Closed() tells them apart).
+	*/
+	bool Acquire(VideoRawData & pic, int timeout_ms);
+	// false if the frame was overwritten while it was held (OVERWRITE policy)
+	bool Release();
+	bool Closed() const { return m_closed; }
+	// readable when a frame may be waiting, for poll loops
+	int EventFd() const { return m_event_fd; }
+	void Close();
+private:
+	FrameRingHeader * m_header = nullptr;
+	unsigned char * m_map = nullptr;
+	size_t m_map_size = 0;
+	int m_memfd = -1;
+	int m_writer_fd = -1;
+	int m_event_fd = -1;
+	int m_index = -1;
+	uint64_t m_held = 0;
+	bool m_holding = false;
+	bool m_closed = false;
+};
+#endif
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "FrameTrace.h"
+
+struct TraceEvent{
+	const char * name = nullptr;
+	int channel = 0;
+	int tid = 0;
+	int64_t frame = 0;
+	int64_t begin_ns = 0;
+	int64_t end_ns = 0;
+};
+
+struct TraceRing{
+	std::vector<TraceEvent> events;
+	uint64_t mask = 0;
+	std::atomic<uint64_t> head{0};
+};
+
+// gives the thread's ring back when the thread exits, its events stay until overwritten
+struct TraceRingOwner{
+	TraceRing * ring = nullptr;
+	int tid = 0;
+	~TraceRingOwner();
+};
+
+std::atomic<bool> FrameTrace::s_enabled(false);
+
+static std::mutex g_trace_mutex;
+static std::vector<TraceRing*> g_trace_rings;	// never freed, events outlive their threads
+static std::vector<TraceRing*> g_trace_free;	// rings of exited threads
+static int g_trace_threads = 0;
+static std::atomic<int> g_trace_capacity(65536);
+static std::atomic<int> g_trace_channels(0);
+static const std::chrono::steady_clock::time_point g_trace_epoch = std::chrono::steady_clock::now();
+static thread_local TraceRingOwner t_trace_owner;
+
+TraceRingOwner::~TraceRingOwner(){
+	if (!ring)
+		return;
+	std::lock_guard<std::mutex> lock(g_trace_mutex);
+	g_trace_free.push_back(ring);
+}
+
+static TraceRingOwner & ThreadRing(){
+	TraceRingOwner & owner = t_trace_owner;
+	if (!owner.ring){
+		std::lock_guard<std::mutex> lock(g_trace_mutex);
+		owner.tid = ++g_trace_threads;
+		if (!g_trace_free.empty()){
+			owner.ring = g_trace_free.back();
+			g_trace_free.pop_back();
+			return owner;
+		}
+		uint64_t capacity = 1;
+		while (capacity < (uint64_t)g_trace_capacity.load())
+			capacity <<= 1;
+		TraceRing * ring = new TraceRing();
+		ring->events.resize(capacity);
+		ring->mask = capacity - 1;
+		g_trace_rings.push_back(ring);
+		owner.ring = ring;
+	}
+	return owner;
+}
+
+void FrameTrace::Enable(int events_per_thread){
+	if (events_per_thread > 0)
+		g_trace_capacity = events_per_thread;
+	s_enabled = true;
+}
+
+void FrameTrace::Disable(){
+	s_enabled = false;
+}
+
+int FrameTrace::NewChannel(){
+	return ++g_trace_channels;
+}
+
+int64_t FrameTrace::Now(){
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_trace_epoch).count();
+}
+
+void FrameTrace::Record(const char * name, int channel, int64_t frame, int64_t begin_ns, int64_t end_ns){
+	TraceRingOwner & owner = ThreadRing();
+	TraceRing * ring = owner.ring;
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	TraceEvent & event = ring->events[head & ring->mask];
+	event.name = name;
+	event.channel = channel;
+	event.tid = owner.tid;
+	event.frame = frame;
+	event.begin_ns = begin_ns;
+	event.end_ns = end_ns;
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+bool FrameTrace::Export(const char * path){
+	FILE * fp = fopen(path, "w");
+	if (!fp)
+		return false;
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	std::set<int> channels;
+	std::lock_guard<std::mutex> lock(g_trace_mutex);
+	for (auto ring : g_trace_rings){
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+		uint64_t count = head < ring->events.size() ? head : ring->events.size();
+		for (uint64_t i = head - count; i < head; i++){
+			const TraceEvent & event = ring->events[i & ring->mask];
+			fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%lld}}",
+					first ? "" : ",\n", event.name, event.channel, event.tid, event.begin_ns / 1000.0,
+					(event.end_ns - event.begin_ns) / 1000.0, (long long)event.frame);
+			first = false;
+			channels.insert(event.channel);
+		}
+	}
+	for (auto channel : channels){
+		fprintf(fp, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"channel %d\"}}",
+				first ? "" : ",\n", channel, channel);
+		first = false;
+	}
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+	return true;
+}
@@ -0,0 +1,48 @@
+#ifndef _H_FRAMETRACE_
+#define _H_FRAMETRACE_
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+Optional per-frame span tracing. Every thread records into its own ring
+(single writer, no locks), Export() writes all rings as Chrome/Perfetto
+trace JSON with one process per channel. Export while the pipeline is idle,
+a ring that is being written during export may show a torn oldest event.
+The ring of a thread that exits is taken over by the next thread that
+records, so there are only as many rings as threads tracing at once.
+*/
+class FrameTrace {
+public:
+	static void Enable(int events_per_thread = 65536);
+	static void Disable();
+	static bool Enabled(){ return s_enabled.load(std::memory_order_relaxed); }
+	static bool Export(const char * path);
+	static int NewChannel();
+	static int64_t Now();
+	static void Record(const char * name, int channel, int64_t frame, int64_t begin_ns, int64_t end_ns);
+private:
+	static std::atomic<bool> s_enabled;
+};
+
+/*
+Records [construction, destruction) as one span when tracing is enabled.
+name must be a string literal.
+*/
+class TraceSpan {
+public:
+	TraceSpan(const char * name, int channel, int64_t frame)
+		: m_name(name), m_channel(channel), m_frame(frame),
+		  m_begin(FrameTrace::Enabled() ? FrameTrace::Now() : -1){}
+	~TraceSpan(){
+		if (m_begin >= 0)
+			FrameTrace::Record(m_name, m_channel, m_frame, m_begin, FrameTrace::Now());
+	}
+	void SetFrame(int64_t frame){ m_frame = frame; }
+private:
+	const char * m_name;
+	int m_channel;
+	int64_t m_frame;
+	int64_t m_begin;
+};
+#endif
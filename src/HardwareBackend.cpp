@@ -0,0 +1,111 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "HardwareBackend.h"
+#include "va/va.h"
+#include "va/va_drm.h"
+
+HardwareBackend::~HardwareBackend(){
+	Close();
+}
+
+bool HardwareBackend::InitVA(){
+	UnInitVA();
+	m_device_fd = open("/dev/dri/renderD128", O_RDWR);
+	if(m_device_fd < 0)
+		return false;
+	m_va_dpy = vaGetDisplayDRM(m_device_fd);
+	if(!m_va_dpy)
+		return false;
+	int major_version,minor_version;
+	VAStatus va_status = vaInitialize(m_va_dpy, &major_version, &minor_version);
+	if(va_status != VA_STATUS_SUCCESS)
+		return false;
+	mfxStatus mfx_status = MFXVideoCORE_SetHandle(m_session, MFX_HANDLE_VA_DISPLAY, m_va_dpy);
+	if(mfx_status < MFX_ERR_NONE)
+		return false;
+	return true;
+}
+
+void HardwareBackend::UnInitVA(){
+	if(m_va_dpy){
+		vaTerminate(m_va_dpy);
+		m_va_dpy = nullptr;
+	}
+	if(m_device_fd >= 0){
+		close(m_device_fd);
+		m_device_fd = -1;
+	}
+}
+
+bool HardwareBackend::Open(){
+	Close();
+	mfxIMPL impl = MFX_IMPL_HARDWARE_ANY;
+	mfxVersion ver{ 0,1 };
+	mfxStatus ret = MFXInit(impl, &ver, &m_session);
+	if (ret != MFX_ERR_NONE){
+		m_session = nullptr;
+		return false;
+	}
+	return InitVA();
+}
+
+void HardwareBackend::Close(){
+	if (m_session){
+		MFXClose(m_session);
+		m_session = nullptr;
+	}
+	UnInitVA();
+}
+
+mfxStatus HardwareBackend::DecodeHeader(mfxBitstream *bs, mfxVideoParam *par){
+	return MFXVideoDECODE_DecodeHeader(m_session, bs, par);
+}
+
+mfxStatus HardwareBackend::DecodeInit(mfxVideoParam *par){
+	return MFXVideoDECODE_Init(m_session, par);
+}
+
+mfxStatus HardwareBackend::DecodeQueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest *request){
+	return MFXVideoDECODE_QueryIOSurf(m_session, par, request);
+}
+
+mfxStatus HardwareBackend::DecodeFrameAsync(mfxBitstream *bs, mfxFrameSurface1 *surface_work,
+		mfxFrameSurface1 **surface_out, mfxSyncPoint *syncp){
+	return MFXVideoDECODE_DecodeFrameAsync(m_session, bs, surface_work, surface_out, syncp);
+}
+
+mfxStatus HardwareBackend::DecodeReset(mfxVideoParam *par){
+	return MFXVideoDECODE_Reset(m_session, par);
+}
+
+void HardwareBackend::DecodeClose(){
+	if (m_session)
+		MFXVideoDECODE_Close(m_session);
+}
+
+mfxStatus HardwareBackend::EncodeInit(mfxVideoParam *par){
+	return MFXVideoENCODE_Init(m_session, par);
+}
+
+mfxStatus HardwareBackend::EncodeQueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest *request){
+	return MFXVideoENCODE_QueryIOSurf(m_session, par, request);
+}
+
+mfxStatus HardwareBackend::EncodeGetVideoParam(mfxVideoParam *par){
+	return MFXVideoENCODE_GetVideoParam(m_session, par);
+}
+
+mfxStatus HardwareBackend::EncodeFrameAsync(mfxEncodeCtrl *ctrl, mfxFrameSurface1 *surface,
+		mfxBitstream *bs, mfxSyncPoint *syncp){
+	return MFXVideoENCODE_EncodeFrameAsync(m_session, ctrl, surface, bs, syncp);
+}
+
+void HardwareBackend::EncodeClose(){
+	if (m_session)
+		MFXVideoENCODE_Close(m_session);
+}
+
+mfxStatus HardwareBackend::SyncOperation(mfxSyncPoint syncp, mfxU32 wait){
+	return MFXVideoCORE_SyncOperation(m_session, syncp, wait);
+}
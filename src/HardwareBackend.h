@@ -0,0 +1,36 @@
+#ifndef _H_HARDWAREBACKEND_
+#define _H_HARDWAREBACKEND_
+
+#include "CodecBackend.h"
+
+class HardwareBackend : public CodecBackend {
+public:
+	HardwareBackend() = default;
+	~HardwareBackend();
+	bool Open() override;
+	void Close() override;
+
+	mfxStatus DecodeHeader(mfxBitstream *bs, mfxVideoParam *par) override;
+	mfxStatus DecodeInit(mfxVideoParam *par) override;
+	mfxStatus DecodeQueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest *request) override;
+	mfxStatus DecodeFrameAsync(mfxBitstream *bs, mfxFrameSurface1 *surface_work,
+			mfxFrameSurface1 **surface_out, mfxSyncPoint *syncp) override;
+	mfxStatus DecodeReset(mfxVideoParam *par) override;
+	void DecodeClose() override;
+
+	mfxStatus EncodeInit(mfxVideoParam *par) override;
+	mfxStatus EncodeQueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest *request) override;
+	mfxStatus EncodeGetVideoParam(mfxVideoParam *par) override;
+	mfxStatus EncodeFrameAsync(mfxEncodeCtrl *ctrl, mfxFrameSurface1 *surface,
+			mfxBitstream *bs, mfxSyncPoint *syncp) override;
+	void EncodeClose() override;
+
+	mfxStatus SyncOperation(mfxSyncPoint syncp, mfxU32 wait) override;
+private:
+	bool InitVA();
+	void UnInitVA();
+	int m_device_fd = -1;
+	void * m_va_dpy = nullptr;
+	mfxSession m_session = nullptr;
+};
+#endif
@@ -0,0 +1,529 @@
+#include <string.h>
+#include <stdio.h>
+#include <thread>
+
+#include "LoopbackBackend.h"
+#include "PixelFormat.h"
+
+#define MSDK_ALIGN16(value)  (((value + 15) >> 4) << 4)
+#define LOOPBACK_TAG "LBK"
+
+enum NalKind{
+	NAL_OTHER,
+	NAL_SPS,
+	NAL_PICTURE,	// first slice of a picture
+	NAL_SLICE		// further slices of the same picture
+};
+
+static int FindStartCode(const mfxU8 *data, int len, int pos){
+	for (int i = pos; i + 2 < len; i++){
+		if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+			return i;
+	}
+	return len;
+}
+
+static int NalHeaderLen(mfxU32 codec){
+	return codec == MFX_CODEC_HEVC ? 2 : 1;
+}
+
+static NalKind ClassifyNal(mfxU32 codec, const mfxU8 *nal, int len){
+	if (len <= NalHeaderLen(codec))
+		return NAL_OTHER;
+	if (codec == MFX_CODEC_HEVC){
+		int type = (nal[0] >> 1) & 0x3F;
+		if (type == 33)
+			return NAL_SPS;
+		if (type <= 9 || (type >= 16 && type <= 21))
+			return (nal[2] & 0x80) ? NAL_PICTURE : NAL_SLICE;	// first_slice_segment_in_pic_flag
+		return NAL_OTHER;
+	}
+	int type = nal[0] & 0x1F;
+	if (type == 7)
+		return NAL_SPS;
+	if (type >= 1 && type <= 5)
+		return (nal[1] & 0x80) ? NAL_PICTURE : NAL_SLICE;	// first_mb_in_slice == 0
+	return NAL_OTHER;
+}
+
+static mfxU8 * WriteNalHeader(mfxU8 *out, mfxU32 codec, mfxU8 avc_header, int hevc_type){
+	*out++ = 0;
+	*out++ = 0;
+	*out++ = 0;
+	*out++ = 1;
+	if (codec == MFX_CODEC_HEVC){
+		*out++ = (mfxU8)(hevc_type << 1);
+		*out++ = 1;
+	}else
+		*out++ = avc_header;
+	return out;
+}
+
+static VideoChromaFormat ChromaFromMfx(int chroma_format){
+	switch(chroma_format){
+		case MFX_CHROMAFORMAT_YUV422:
+			return VideoChromaFormat::YUV422;
+		case MFX_CHROMAFORMAT_YUV444:
+			return VideoChromaFormat::YUV444;
+		default:
+			return VideoChromaFormat::YUV420;
+	}
+}
+
+// same output surfaces the gpu decoder picks for the sampling and depth
+static bool FillFrameInfo(mfxFrameInfo *info, int width, int height, int bit_depth, VideoChromaFormat chroma){
+	PixelFormatDesc format;
+	if (!GetSurfaceFormat(SurfaceFourCC(chroma, bit_depth), format))
+		return false;
+	info->FourCC = format.fourcc;
+	info->ChromaFormat = format.chroma_format;
+	info->BitDepthLuma = format.bit_depth;
+	info->BitDepthChroma = format.bit_depth;
+	info->Shift = format.sample_bytes == 2 && format.bit_depth > 8 ? 1 : 0;
+	info->Width = MSDK_ALIGN16(width);
+	info->Height = MSDK_ALIGN16(height);
+	info->CropX = 0;
+	info->CropY = 0;
+	info->CropW = width;
+	info->CropH = height;
+	info->FrameRateExtN = 30;
+	info->FrameRateExtD = 1;
+	info->AspectRatioW = 1;
+	info->AspectRatioH = 1;
+	info->PicStruct = MFX_PICSTRUCT_PROGRESSIVE;
+	return true;
+}
+
+/*
+luma steps with the row and the frame order, chroma is mid grey. the pattern
+is drawn once, planar and 256 rows taller than the picture, every frame is a
+view starting at row (order & 0xFF) converted into the surface format, so all
+formats decode to the same planar picture.
+*/
+void LoopbackBackend::DrawPattern(const mfxFrameInfo & info){
+	PixelFormatDesc format;
+	if (!GetSurfaceFormat(info.FourCC, format))
+		return;
+	VideoRawData pic;
+	pic.width = info.Width;
+	pic.height = info.Height + 256;
+	pic.fmt = format.planar;
+	m_dec_pattern.assign(RawFrameSize(pic.fmt, pic.width, pic.height), 0);
+	SetRawPlanes(pic, m_dec_pattern.data());
+
+	int chroma_height = (pic.height + (1 << format.chroma_shift_y) - 1) >> format.chroma_shift_y;
+	int upshift = format.bit_depth - 8;
+	for (int p = 0; p < 3; p++){
+		int rows = p == 0 ? pic.height : chroma_height;
+		for (int y = 0; y < rows; y++){
+			int value = p == 0 ? (y & 0xFF) << upshift : 1 << (format.bit_depth - 1);
+			unsigned char * row = pic.buffer[p] + y * pic.line_size[p];
+			if (upshift){
+				for (int x = 0; x < pic.line_size[p] / 2; x++)
+					((mfxU16*)row)[x] = (mfxU16)value;
+			}else
+				memset(row, value, pic.line_size[p]);
+		}
+	}
+}
+
+void LoopbackBackend::FillPicture(mfxFrameSurface1 *surface, mfxU32 order){
+	PixelFormatDesc format;
+	if (m_dec_pattern.empty() || !GetSurfaceFormat(surface->Info.FourCC, format))
+		return;
+	VideoRawData pic;
+	pic.width = surface->Info.Width;
+	pic.height = surface->Info.Height + 256;
+	pic.fmt = format.planar;
+	if (RawFrameSize(pic.fmt, pic.width, pic.height) != (int)m_dec_pattern.size())
+		return;
+	SetRawPlanes(pic, m_dec_pattern.data());
+	pic.buffer[0] += (order & 0xFF) * pic.line_size[0];
+	pic.height = surface->Info.Height;
+	CopyToSurface(pic, surface);
+}
+
+LoopbackBackend::LoopbackBackend(const LoopbackParams & params) : m_params(params){
+	memset(&m_dec_param, 0, sizeof(mfxVideoParam));
+	memset(&m_enc_param, 0, sizeof(mfxVideoParam));
+	if (m_params.async_depth < 1)
+		m_params.async_depth = 1;
+}
+
+LoopbackBackend::~LoopbackBackend(){
+	Close();
+}
+
+bool LoopbackBackend::Open(){
+	Close();
+	m_opened = true;
+	return true;
+}
+
+void LoopbackBackend::Close(){
+	DecodeClose();
+	EncodeClose();
+	m_opened = false;
+}
+
+mfxSyncPoint LoopbackBackend::Submit(Job & job){
+	job.id = m_next_id++;
+	job.ready = std::chrono::steady_clock::now() + std::chrono::microseconds(m_params.latency_us);
+	m_jobs.push_back(job);
+	return reinterpret_cast<mfxSyncPoint>(static_cast<uintptr_t>(job.id));
+}
+
+void LoopbackBackend::DropJobs(bool encode){
+	for (auto iter = m_jobs.begin(); iter != m_jobs.end();){
+		if (iter->encode == encode){
+			if (iter->surface && iter->surface->Data.Locked)
+				iter->surface->Data.Locked--;
+			iter = m_jobs.erase(iter);
+		}else
+			iter++;
+	}
+}
+
+bool LoopbackBackend::ParseHeader(const mfxU8 *data, int len, mfxVideoParam *par){
+	mfxU32 codec = par->mfx.CodecId;
+	int pos = FindStartCode(data, len, 0);
+	while (pos < len){
+		int nal = pos + 3;
+		int next = FindStartCode(data, len, nal);
+		NalKind kind = ClassifyNal(codec, data + nal, next - nal);
+		if (kind == NAL_SPS || kind == NAL_PICTURE){
+			int width = m_params.width;
+			int height = m_params.height;
+			int bit_depth = m_params.bit_depth;
+			int chroma_format = 0;
+			if (kind == NAL_SPS){
+				char text[64] = {0};
+				int header = NalHeaderLen(codec);
+				int text_len = next - nal - header;
+				memcpy(text, data + nal + header, text_len < 63 ? text_len : 63);
+				if (strncmp(text, LOOPBACK_TAG, strlen(LOOPBACK_TAG)) == 0)
+					sscanf(text + strlen(LOOPBACK_TAG), "%d %d %d %d", &width, &height, &bit_depth, &chroma_format);
+			}
+			VideoChromaFormat chroma = chroma_format ? ChromaFromMfx(chroma_format) : m_params.chroma_format;
+			return FillFrameInfo(&par->mfx.FrameInfo, width, height, bit_depth, chroma);
+		}
+		pos = next;
+	}
+	return false;
+}
+
+mfxStatus LoopbackBackend::DecodeHeader(mfxBitstream *bs, mfxVideoParam *par){
+	if (!bs || !par)
+		return MFX_ERR_NULL_PTR;
+	if (par->mfx.CodecId != MFX_CODEC_AVC && par->mfx.CodecId != MFX_CODEC_HEVC)
+		return MFX_ERR_UNSUPPORTED;
+	if (!ParseHeader(bs->Data + bs->DataOffset, bs->DataLength, par))
+		return MFX_ERR_MORE_DATA;
+	return MFX_ERR_NONE;
+}
+
+mfxStatus LoopbackBackend::DecodeInit(mfxVideoParam *par){
+	if (!par)
+		return MFX_ERR_NULL_PTR;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_opened)
+		return MFX_ERR_NOT_INITIALIZED;
+	m_dec_param = *par;
+	m_dec_tail.clear();
+	DrawPattern(par->mfx.FrameInfo);
+	m_dec_frame_order = 0;
+	m_dec_inited = true;
+	return MFX_ERR_NONE;
+}
+
+mfxStatus LoopbackBackend::DecodeQueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest *request){
+	if (!par || !request)
+		return MFX_ERR_NULL_PTR;
+	request->Info = par->mfx.FrameInfo;
+	request->NumFrameMin = m_params.async_depth + 1;
+	request->NumFrameSuggested = request->NumFrameMin + par->AsyncDepth;
+	return MFX_ERR_NONE;
+}
+
+mfxStatus LoopbackBackend::DecodeFrameAsync(mfxBitstream *bs, mfxFrameSurface1 *surface_work,
+		mfxFrameSurface1 **surface_out, mfxSyncPoint *syncp){
+	if (!surface_out || !syncp)
+		return MFX_ERR_NULL_PTR;
+	*surface_out = nullptr;
+	*syncp = nullptr;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_dec_inited)
+		return MFX_ERR_NOT_INITIALIZED;
+	if (!surface_work)
+		return MFX_ERR_NULL_PTR;
+	if (surface_work->Data.Locked)
+		return MFX_ERR_MORE_SURFACE;
+	if ((int)m_jobs.size() >= m_params.async_depth)
+		return MFX_WRN_DEVICE_BUSY;
+
+	mfxU32 codec = m_dec_param.mfx.CodecId;
+	bool picture = false;
+	while (!picture){
+		// the last nal of the previous call ends at the first start code of this one
+		if (!m_dec_tail.empty()){
+			if (bs && bs->DataLength){
+				const mfxU8 *data = bs->Data + bs->DataOffset;
+				int sc = FindStartCode(data, bs->DataLength, 0);
+				m_dec_tail.insert(m_dec_tail.end(), data, data + sc);
+				bs->DataOffset += sc;
+				bs->DataLength -= sc;
+				if (!bs->DataLength)
+					return MFX_ERR_MORE_DATA;
+			}else if (bs)
+				return MFX_ERR_MORE_DATA;
+			picture = ClassifyNal(codec, m_dec_tail.data(), m_dec_tail.size()) == NAL_PICTURE;
+			m_dec_tail.clear();
+			continue;
+		}
+
+		if (!bs || !bs->DataLength)
+			return MFX_ERR_MORE_DATA;
+		const mfxU8 *data = bs->Data + bs->DataOffset;
+		int len = bs->DataLength;
+		int start = FindStartCode(data, len, 0);
+		int nal = start + 3;
+		if (nal >= len){
+			bs->DataOffset += start;
+			bs->DataLength -= start;
+			return MFX_ERR_MORE_DATA;
+		}
+		int next = FindStartCode(data, len, nal);
+		if (next == len){
+			m_dec_tail.assign(data + nal, data + len);
+			bs->DataOffset += len;
+			bs->DataLength = 0;
+			return MFX_ERR_MORE_DATA;
+		}
+		picture = ClassifyNal(codec, data + nal, next - nal) == NAL_PICTURE;
+		bs->DataOffset += next;
+		bs->DataLength -= next;
+	}
+
+	Job job;
+	job.surface = surface_work;
+	job.frame_order = m_dec_frame_order++;
+	surface_work->Data.Locked++;
+	*surface_out = surface_work;
+	*syncp = Submit(job);
+	return MFX_ERR_NONE;
+}
+
+mfxStatus LoopbackBackend::DecodeReset(mfxVideoParam *par){
+	if (!par)
+		return MFX_ERR_NULL_PTR;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_dec_inited)
+		return MFX_ERR_NOT_INITIALIZED;
+	// like the sdk, the stream format can not change without a new DecodeInit
+	if (par->mfx.FrameInfo.FourCC != m_dec_param.mfx.FrameInfo.FourCC ||
+			par->mfx.FrameInfo.Width != m_dec_param.mfx.FrameInfo.Width ||
+			par->mfx.FrameInfo.Height != m_dec_param.mfx.FrameInfo.Height)
+		return MFX_ERR_INCOMPATIBLE_VIDEO_PARAM;
+	DropJobs(false);
+	m_dec_tail.clear();
+	m_dec_frame_order = 0;
+	return MFX_ERR_NONE;
+}
+
+void LoopbackBackend::DecodeClose(){
+	std::lock_guard<std::mutex> lock(m_mutex);
+	DropJobs(false);
+	m_dec_tail.clear();
+	m_dec_inited = false;
+}
+
+mfxStatus LoopbackBackend::EncodeInit(mfxVideoParam *par){
+	if (!par)
+		return MFX_ERR_NULL_PTR;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_opened)
+		return MFX_ERR_NOT_INITIALIZED;
+	if (par->mfx.CodecId != MFX_CODEC_AVC && par->mfx.CodecId != MFX_CODEC_HEVC)
+		return MFX_ERR_INVALID_VIDEO_PARAM;
+	PixelFormatDesc format;
+	if (!GetSurfaceFormat(par->mfx.FrameInfo.FourCC, format))
+		return MFX_ERR_INVALID_VIDEO_PARAM;
+	m_enc_param = *par;
+	if (!m_enc_param.mfx.GopRefDist)
+		m_enc_param.mfx.GopRefDist = 1;	// the default here is no b frames
+	m_enc_frame_order = 0;
+	m_enc_inited = true;
+	return MFX_ERR_NONE;
+}
+
+mfxStatus LoopbackBackend::EncodeQueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest *request){
+	if (!par || !request)
+		return MFX_ERR_NULL_PTR;
+	int delay = par->mfx.GopRefDist > 1 ? par->mfx.GopRefDist - 1 : 0;
+	request->Info = par->mfx.FrameInfo;
+	request->NumFrameMin = delay + 1;
+	request->NumFrameSuggested = request->NumFrameMin + par->AsyncDepth;
+	return MFX_ERR_NONE;
+}
+
+mfxStatus LoopbackBackend::EncodeGetVideoParam(mfxVideoParam *par){
+	if (!par)
+		return MFX_ERR_NULL_PTR;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_enc_inited)
+		return MFX_ERR_NOT_INITIALIZED;
+	*par = m_enc_param;
+	return MFX_ERR_NONE;
+}
+
+mfxStatus LoopbackBackend::EncodeFrameAsync(mfxEncodeCtrl *ctrl, mfxFrameSurface1 *surface,
+		mfxBitstream *bs, mfxSyncPoint *syncp){
+	if (!bs || !syncp)
+		return MFX_ERR_NULL_PTR;
+	*syncp = nullptr;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_enc_inited)
+		return MFX_ERR_NOT_INITIALIZED;
+	if ((int)m_jobs.size() >= m_params.async_depth)
+		return MFX_WRN_DEVICE_BUSY;
+
+	if (surface){
+		PendingInput input;
+		input.surface = surface;
+		input.frame_type = ctrl ? ctrl->FrameType : 0;
+		surface->Data.Locked++;
+		m_enc_pending.push_back(input);
+	}
+
+	// b frames hold back GopRefDist - 1 inputs before the first output
+	size_t delay = m_enc_param.mfx.GopRefDist > 1 ? m_enc_param.mfx.GopRefDist - 1 : 0;
+	if (m_enc_pending.empty() || (surface && m_enc_pending.size() <= delay))
+		return MFX_ERR_MORE_DATA;
+
+	PendingInput input = m_enc_pending.front();
+	m_enc_pending.pop_front();
+
+	int gop = m_enc_param.mfx.GopPicSize;
+	Job job;
+	job.encode = true;
+	job.surface = input.surface;
+	job.bs = bs;
+	job.frame_order = m_enc_frame_order++;
+	if (job.frame_order == 0 || (gop > 0 && job.frame_order % gop == 0) || (input.frame_type & MFX_FRAMETYPE_IDR))
+		job.frame_type = MFX_FRAMETYPE_I | MFX_FRAMETYPE_REF | MFX_FRAMETYPE_IDR;
+	else if (input.frame_type && !(input.frame_type & MFX_FRAMETYPE_REF))
+		job.frame_type = MFX_FRAMETYPE_P;
+	else
+		job.frame_type = MFX_FRAMETYPE_P | MFX_FRAMETYPE_REF;
+	*syncp = Submit(job);
+	return MFX_ERR_NONE;
+}
+
+void LoopbackBackend::EncodeClose(){
+	std::lock_guard<std::mutex> lock(m_mutex);
+	DropJobs(true);
+	for (auto & input : m_enc_pending){
+		if (input.surface->Data.Locked)
+			input.surface->Data.Locked--;
+	}
+	m_enc_pending.clear();
+	m_enc_inited = false;
+}
+
+mfxStatus LoopbackBackend::Complete(const Job & job){
+	if (!job.encode){
+		FillPicture(job.surface, job.frame_order);
+		job.surface->Data.FrameOrder = job.frame_order;
+		job.surface->Data.Locked--;
+		return MFX_ERR_NONE;
+	}
+
+	mfxBitstream *bs = job.bs;
+	mfxU32 codec = m_enc_param.mfx.CodecId;
+	mfxFrameInfo & info = m_enc_param.mfx.FrameInfo;
+	int header = NalHeaderLen(codec);
+	bool idr = (job.frame_type & MFX_FRAMETYPE_IDR) != 0;
+
+	char sps[64] = {0};
+	int sps_len = 0;
+	if (idr)
+		sps_len = snprintf(sps, sizeof(sps), LOOPBACK_TAG " %d %d %d %d", info.CropW, info.CropH,
+				info.BitDepthLuma ? info.BitDepthLuma : 8, info.ChromaFormat ? info.ChromaFormat : (mfxU16)MFX_CHROMAFORMAT_YUV420);
+	char order[16] = {0};
+	int order_len = snprintf(order, sizeof(order), "%u", job.frame_order);
+	int slice_len = m_params.frame_bytes * (idr ? 4 : 1);
+	if (slice_len < order_len + 1)
+		slice_len = order_len + 1;
+
+	mfxU32 need = (idr ? 4 + header + sps_len : 0) + 4 + header + slice_len;
+	job.surface->Data.Locked--;
+	if (bs->MaxLength - bs->DataOffset - bs->DataLength < need)
+		return MFX_ERR_NOT_ENOUGH_BUFFER;
+
+	mfxU8 *out = bs->Data + bs->DataOffset + bs->DataLength;
+	mfxU8 *begin = out;
+	if (idr){
+		out = WriteNalHeader(out, codec, 0x67, 33);
+		memcpy(out, sps, sps_len);
+		out += sps_len;
+	}
+	if (idr)
+		out = WriteNalHeader(out, codec, 0x65, 19);
+	else if (job.frame_type & MFX_FRAMETYPE_REF)
+		out = WriteNalHeader(out, codec, 0x41, 1);
+	else
+		out = WriteNalHeader(out, codec, 0x01, 0);	// nal_ref_idc 0 / TRAIL_N
+	/*
+	first slice flag set (for avc first_mb_in_slice 0 and slice_type 7 or 5, so
+	a stream index tells I from P), then the frame order as text and filler
+	without zero bytes
+	*/
+	*out++ = (job.frame_type & MFX_FRAMETYPE_I) ? 0x88 : 0x98;
+	memcpy(out, order, order_len);
+	memset(out + order_len, 0xAA, slice_len - order_len - 1);
+	out += slice_len - 1;
+
+	bs->DataLength += (mfxU32)(out - begin);
+	bs->FrameType = job.frame_type;
+	bs->TimeStamp = job.surface->Data.TimeStamp;
+	return MFX_ERR_NONE;
+}
+
+mfxStatus LoopbackBackend::SyncOperation(mfxSyncPoint syncp, mfxU32 wait){
+	if (!syncp)
+		return MFX_ERR_NULL_PTR;
+	uint64_t id = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(syncp));
+	auto find = [&]() {
+		for (auto iter = m_jobs.begin(); iter != m_jobs.end(); iter++){
+			if (iter->id == id)
+				return iter;
+		}
+		return m_jobs.end();
+	};
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	auto iter = find();
+	if (iter == m_jobs.end())
+		return MFX_ERR_INVALID_HANDLE;
+
+	auto now = std::chrono::steady_clock::now();
+	if (iter->ready > now){
+		auto deadline = now + std::chrono::milliseconds(wait);
+		bool done = iter->ready <= deadline;
+		auto until = done ? iter->ready : deadline;
+		lock.unlock();
+		std::this_thread::sleep_until(until);
+		if (!done)
+			return MFX_WRN_IN_EXECUTION;
+		lock.lock();
+		iter = find();
+		if (iter == m_jobs.end())
+			return MFX_ERR_ABORTED;
+	}
+
+	Job job = *iter;
+	m_jobs.erase(iter);
+	return Complete(job);
+}
@@ -0,0 +1,93 @@
+#ifndef _H_LOOPBACKBACKEND_
+#define _H_LOOPBACKBACKEND_
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "CodecBackend.h"
+#include "Def.h"
+
+struct LoopbackParams{
+	int latency_us = 0;		// time from submit until the sync point is ready
+	int async_depth = 4;	// jobs in flight before MFX_WRN_DEVICE_BUSY
+	int width = 1920;		// picture size used when the stream has no loopback header
+	int height = 1080;
+	int bit_depth = 8;
+	VideoChromaFormat chroma_format = VideoChromaFormat::YUV420;
+	int frame_bytes = 4096;	// coded size of a P frame, IDR frames are 4x
+};
+
+/*
+Deterministic software stand-in for the media sdk.
+The encoder writes an annex-b stream whose SPS carries "LBK width height depth chroma"
+and whose slices are filler, the decoder turns every picture of any annex-b
+stream into one frame filled with a pattern derived from the frame order.
+Surfaces are locked while a job holds them and the sync points only become
+ready latency_us after submission, so surface pooling, DEVICE_BUSY and
+MORE_DATA handling behave like on the gpu. mfxEncodeCtrl frame types
+(forced IDR, non-reference P) are always honoured.
+*/
+class LoopbackBackend : public CodecBackend {
+public:
+	explicit LoopbackBackend(const LoopbackParams & params = LoopbackParams());
+	~LoopbackBackend();
+	bool Open() override;
+	void Close() override;
+
+	mfxStatus DecodeHeader(mfxBitstream *bs, mfxVideoParam *par) override;
+	mfxStatus DecodeInit(mfxVideoParam *par) override;
+	mfxStatus DecodeQueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest *request) override;
+	mfxStatus DecodeFrameAsync(mfxBitstream *bs, mfxFrameSurface1 *surface_work,
+			mfxFrameSurface1 **surface_out, mfxSyncPoint *syncp) override;
+	mfxStatus DecodeReset(mfxVideoParam *par) override;
+	void DecodeClose() override;
+
+	mfxStatus EncodeInit(mfxVideoParam *par) override;
+	mfxStatus EncodeQueryIOSurf(mfxVideoParam *par, mfxFrameAllocRequest *request) override;
+	mfxStatus EncodeGetVideoParam(mfxVideoParam *par) override;
+	mfxStatus EncodeFrameAsync(mfxEncodeCtrl *ctrl, mfxFrameSurface1 *surface,
+			mfxBitstream *bs, mfxSyncPoint *syncp) override;
+	void EncodeClose() override;
+
+	mfxStatus SyncOperation(mfxSyncPoint syncp, mfxU32 wait) override;
+private:
+	struct Job{
+		uint64_t id = 0;
+		bool encode = false;
+		std::chrono::steady_clock::time_point ready;
+		mfxFrameSurface1 * surface = nullptr;
+		mfxBitstream * bs = nullptr;
+		mfxU16 frame_type = 0;
+		mfxU32 frame_order = 0;
+	};
+	struct PendingInput{
+		mfxFrameSurface1 * surface = nullptr;
+		mfxU16 frame_type = 0;
+	};
+	mfxSyncPoint Submit(Job & job);
+	mfxStatus Complete(const Job & job);
+	bool ParseHeader(const mfxU8 *data, int len, mfxVideoParam *par);
+	void DrawPattern(const mfxFrameInfo & info);
+	void FillPicture(mfxFrameSurface1 *surface, mfxU32 order);
+	void DropJobs(bool encode);
+private:
+	LoopbackParams m_params;
+	std::mutex m_mutex;
+	std::deque<Job> m_jobs;
+	uint64_t m_next_id = 1;
+	bool m_opened = false;
+private:
+	mfxVideoParam m_dec_param;
+	bool m_dec_inited = false;
+	std::vector<mfxU8> m_dec_tail;
+	std::vector<mfxU8> m_dec_pattern;
+	mfxU32 m_dec_frame_order = 0;
+private:
+	mfxVideoParam m_enc_param;
+	bool m_enc_inited = false;
+	std::deque<PendingInput> m_enc_pending;
+	mfxU32 m_enc_frame_order = 0;
+};
+#endif
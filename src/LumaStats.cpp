@@ -0,0 +1,161 @@
+#include <string.h>
+
+#include "LumaStats.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// vectors per block before the 32 bit lanes are folded into 64 bit sums
+#define LUMA_STATS_BLOCK 64
+
+void LumaStats::Reset(int width, int height, int sample_bytes, int bit_depth, int shift){
+	bool same = width == m_width && height == m_height && sample_bytes == m_sample_bytes && bit_depth == m_bit_depth;
+	m_sad = m_complete && same;
+	m_complete = false;
+	m_width = width;
+	m_height = height;
+	m_sample_bytes = sample_bytes;
+	m_bit_depth = bit_depth < 8 ? 8 : bit_depth;
+	m_shift = shift;
+	m_count = 0;
+	m_sum = 0;
+	m_sum_sq = 0;
+	m_sad_sum = 0;
+	memset(m_histogram, 0, sizeof(m_histogram));
+	if ((int)m_cur.size() < width){
+		m_cur.resize(width);
+		m_prev.resize(width);
+	}
+}
+
+void LumaStats::Row(const void * cur, const void * prev){
+	if (!prev)
+		m_sad = false;
+	if (m_sample_bytes == 1)
+		Row8((const uint8_t*)cur, m_sad ? (const uint8_t*)prev : nullptr);
+	else
+		Row16((const uint16_t*)cur, m_sad ? (const uint16_t*)prev : nullptr, m_shift);
+}
+
+void LumaStats::ScratchRow(bool with_prev){
+	if (!with_prev)
+		m_sad = false;
+	Row16(m_cur.data(), m_sad ? m_prev.data() : nullptr, 0);
+}
+
+// 8 bit bins are exact, Finish takes the sums from the histogram
+void LumaStats::Row8(const uint8_t * cur, const uint8_t * prev){
+	if (prev){
+		int x = 0;
+#ifdef __SSE2__
+		__m128i sad = _mm_setzero_si128();
+		for (; x + 16 <= m_width; x += 16)
+			sad = _mm_add_epi64(sad, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(cur + x)),
+					_mm_loadu_si128((const __m128i*)(prev + x))));
+		uint64_t halves[2];
+		_mm_storeu_si128((__m128i*)halves, sad);
+		m_sad_sum += halves[0] + halves[1];
+#endif
+		for (; x < m_width; x++)
+			m_sad_sum += cur[x] > prev[x] ? cur[x] - prev[x] : prev[x] - cur[x];
+	}
+
+	uint32_t (*hist)[256] = m_histogram;
+	int i = 0;
+	for (; i + 8 <= m_width; i += 8){
+		uint64_t v;
+		memcpy(&v, cur + i, 8);
+		hist[0][v & 0xFF]++;
+		hist[1][(v >> 8) & 0xFF]++;
+		hist[2][(v >> 16) & 0xFF]++;
+		hist[3][(v >> 24) & 0xFF]++;
+		hist[4][(v >> 32) & 0xFF]++;
+		hist[5][(v >> 40) & 0xFF]++;
+		hist[6][(v >> 48) & 0xFF]++;
+		hist[7][v >> 56]++;
+	}
+	for (; i < m_width; i++)
+		hist[0][cur[i]]++;
+	m_count += m_width;
+}
+
+void LumaStats::Row16(const uint16_t * cur, const uint16_t * prev, int shift){
+	int x = 0;
+#ifdef __SSE2__
+	const __m128i ones = _mm_set1_epi16(1);
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	while (x + 8 <= m_width){
+		__m128i sum = _mm_setzero_si128();
+		__m128i sum_sq = _mm_setzero_si128();
+		__m128i sad = _mm_setzero_si128();
+		for (int n = 0; n < LUMA_STATS_BLOCK && x + 8 <= m_width; n++, x += 8){
+			__m128i v = _mm_srl_epi16(_mm_loadu_si128((const __m128i*)(cur + x)), count);
+			sum = _mm_add_epi32(sum, _mm_madd_epi16(v, ones));
+			sum_sq = _mm_add_epi32(sum_sq, _mm_madd_epi16(v, v));
+			if (prev){
+				__m128i p = _mm_srl_epi16(_mm_loadu_si128((const __m128i*)(prev + x)), count);
+				__m128i diff = _mm_or_si128(_mm_subs_epu16(v, p), _mm_subs_epu16(p, v));
+				sad = _mm_add_epi32(sad, _mm_madd_epi16(diff, ones));
+			}
+		}
+		uint32_t lanes[4];
+		_mm_storeu_si128((__m128i*)lanes, sum);
+		m_sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		_mm_storeu_si128((__m128i*)lanes, sum_sq);
+		m_sum_sq += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		_mm_storeu_si128((__m128i*)lanes, sad);
+		m_sad_sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+#endif
+	for (int i = x; i < m_width; i++){
+		uint64_t v = cur[i] >> shift;
+		m_sum += v;
+		m_sum_sq += v * v;
+		if (prev){
+			uint64_t p = prev[i] >> shift;
+			m_sad_sum += v > p ? v - p : p - v;
+		}
+	}
+
+	int bin_shift = shift + m_bit_depth - 8;
+	uint32_t (*hist)[256] = m_histogram;
+	int i = 0;
+	for (; i + 8 <= m_width; i += 8){
+		hist[0][(cur[i] >> bin_shift) & 0xFF]++;
+		hist[1][(cur[i + 1] >> bin_shift) & 0xFF]++;
+		hist[2][(cur[i + 2] >> bin_shift) & 0xFF]++;
+		hist[3][(cur[i + 3] >> bin_shift) & 0xFF]++;
+		hist[4][(cur[i + 4] >> bin_shift) & 0xFF]++;
+		hist[5][(cur[i + 5] >> bin_shift) & 0xFF]++;
+		hist[6][(cur[i + 6] >> bin_shift) & 0xFF]++;
+		hist[7][(cur[i + 7] >> bin_shift) & 0xFF]++;
+	}
+	for (; i < m_width; i++)
+		hist[0][(cur[i] >> bin_shift) & 0xFF]++;
+	m_count += m_width;
+}
+
+void LumaStats::Finish(VideoFrameStats & stats){
+	for (int b = 0; b < 256; b++){
+		stats.histogram[b] = 0;
+		for (int k = 0; k < 8; k++)
+			stats.histogram[b] += m_histogram[k][b];
+	}
+	if (m_bit_depth == 8){
+		m_sum = 0;
+		m_sum_sq = 0;
+		for (uint64_t b = 0; b < 256; b++){
+			m_sum += b * stats.histogram[b];
+			m_sum_sq += b * b * stats.histogram[b];
+		}
+	}
+	double scale = 1.0 / (1 << (m_bit_depth - 8));
+	double mean = m_count ? (double)m_sum / m_count : 0;
+	double variance = m_count ? (double)m_sum_sq / m_count - mean * mean : 0;
+	stats.mean = mean * scale;
+	stats.variance = (variance > 0 ? variance : 0) * scale * scale;
+	stats.has_sad = m_sad && m_count;
+	stats.sad = stats.has_sad ? (double)m_sad_sum / m_count * scale : 0;
+	m_complete = true;
+}
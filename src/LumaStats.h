@@ -0,0 +1,51 @@
+#ifndef _H_LUMASTATS_
+#define _H_LUMASTATS_
+
+#include <stdint.h>
+#include <vector>
+
+#include "Def.h"
+
+/*
+Luma histogram, mean/variance and SAD to the previous frame, accumulated row
+by row so the conversion loops can feed it while the rows are in cache. Sums
+and the SAD run on SSE2, the histogram spreads over eight tables so repeated
+bins do not serialize on one counter.
+The previous frame is not kept: a caller that overwrites it in place (the
+decoder's output buffer) passes the old row along with the new one. SAD is
+reported when every row of the frame had one and the last frame finished with
+the same geometry.
+*/
+class LumaStats {
+public:
+	// sample_bytes 1 or 2, shift is how far 2 byte samples sit above lsb alignment
+	void Reset(int width, int height, int sample_bytes, int bit_depth, int shift);
+	// width samples of the new frame, prev is the same row of the previous one or nullptr
+	void Row(const void * cur, const void * prev);
+	// lsb aligned 2 byte scratch rows for layouts whose luma is not contiguous
+	uint16_t * CurScratch(){ return m_cur.data(); }
+	uint16_t * PrevScratch(){ return m_prev.data(); }
+	void ScratchRow(bool with_prev);
+	void Finish(VideoFrameStats & stats);
+	// the previous frame is gone, e.g. its buffer was freed
+	void ForgetPrevious(){ m_complete = false; }
+private:
+	void Row8(const uint8_t * cur, const uint8_t * prev);
+	void Row16(const uint16_t * cur, const uint16_t * prev, int shift);
+private:
+	int m_width = 0;
+	int m_height = 0;
+	int m_sample_bytes = 1;
+	int m_bit_depth = 8;
+	int m_shift = 0;
+	bool m_complete = false;	// the last frame went through Finish
+	bool m_sad = false;			// every row so far came with its previous row
+	uint64_t m_count = 0;
+	uint64_t m_sum = 0;
+	uint64_t m_sum_sq = 0;
+	uint64_t m_sad_sum = 0;
+	uint32_t m_histogram[8][256];
+	std::vector<uint16_t> m_cur;
+	std::vector<uint16_t> m_prev;
+};
+#endif
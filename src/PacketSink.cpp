@@ -0,0 +1,476 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "PacketSink.h"
+
+struct PacketSink::Uring{
+	int fd = -1;
+	void * sq_ptr = nullptr;
+	size_t sq_len = 0;
+	void * cq_ptr = nullptr;
+	size_t cq_len = 0;
+	struct io_uring_sqe * sqes = nullptr;
+	size_t sqes_len = 0;
+	unsigned * sq_head = nullptr;
+	unsigned * sq_tail = nullptr;
+	unsigned * sq_mask = nullptr;
+	unsigned * sq_array = nullptr;
+	unsigned * cq_head = nullptr;
+	unsigned * cq_tail = nullptr;
+	unsigned * cq_mask = nullptr;
+	struct io_uring_cqe * cqes = nullptr;
+};
+
+PacketSink::~PacketSink(){
+	Close();
+}
+
+bool PacketSink::InitUring(){
+	UnInitUring();
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = (int)syscall(__NR_io_uring_setup, m_params.max_in_flight, &p);
+	if (fd < 0)
+		return false;
+
+	m_uring = new Uring();
+	Uring & r = *m_uring;
+	r.fd = fd;
+	r.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap){
+		if (r.cq_len > r.sq_len)
+			r.sq_len = r.cq_len;
+		r.cq_len = r.sq_len;
+	}
+
+	void * ptr = mmap(nullptr, r.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED){
+		UnInitUring();
+		return false;
+	}
+	r.sq_ptr = ptr;
+	if (single_mmap)
+		r.cq_ptr = r.sq_ptr;
+	else{
+		ptr = mmap(nullptr, r.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED){
+			UnInitUring();
+			return false;
+		}
+		r.cq_ptr = ptr;
+	}
+	r.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(nullptr, r.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED){
+		UnInitUring();
+		return false;
+	}
+	r.sqes = (struct io_uring_sqe*)ptr;
+
+	char * sq = (char*)r.sq_ptr;
+	char * cq = (char*)r.cq_ptr;
+	r.sq_head = (unsigned*)(sq + p.sq_off.head);
+	r.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	r.sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	r.sq_array = (unsigned*)(sq + p.sq_off.array);
+	r.cq_head = (unsigned*)(cq + p.cq_off.head);
+	r.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	r.cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	r.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	return true;
+}
+
+void PacketSink::UnInitUring(){
+	if (!m_uring)
+		return;
+	if (m_uring->sqes)
+		munmap(m_uring->sqes, m_uring->sqes_len);
+	if (m_uring->cq_ptr && m_uring->cq_ptr != m_uring->sq_ptr)
+		munmap(m_uring->cq_ptr, m_uring->cq_len);
+	if (m_uring->sq_ptr)
+		munmap(m_uring->sq_ptr, m_uring->sq_len);
+	if (m_uring->fd >= 0)
+		close(m_uring->fd);
+	delete m_uring;
+	m_uring = nullptr;
+}
+
+// the packets of one writev and how far it got
+struct PacketSink::Batch{
+	enum State { FREE, READY, IN_FLIGHT };
+	State state = FREE;
+	std::vector<Packet*> packets;
+	std::vector<struct iovec> iov;
+	size_t next = 0;		// first iov entry not written completely
+	int64_t offset = -1;	// file offset of the first byte not written yet, -1 for the fd position
+	int64_t written = 0;
+	unsigned sq_tail = 0;	// ring tail its sqe was queued at
+	bool ok = true;
+
+	// moves past n written bytes, true once everything is written
+	bool Advance(size_t n){
+		written += n;
+		if (offset >= 0)
+			offset += n;
+		while (next < iov.size() && n >= iov[next].iov_len){
+			n -= iov[next].iov_len;
+			next++;
+		}
+		if (next < iov.size()){
+			iov[next].iov_base = (char*)iov[next].iov_base + n;
+			iov[next].iov_len -= n;
+		}
+		return next == iov.size();
+	}
+};
+
+// a non-blocking fd that is full, wait until it takes data again
+static bool WaitWritable(int fd){
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	while (poll(&pfd, 1, -1) < 0){
+		if (errno != EINTR)
+			return false;
+	}
+	return true;
+}
+
+bool PacketSink::WriteAll(Batch & batch){
+	while (batch.next < batch.iov.size()){
+		struct iovec * iov = &batch.iov[batch.next];
+		int count = batch.iov.size() - batch.next;
+		ssize_t n = batch.offset >= 0 ? pwritev(m_fd, iov, count, batch.offset) : writev(m_fd, iov, count);
+		if (n < 0){
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && WaitWritable(m_fd))
+				continue;
+			return false;
+		}
+		batch.Advance(n);
+	}
+	return true;
+}
+
+bool PacketSink::Open(const char * path, const PacketSinkParams & params){
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	return Start(fd, true, params);
+}
+
+bool PacketSink::Open(int fd, const PacketSinkParams & params){
+	if (fd < 0)
+		return false;
+	return Start(fd, false, params);
+}
+
+bool PacketSink::Start(int fd, bool own_fd, const PacketSinkParams & params){
+	Close();
+	m_params = params;
+	if (m_params.max_batch < 1)
+		m_params.max_batch = 1;
+	if (m_params.max_batch > IOV_MAX)
+		m_params.max_batch = IOV_MAX;
+	if (m_params.max_in_flight < 1)
+		m_params.max_in_flight = 1;
+	if (m_params.max_in_flight > 64)
+		m_params.max_in_flight = 64;
+	m_fd = fd;
+	m_own_fd = own_fd;
+	// batches written out of order only land in place at explicit offsets of a regular file
+	struct stat st;
+	int flags = fcntl(fd, F_GETFL);
+	off_t pos = lseek(fd, 0, SEEK_CUR);
+	bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && flags >= 0 && !(flags & O_APPEND) && pos >= 0;
+	m_offset = regular ? pos : 0;
+	if (m_params.use_io_uring && regular)
+		InitUring();
+
+	m_stats = PacketSinkStats();
+	m_stats.io_uring = m_uring != nullptr;
+	m_latency_sum_us = 0;
+	m_queue_bytes = 0;
+	m_writing = 0;
+	m_running = true;
+	m_thread = std::thread(&PacketSink::WorkThread, this);
+	return true;
+}
+
+// takes up to max_batch queued packets, under m_mutex
+void PacketSink::TakeBatch(Batch & batch){
+	batch.packets.clear();
+	while (!m_queue.empty() && (int)batch.packets.size() < m_params.max_batch){
+		batch.packets.push_back(m_queue.front());
+		m_queue.pop_front();
+	}
+	batch.iov.resize(batch.packets.size());
+	int64_t bytes = 0;
+	for (size_t i = 0; i < batch.packets.size(); i++){
+		batch.iov[i].iov_base = batch.packets[i]->data.data();
+		batch.iov[i].iov_len = batch.packets[i]->data.size();
+		bytes += batch.iov[i].iov_len;
+	}
+	batch.next = 0;
+	batch.written = 0;
+	batch.ok = true;
+	batch.offset = -1;
+	if (m_uring){
+		batch.offset = m_offset;
+		m_offset += bytes;
+	}
+	m_writing += batch.packets.size();
+}
+
+// counts a finished batch and returns its packets to the free list, under m_mutex
+void PacketSink::FinishBatch(Batch & batch){
+	auto now = std::chrono::steady_clock::now();
+	m_stats.io_uring = m_uring != nullptr;
+	m_stats.batches++;
+	if (!batch.ok)
+		m_stats.write_errors++;
+	int64_t written = batch.written;
+	for (auto packet : batch.packets){
+		int64_t size = packet->data.size();
+		m_queue_bytes -= size;
+		m_free.push_back(packet);
+		// packets the failed write did not get out completely are not counted as written
+		if (written < size){
+			written = 0;
+			m_stats.failed_packets++;
+			m_stats.failed_bytes += size;
+			continue;
+		}
+		written -= size;
+		int64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(now - packet->queued).count();
+		m_latency_sum_us += latency;
+		if (latency > m_stats.max_write_latency_us)
+			m_stats.max_write_latency_us = latency;
+		m_stats.packets++;
+		m_stats.bytes += size;
+	}
+	m_writing -= batch.packets.size();
+	batch.packets.clear();
+	batch.state = Batch::FREE;
+	m_cond.notify_all();
+}
+
+void PacketSink::WorkThread(){
+	if (m_uring && UringWork())
+		return;
+	// pipes and sockets: one blocking writev at a time, the asynchrony is this thread alone
+	Batch batch;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true){
+		m_cond.wait(lock, [this]{ return !m_running || !m_queue.empty(); });
+		if (m_queue.empty())
+			break;
+		TakeBatch(batch);
+		lock.unlock();
+		batch.ok = WriteAll(batch);
+		lock.lock();
+		FinishBatch(batch);
+	}
+}
+
+/*
+io_uring on a regular file: up to max_in_flight batches are written at once,
+each at the offset reserved for it when it was taken, so they may complete in
+any order. Completions are reaped on the next submit, the worker only blocks
+in io_uring_enter when every slot is busy or nothing new was queued. Whenever
+nothing is in flight the fd position is moved to the end of the written data,
+so a caller sharing the fd writes after the packets. Returns false, with
+nothing in flight, when the kernel cannot writev this fd through io_uring.
+*/
+bool PacketSink::UringWork(){
+	Uring & r = *m_uring;
+	std::vector<Batch> batches(m_params.max_in_flight);
+	std::vector<Batch*> done;
+	int in_flight = 0;
+	bool fallback = false;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true){
+		if (!in_flight){
+			if (fallback)
+				break;
+			m_cond.wait(lock, [this]{ return !m_running || !m_queue.empty(); });
+			if (m_queue.empty())
+				break;
+		}
+		bool taken = false;
+		for (auto & batch : batches){
+			if (fallback || m_queue.empty())
+				break;
+			if (batch.state != Batch::FREE)
+				continue;
+			TakeBatch(batch);
+			batch.state = Batch::READY;
+			in_flight++;
+			taken = true;
+		}
+		lock.unlock();
+
+		for (size_t i = 0; i < batches.size(); i++){
+			Batch & batch = batches[i];
+			if (batch.state != Batch::READY)
+				continue;
+			unsigned tail = *r.sq_tail;
+			unsigned index = tail & *r.sq_mask;
+			struct io_uring_sqe * sqe = &r.sqes[index];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_WRITEV;
+			sqe->fd = m_fd;
+			sqe->addr = (uint64_t)(uintptr_t)&batch.iov[batch.next];
+			sqe->len = batch.iov.size() - batch.next;
+			sqe->off = (uint64_t)batch.offset;
+			sqe->user_data = i;
+			r.sq_array[index] = index;
+			__atomic_store_n(r.sq_tail, tail + 1, __ATOMIC_RELEASE);
+			batch.sq_tail = tail;
+			batch.state = Batch::IN_FLIGHT;
+		}
+
+		done.clear();
+		unsigned tail = *r.sq_tail;
+		unsigned to_submit = tail - __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE);
+		bool wait = fallback || !taken || in_flight == (int)batches.size();
+		int ret = (int)syscall(__NR_io_uring_enter, r.fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY){
+			// sqes the kernel did not take are withdrawn and their batches failed,
+			// when there were none the ring itself is gone (EBADF/EFAULT) and nothing will complete
+			unsigned head = __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE);
+			__atomic_store_n(r.sq_tail, head, __ATOMIC_RELEASE);
+			for (auto & batch : batches){
+				if (batch.state == Batch::IN_FLIGHT && (!to_submit || (int)(batch.sq_tail - head) >= 0)){
+					batch.ok = false;
+					batch.state = Batch::FREE;
+					done.push_back(&batch);
+				}
+			}
+			if (!to_submit)
+				fallback = true;
+		}
+
+		unsigned head = *r.cq_head;
+		while (head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)){
+			struct io_uring_cqe * cqe = &r.cqes[head & *r.cq_mask];
+			Batch & batch = batches[cqe->user_data];
+			int res = cqe->res;
+			head++;
+			if (batch.state != Batch::IN_FLIGHT)
+				continue;
+			// a short write or EAGAIN is submitted again from where it stopped
+			batch.state = Batch::READY;
+			if (res > 0){
+				if (batch.Advance(res))
+					done.push_back(&batch);
+			}else if (res == -EINVAL || res == -EOPNOTSUPP){
+				// kernel without writev support on this fd, stay on writev from now on
+				fallback = true;
+				batch.ok = WriteAll(batch);
+				done.push_back(&batch);
+			}else if (res != -EAGAIN && res != -EINTR){
+				batch.ok = false;
+				done.push_back(&batch);
+			}
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+
+		in_flight -= done.size();
+		if (!done.empty() && !in_flight)
+			lseek(m_fd, m_offset, SEEK_SET);
+		lock.lock();
+		for (auto batch : done)
+			FinishBatch(*batch);
+	}
+	lock.unlock();
+	if (!fallback)
+		return true;
+	UnInitUring();
+	return false;
+}
+
+bool PacketSink::Write(const unsigned char * data, int len){
+	if (!data || len <= 0)
+		return false;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (!m_running)
+		return false;
+	// a packet larger than the whole budget still goes through once the queue is drained
+	m_cond.wait(lock, [&]{ return !m_running || m_queue_bytes == 0 || m_queue_bytes + len <= m_params.max_queue_bytes; });
+	if (!m_running)
+		return false;
+	m_queue_bytes += len;
+	Packet * packet = nullptr;
+	if (!m_free.empty()){
+		packet = m_free.back();
+		m_free.pop_back();
+	}else
+		packet = new Packet();
+	packet->data.assign(data, data + len);
+	packet->queued = std::chrono::steady_clock::now();
+	m_queue.push_back(packet);
+	if ((int)m_queue.size() > m_stats.max_queue_depth)
+		m_stats.max_queue_depth = m_queue.size();
+	m_cond.notify_all();
+	return true;
+}
+
+bool PacketSink::Write(const VideoBitStream & stream){
+	if (!stream.mfx_bit_stream || !stream.mfx_bit_stream->Data)
+		return false;
+	return Write(stream.mfx_bit_stream->Data + stream.mfx_bit_stream->DataOffset, stream.mfx_bit_stream->DataLength);
+}
+
+void PacketSink::Flush(){
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_cond.wait(lock, [this]{ return !m_running || (m_queue.empty() && m_writing == 0); });
+}
+
+void PacketSink::Close(){
+	if (m_thread.joinable()){
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_running = false;
+			m_cond.notify_all();
+		}
+		m_thread.join();
+	}
+	m_running = false;
+	if (m_uring)
+		lseek(m_fd, m_offset, SEEK_SET);
+	UnInitUring();
+	if (m_own_fd && m_fd >= 0)
+		close(m_fd);
+	m_fd = -1;
+	m_own_fd = false;
+
+	for (auto packet : m_queue)
+		delete packet;
+	m_queue.clear();
+	for (auto packet : m_free)
+		delete packet;
+	m_free.clear();
+	m_queue_bytes = 0;
+}
+
+void PacketSink::GetStats(PacketSinkStats & stats){
+	std::lock_guard<std::mutex> lock(m_mutex);
+	stats = m_stats;
+	stats.queue_depth = m_queue.size();
+	stats.queue_bytes = m_queue_bytes;
+	stats.avg_write_latency_us = m_stats.packets ? m_latency_sum_us / (int64_t)m_stats.packets : 0;
+}
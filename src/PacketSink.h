@@ -0,0 +1,88 @@
+#ifndef _H_PACKETSINK_
+#define _H_PACKETSINK_
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Def.h"
+
+struct PacketSinkParams{
+	int max_queue_bytes = 16 * 1024 * 1024;	// Write blocks once this much is waiting
+	int max_batch = 64;						// packets gathered into one writev
+	int max_in_flight = 4;					// io_uring batches written at once
+	bool use_io_uring = true;				// regular files only, falls back to writev when io_uring is unavailable
+};
+
+struct PacketSinkStats{
+	uint64_t packets = 0;		// written completely
+	uint64_t bytes = 0;
+	uint64_t batches = 0;
+	uint64_t write_errors = 0;	// batches that failed, their packets are counted below
+	uint64_t failed_packets = 0;
+	uint64_t failed_bytes = 0;
+	int queue_depth = 0;		// packets waiting to be written
+	int max_queue_depth = 0;
+	int64_t queue_bytes = 0;
+	int64_t avg_write_latency_us = 0;	// Write() to completion of the batch holding the packet, written packets only
+	int64_t max_write_latency_us = 0;
+	bool io_uring = false;
+};
+
+/*
+Writes encoded packets (annex-b as produced by VideoEncoder) to a file or pipe
+from a worker thread. Write() only copies the packet into a bounded queue,
+the worker gathers up to max_batch packets into one writev. On a regular file
+up to max_in_flight of these batches are in flight through io_uring, each at
+its own offset. Pipes and sockets get one blocking writev at a time, there the
+worker thread alone provides the asynchrony.
+*/
+class PacketSink {
+public:
+	PacketSink() = default;
+	~PacketSink();
+	bool Open(const char * path, const PacketSinkParams & params = PacketSinkParams());
+	bool Open(int fd, const PacketSinkParams & params = PacketSinkParams());
+	bool Write(const unsigned char * data, int len);
+	bool Write(const VideoBitStream & stream);
+	void Flush();
+	void Close();
+	void GetStats(PacketSinkStats & stats);
+private:
+	struct Packet{
+		std::vector<unsigned char> data;
+		std::chrono::steady_clock::time_point queued;
+	};
+	struct Batch;
+	struct Uring;
+	bool Start(int fd, bool own_fd, const PacketSinkParams & params);
+	void WorkThread();
+	void TakeBatch(Batch & batch);
+	void FinishBatch(Batch & batch);
+	bool WriteAll(Batch & batch);
+	bool InitUring();
+	void UnInitUring();
+	bool UringWork();
+private:
+	PacketSinkParams m_params;
+	int m_fd = -1;
+	bool m_own_fd = false;
+	int64_t m_offset = 0;		// end of the data handed to io_uring
+	Uring * m_uring = nullptr;
+private:
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<Packet*> m_queue;
+	std::vector<Packet*> m_free;
+	int64_t m_queue_bytes = 0;
+	int m_writing = 0;
+	bool m_running = false;
+	PacketSinkStats m_stats;
+	int64_t m_latency_sum_us = 0;
+};
+#endif
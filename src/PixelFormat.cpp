@@ -0,0 +1,495 @@
+#include <string.h>
+#include <stdlib.h>
+#include <type_traits>
+
+#include "PixelFormat.h"
+
+#define MSDK_ALIGN32(X) (((mfxU32)((X)+31)) & (~ (mfxU32)31))
+
+template <class Src, class Dst>
+constexpr bool Compatible(){
+	return Src::bit_depth == Dst::bit_depth && Src::chroma_shift_x == Dst::chroma_shift_x &&
+			Src::chroma_shift_y == Dst::chroma_shift_y;
+}
+
+static void PlaneSize(const PixelFormatDesc & desc, int plane, int width, int height, int & row_bytes, int & rows){
+	int chroma_width = (width + (1 << desc.chroma_shift_x) - 1) >> desc.chroma_shift_x;
+	int chroma_height = (height + (1 << desc.chroma_shift_y) - 1) >> desc.chroma_shift_y;
+	if (plane == 0){
+		// packed rows carry whole chroma sites, Y0 U Y1 V even for odd widths
+		row_bytes = (desc.planes == 1 ? chroma_width << desc.chroma_shift_x : width) * desc.pixel_bytes;
+		rows = height;
+	}else if (plane >= desc.planes){
+		row_bytes = 0;
+		rows = 0;
+	}else{
+		row_bytes = chroma_width * desc.sample_bytes * (desc.planes == 2 ? 2 : 1);
+		rows = chroma_height;
+	}
+}
+
+/*
+per-row work on the raw side of a transfer while the rows are in cache.
+rows are hashed right after the kernel wrote or read them, packed rows are
+only complete after the chroma pass, so they are hashed there.
+luma stats are taken before a luma row is stored: when decoding, the raw row
+about to be overwritten still holds the previous frame.
+*/
+struct RowTap{
+	FrameHash * hash;
+	LumaStats * stats;
+	FrameRef raw;
+	int planes;
+	bool to_surface;
+	template <class Src, class Dst>
+	void Luma(const FrameRef & src, const FrameRef & dst, int width, int y){
+		if (!stats)
+			return;
+		if (Src::luma_plane && Dst::luma_plane && sizeof(typename Src::Sample) == sizeof(typename Dst::Sample) &&
+				src.shift == dst.shift){
+			stats->Row(src.plane[0] + y * src.pitch[0], to_surface ? nullptr : dst.plane[0] + y * dst.pitch[0]);
+			return;
+		}
+		uint16_t * cur = stats->CurScratch();
+		uint16_t * prev = stats->PrevScratch();
+		for (int x = 0; x < width; x++)
+			cur[x] = (uint16_t)Src::LoadLuma(src, x, y);
+		if (!to_surface){
+			for (int x = 0; x < width; x++)
+				prev[x] = (uint16_t)Dst::LoadLuma(dst, x, y);
+		}
+		stats->ScratchRow(!to_surface);
+	}
+	void Row(int p, int y){
+		if (hash)
+			hash->rows[p].Update(raw.plane[p] + y * raw.pitch[p]);
+	}
+	void LumaRow(int y){
+		if (planes > 1)
+			Row(0, y);
+	}
+	void ChromaRow(int y){
+		if (planes == 1)
+			Row(0, y);
+		for (int p = 1; p < planes; p++)
+			Row(p, y);
+	}
+};
+
+/*
+same layout on both sides, rows are copied as they are
+*/
+template <class L>
+static void CopyFrame(FrameRef src, FrameRef dst, int width, int height, RowTap * tap){
+	PixelFormatDesc desc = DescribeLayout<L>(0, VideoBaseBandFmt::NONE);
+	for (int p = 0; p < L::planes; p++){
+		int row_bytes = 0;
+		int rows = 0;
+		PlaneSize(desc, p, width, height, row_bytes, rows);
+		for (int y = 0; y < rows; y++){
+			if (tap && p == 0)
+				tap->Luma<L, L>(src, dst, width, y);
+			memcpy(dst.plane[p] + y * dst.pitch[p], src.plane[p] + y * src.pitch[p], row_bytes);
+			if (tap)
+				tap->Row(p, y);
+		}
+	}
+}
+
+/*
+src and dst are taken by value so the compiler can keep the plane pointers
+in registers, the stores through them may alias anything
+*/
+template <class Src, class Dst>
+static void ConvertFrame(FrameRef src, FrameRef dst, int width, int height, RowTap * tap){
+	if (Src::luma_plane && Dst::luma_plane && sizeof(typename Src::Sample) == sizeof(typename Dst::Sample) &&
+			src.shift == dst.shift){
+		for (int y = 0; y < height; y++){
+			if (tap)
+				tap->Luma<Src, Dst>(src, dst, width, y);
+			memcpy(dst.plane[0] + y * dst.pitch[0], src.plane[0] + y * src.pitch[0], width * sizeof(typename Src::Sample));
+			if (tap)
+				tap->LumaRow(y);
+		}
+	}else{
+		for (int y = 0; y < height; y++){
+			if (tap)
+				tap->Luma<Src, Dst>(src, dst, width, y);
+			for (int x = 0; x < width; x++)
+				Dst::StoreLuma(dst, x, y, Src::LoadLuma(src, x, y));
+			if (tap)
+				tap->LumaRow(y);
+		}
+	}
+
+	int chroma_width = (width + (1 << Src::chroma_shift_x) - 1) >> Src::chroma_shift_x;
+	int chroma_height = (height + (1 << Src::chroma_shift_y) - 1) >> Src::chroma_shift_y;
+	for (int y = 0; y < chroma_height; y++){
+		for (int x = 0; x < chroma_width; x++){
+			int u = 0;
+			int v = 0;
+			Src::LoadChroma(src, x, y, u, v);
+			Dst::StoreChroma(dst, x, y, u, v);
+		}
+		if (tap)
+			tap->ChromaRow(y);
+	}
+}
+
+template <class Src, class Dst>
+static bool Convert(const FrameRef &, const FrameRef &, int, int, RowTap *, std::false_type){
+	return false;
+}
+
+template <class Src, class Dst>
+static bool Convert(const FrameRef & src, const FrameRef & dst, int width, int height, RowTap * tap, std::true_type){
+	if (std::is_same<Src, Dst>::value && src.shift == dst.shift)
+		CopyFrame<Src>(src, dst, width, height, tap);
+	else
+		ConvertFrame<Src, Dst>(src, dst, width, height, tap);
+	return true;
+}
+
+template <class Raw, class Surface>
+static bool Transfer(bool to_surface, const FrameRef & raw, const FrameRef & surface, int width, int height,
+		RowTap * tap){
+	std::integral_constant<bool, Compatible<Raw, Surface>()> compatible;
+	if (to_surface)
+		return Convert<Raw, Surface>(raw, surface, width, height, tap, compatible);
+	return Convert<Surface, Raw>(surface, raw, width, height, tap, compatible);
+}
+
+template <class Surface>
+static bool TransferRaw(VideoBaseBandFmt fmt, bool to_surface, const FrameRef & raw, const FrameRef & surface, int width, int height,
+		RowTap * tap){
+	switch(fmt){
+		case VideoBaseBandFmt::YUV420P:
+			return Transfer<RawFormat<VideoBaseBandFmt::YUV420P>::Layout, Surface>(to_surface, raw, surface, width, height, tap);
+		case VideoBaseBandFmt::YUV420P10LE:
+			return Transfer<RawFormat<VideoBaseBandFmt::YUV420P10LE>::Layout, Surface>(to_surface, raw, surface, width, height, tap);
+		case VideoBaseBandFmt::YUV422P:
+			return Transfer<RawFormat<VideoBaseBandFmt::YUV422P>::Layout, Surface>(to_surface, raw, surface, width, height, tap);
+		case VideoBaseBandFmt::YUV422P10LE:
+			return Transfer<RawFormat<VideoBaseBandFmt::YUV422P10LE>::Layout, Surface>(to_surface, raw, surface, width, height, tap);
+		case VideoBaseBandFmt::YUV444P:
+			return Transfer<RawFormat<VideoBaseBandFmt::YUV444P>::Layout, Surface>(to_surface, raw, surface, width, height, tap);
+		case VideoBaseBandFmt::YUV444P10LE:
+			return Transfer<RawFormat<VideoBaseBandFmt::YUV444P10LE>::Layout, Surface>(to_surface, raw, surface, width, height, tap);
+		case VideoBaseBandFmt::NV12:
+			return Transfer<RawFormat<VideoBaseBandFmt::NV12>::Layout, Surface>(to_surface, raw, surface, width, height, tap);
+		case VideoBaseBandFmt::P010LE:
+			return Transfer<RawFormat<VideoBaseBandFmt::P010LE>::Layout, Surface>(to_surface, raw, surface, width, height, tap);
+		case VideoBaseBandFmt::P210:
+			return Transfer<RawFormat<VideoBaseBandFmt::P210>::Layout, Surface>(to_surface, raw, surface, width, height, tap);
+		case VideoBaseBandFmt::Y210:
+			return Transfer<RawFormat<VideoBaseBandFmt::Y210>::Layout, Surface>(to_surface, raw, surface, width, height, tap);
+		case VideoBaseBandFmt::AYUV:
+			return Transfer<RawFormat<VideoBaseBandFmt::AYUV>::Layout, Surface>(to_surface, raw, surface, width, height, tap);
+		case VideoBaseBandFmt::Y410:
+			return Transfer<RawFormat<VideoBaseBandFmt::Y410>::Layout, Surface>(to_surface, raw, surface, width, height, tap);
+		default:
+			return false;
+	}
+}
+
+static bool TransferSurface(mfxU32 fourcc, VideoBaseBandFmt fmt, bool to_surface, const FrameRef & raw, const FrameRef & surface,
+		int width, int height, RowTap * tap){
+	switch(fourcc){
+		case MFX_FOURCC_NV12:
+			return TransferRaw<SurfaceFormat<MFX_FOURCC_NV12>::Layout>(fmt, to_surface, raw, surface, width, height, tap);
+		case MFX_FOURCC_NV16:
+			return TransferRaw<SurfaceFormat<MFX_FOURCC_NV16>::Layout>(fmt, to_surface, raw, surface, width, height, tap);
+		case MFX_FOURCC_P010:
+			return TransferRaw<SurfaceFormat<MFX_FOURCC_P010>::Layout>(fmt, to_surface, raw, surface, width, height, tap);
+		case MFX_FOURCC_P210:
+			return TransferRaw<SurfaceFormat<MFX_FOURCC_P210>::Layout>(fmt, to_surface, raw, surface, width, height, tap);
+		case MFX_FOURCC_YUY2:
+			return TransferRaw<SurfaceFormat<MFX_FOURCC_YUY2>::Layout>(fmt, to_surface, raw, surface, width, height, tap);
+		case MFX_FOURCC_Y210:
+			return TransferRaw<SurfaceFormat<MFX_FOURCC_Y210>::Layout>(fmt, to_surface, raw, surface, width, height, tap);
+		case MFX_FOURCC_AYUV:
+			return TransferRaw<SurfaceFormat<MFX_FOURCC_AYUV>::Layout>(fmt, to_surface, raw, surface, width, height, tap);
+		case MFX_FOURCC_Y410:
+			return TransferRaw<SurfaceFormat<MFX_FOURCC_Y410>::Layout>(fmt, to_surface, raw, surface, width, height, tap);
+		default:
+			return false;
+	}
+}
+
+bool GetSurfaceFormat(mfxU32 fourcc, PixelFormatDesc & desc){
+	switch(fourcc){
+		case MFX_FOURCC_NV12:
+			desc = DescribeLayout<SurfaceFormat<MFX_FOURCC_NV12>::Layout>(fourcc, SurfaceFormat<MFX_FOURCC_NV12>::planar);
+			return true;
+		case MFX_FOURCC_NV16:
+			desc = DescribeLayout<SurfaceFormat<MFX_FOURCC_NV16>::Layout>(fourcc, SurfaceFormat<MFX_FOURCC_NV16>::planar);
+			return true;
+		case MFX_FOURCC_P010:
+			desc = DescribeLayout<SurfaceFormat<MFX_FOURCC_P010>::Layout>(fourcc, SurfaceFormat<MFX_FOURCC_P010>::planar);
+			return true;
+		case MFX_FOURCC_P210:
+			desc = DescribeLayout<SurfaceFormat<MFX_FOURCC_P210>::Layout>(fourcc, SurfaceFormat<MFX_FOURCC_P210>::planar);
+			return true;
+		case MFX_FOURCC_YUY2:
+			desc = DescribeLayout<SurfaceFormat<MFX_FOURCC_YUY2>::Layout>(fourcc, SurfaceFormat<MFX_FOURCC_YUY2>::planar);
+			return true;
+		case MFX_FOURCC_Y210:
+			desc = DescribeLayout<SurfaceFormat<MFX_FOURCC_Y210>::Layout>(fourcc, SurfaceFormat<MFX_FOURCC_Y210>::planar);
+			return true;
+		case MFX_FOURCC_AYUV:
+			desc = DescribeLayout<SurfaceFormat<MFX_FOURCC_AYUV>::Layout>(fourcc, SurfaceFormat<MFX_FOURCC_AYUV>::planar);
+			return true;
+		case MFX_FOURCC_Y410:
+			desc = DescribeLayout<SurfaceFormat<MFX_FOURCC_Y410>::Layout>(fourcc, SurfaceFormat<MFX_FOURCC_Y410>::planar);
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool GetRawFormat(VideoBaseBandFmt fmt, PixelFormatDesc & desc){
+	switch(fmt){
+		case VideoBaseBandFmt::YUV420P:
+			desc = DescribeLayout<RawFormat<VideoBaseBandFmt::YUV420P>::Layout>(0, fmt);
+			return true;
+		case VideoBaseBandFmt::YUV420P10LE:
+			desc = DescribeLayout<RawFormat<VideoBaseBandFmt::YUV420P10LE>::Layout>(0, fmt);
+			return true;
+		case VideoBaseBandFmt::YUV422P:
+			desc = DescribeLayout<RawFormat<VideoBaseBandFmt::YUV422P>::Layout>(0, fmt);
+			return true;
+		case VideoBaseBandFmt::YUV422P10LE:
+			desc = DescribeLayout<RawFormat<VideoBaseBandFmt::YUV422P10LE>::Layout>(0, fmt);
+			return true;
+		case VideoBaseBandFmt::YUV444P:
+			desc = DescribeLayout<RawFormat<VideoBaseBandFmt::YUV444P>::Layout>(0, fmt);
+			return true;
+		case VideoBaseBandFmt::YUV444P10LE:
+			desc = DescribeLayout<RawFormat<VideoBaseBandFmt::YUV444P10LE>::Layout>(0, fmt);
+			return true;
+		case VideoBaseBandFmt::NV12:
+			return GetSurfaceFormat(RawFormat<VideoBaseBandFmt::NV12>::fourcc, desc);
+		case VideoBaseBandFmt::P010LE:
+			return GetSurfaceFormat(RawFormat<VideoBaseBandFmt::P010LE>::fourcc, desc);
+		case VideoBaseBandFmt::P210:
+			return GetSurfaceFormat(RawFormat<VideoBaseBandFmt::P210>::fourcc, desc);
+		case VideoBaseBandFmt::Y210:
+			return GetSurfaceFormat(RawFormat<VideoBaseBandFmt::Y210>::fourcc, desc);
+		case VideoBaseBandFmt::AYUV:
+			return GetSurfaceFormat(RawFormat<VideoBaseBandFmt::AYUV>::fourcc, desc);
+		case VideoBaseBandFmt::Y410:
+			return GetSurfaceFormat(RawFormat<VideoBaseBandFmt::Y410>::fourcc, desc);
+		default:
+			return false;
+	}
+}
+
+mfxU32 SurfaceFourCC(VideoChromaFormat chroma, int bit_depth){
+	switch(chroma){
+		case VideoChromaFormat::YUV420:
+			return bit_depth == 10 ? MFX_FOURCC_P010 : MFX_FOURCC_NV12;
+		case VideoChromaFormat::YUV422:
+			return bit_depth == 10 ? MFX_FOURCC_Y210 : MFX_FOURCC_YUY2;
+		case VideoChromaFormat::YUV444:
+			return bit_depth == 10 ? MFX_FOURCC_Y410 : MFX_FOURCC_AYUV;
+		default:
+			return 0;
+	}
+}
+
+static mfxU32 SurfacePitch(const mfxFrameData & data){
+	return ((mfxU32)data.PitchHigh << 16) | data.PitchLow;
+}
+
+static mfxU8 * SurfaceBase(const mfxFrameSurface1 * surface){
+	switch(surface->Info.FourCC){
+		case MFX_FOURCC_AYUV:
+			return surface->Data.V;
+		case MFX_FOURCC_Y410:
+			return (mfxU8*)surface->Data.Y410;
+		default:
+			return surface->Data.Y;
+	}
+}
+
+bool AllocSurfaceData(mfxFrameSurface1 * surface){
+	PixelFormatDesc desc;
+	if (!GetSurfaceFormat(surface->Info.FourCC, desc))
+		return false;
+	mfxU32 width2 = MSDK_ALIGN32(surface->Info.Width);
+	mfxU32 height2 = MSDK_ALIGN32(surface->Info.Height);
+	mfxU32 pitch = width2 * desc.pixel_bytes;
+	mfxU32 frame_size = pitch * height2;
+	if (desc.planes == 2)
+		frame_size += pitch * (height2 >> desc.chroma_shift_y);
+
+	mfxU8 * base = (mfxU8*)calloc(frame_size + 32, 1);
+	if (!base)
+		return false;
+	mfxFrameData & data = surface->Data;
+	data.PitchHigh = (mfxU16)(pitch >> 16);
+	data.PitchLow = (mfxU16)(pitch & 0xFFFF);
+	switch(surface->Info.FourCC){
+		case MFX_FOURCC_AYUV:
+			data.V = base;
+			data.U = base + 1;
+			data.Y = base + 2;
+			data.A = base + 3;
+			break;
+		case MFX_FOURCC_Y410:
+			data.Y410 = (mfxY410*)base;
+			break;
+		case MFX_FOURCC_YUY2:
+		case MFX_FOURCC_Y210:
+			data.Y = base;
+			data.U = base + desc.sample_bytes;
+			data.V = base + desc.sample_bytes * 3;
+			break;
+		default:
+			data.Y = base;
+			data.UV = base + pitch * height2;
+			data.V = data.UV + desc.sample_bytes;
+			break;
+	}
+	return true;
+}
+
+void FreeSurfaceData(mfxFrameSurface1 * surface){
+	mfxU8 * base = SurfaceBase(surface);
+	if (base)
+		free(base);
+	surface->Data.Y = nullptr;
+	surface->Data.U = nullptr;
+	surface->Data.V = nullptr;
+	surface->Data.A = nullptr;
+}
+
+int RawFrameSize(VideoBaseBandFmt fmt, int width, int height){
+	PixelFormatDesc desc;
+	if (!GetRawFormat(fmt, desc))
+		return 0;
+	int size = 0;
+	for (int p = 0; p < desc.planes; p++){
+		int row_bytes = 0;
+		int rows = 0;
+		PlaneSize(desc, p, width, height, row_bytes, rows);
+		size += row_bytes * rows;
+	}
+	return size;
+}
+
+bool SetRawPlanes(VideoRawData & pic, unsigned char * buffer){
+	PixelFormatDesc desc;
+	if (!GetRawFormat(pic.fmt, desc))
+		return false;
+	for (int p = 0; p < 3; p++){
+		int row_bytes = 0;
+		int rows = 0;
+		PlaneSize(desc, p, pic.width, pic.height, row_bytes, rows);
+		pic.buffer[p] = row_bytes ? buffer : nullptr;
+		pic.line_size[p] = row_bytes;
+		buffer += row_bytes * rows;
+	}
+	return true;
+}
+
+bool CopyRawFrame(const VideoRawData & src, VideoRawData & dst){
+	PixelFormatDesc desc;
+	if (src.fmt != dst.fmt || src.width != dst.width || src.height != dst.height || !GetRawFormat(src.fmt, desc))
+		return false;
+	for (int p = 0; p < desc.planes; p++){
+		int row_bytes = 0;
+		int rows = 0;
+		PlaneSize(desc, p, src.width, src.height, row_bytes, rows);
+		if (!src.buffer[p] || !dst.buffer[p])
+			return false;
+		int src_pitch = src.line_size[p] ? src.line_size[p] : row_bytes;
+		int dst_pitch = dst.line_size[p] ? dst.line_size[p] : row_bytes;
+		for (int y = 0; y < rows; y++)
+			memcpy(dst.buffer[p] + y * dst_pitch, src.buffer[p] + y * src_pitch, row_bytes);
+	}
+	return true;
+}
+
+static bool RawFrameRef(const VideoRawData & pic, const PixelFormatDesc & desc, FrameRef & ref){
+	for (int p = 0; p < 3; p++){
+		int row_bytes = 0;
+		int rows = 0;
+		PlaneSize(desc, p, pic.width, pic.height, row_bytes, rows);
+		if (row_bytes && !pic.buffer[p])
+			return false;
+		ref.plane[p] = pic.buffer[p];
+		ref.pitch[p] = pic.line_size[p] ? pic.line_size[p] : row_bytes;
+	}
+	ref.shift = desc.fourcc && desc.sample_bytes == 2 ? 16 - desc.bit_depth : 0;
+	return true;
+}
+
+bool HashRawFrame(const VideoRawData & pic, FrameHash & hash){
+	PixelFormatDesc desc;
+	FrameRef raw;
+	if (!GetRawFormat(pic.fmt, desc) || !RawFrameRef(pic, desc, raw))
+		return false;
+	for (int p = 0; p < 3; p++){
+		int row_bytes = 0;
+		int rows = 0;
+		PlaneSize(desc, p, pic.width, pic.height, row_bytes, rows);
+		hash.rows[p].Reset(row_bytes);
+		for (int y = 0; y < rows; y++)
+			hash.rows[p].Update(raw.plane[p] + y * raw.pitch[p]);
+		hash.value[p] = p < desc.planes ? hash.rows[p].Value() : 0;
+	}
+	return true;
+}
+
+static bool SurfaceFrameRef(const mfxFrameSurface1 * surface, const PixelFormatDesc & desc, FrameRef & ref){
+	ref.plane[0] = SurfaceBase(surface);
+	ref.plane[1] = desc.planes == 2 ? surface->Data.UV : nullptr;
+	ref.plane[2] = nullptr;
+	ref.pitch[0] = ref.pitch[1] = ref.pitch[2] = SurfacePitch(surface->Data);
+	ref.shift = surface->Info.Shift && desc.sample_bytes == 2 ? 16 - desc.bit_depth : 0;
+	return ref.plane[0] && (desc.planes == 1 || ref.plane[1]);
+}
+
+static bool TransferFrame(VideoRawData & pic, mfxFrameSurface1 * surface, bool to_surface, FrameHash * hash,
+		LumaStats * stats, VideoFrameStats * frame_stats){
+	PixelFormatDesc raw_desc;
+	PixelFormatDesc surface_desc;
+	if (!GetRawFormat(pic.fmt, raw_desc) || !GetSurfaceFormat(surface->Info.FourCC, surface_desc))
+		return false;
+	FrameRef raw;
+	FrameRef dst;
+	if (!RawFrameRef(pic, raw_desc, raw) || !SurfaceFrameRef(surface, surface_desc, dst))
+		return false;
+	int width = pic.width < surface->Info.Width ? pic.width : surface->Info.Width;
+	int height = pic.height < surface->Info.Height ? pic.height : surface->Info.Height;
+	if (!hash && !stats)
+		return TransferSurface(surface->Info.FourCC, pic.fmt, to_surface, raw, dst, width, height, nullptr);
+
+	RowTap tap{hash, stats, raw, raw_desc.planes, to_surface};
+	for (int p = 0; hash && p < raw_desc.planes; p++){
+		int row_bytes = 0;
+		int rows = 0;
+		PlaneSize(raw_desc, p, width, height, row_bytes, rows);
+		hash->rows[p].Reset(row_bytes);
+	}
+	if (stats)
+		stats->Reset(width, height, raw_desc.sample_bytes, raw_desc.bit_depth, raw.shift);
+	if (!TransferSurface(surface->Info.FourCC, pic.fmt, to_surface, raw, dst, width, height, &tap))
+		return false;
+	for (int p = 0; hash && p < 3; p++)
+		hash->value[p] = p < raw_desc.planes ? hash->rows[p].Value() : 0;
+	if (stats && frame_stats)
+		stats->Finish(*frame_stats);
+	return true;
+}
+
+bool CopyToSurface(const VideoRawData & pic, mfxFrameSurface1 * surface, FrameHash * hash,
+		LumaStats * stats, VideoFrameStats * frame_stats){
+	return TransferFrame(const_cast<VideoRawData&>(pic), surface, true, hash, stats, frame_stats);
+}
+
+bool CopyFromSurface(const mfxFrameSurface1 * surface, VideoRawData & pic, FrameHash * hash,
+		LumaStats * stats, VideoFrameStats * frame_stats){
+	return TransferFrame(pic, const_cast<mfxFrameSurface1*>(surface), false, hash, stats, frame_stats);
+}
@@ -0,0 +1,287 @@
+#ifndef _H_PIXELFORMAT_
+#define _H_PIXELFORMAT_
+
+#include "Def.h"
+#include "Crc32c.h"
+#include "LumaStats.h"
+
+/*
+Compile-time pixel format traits. Every layout (planar, semi-planar, packed)
+is a type with its sample type, bit depth and chroma subsampling as constants
+and inline sample accessors, SurfaceFormat<FOURCC> and RawFormat<fmt> map the
+sdk fourccs and VideoBaseBandFmt onto them. The conversion kernels in
+PixelFormat.cpp are instantiated per (source, destination) layout pair, so
+every pair gets its own loop with the format math folded in.
+10 bit samples are normalized to lsb aligned values between layouts, shift
+is how far a layout stores them above that (6 for msb aligned P010).
+*/
+struct FrameRef{
+	mfxU8 * plane[3];
+	int pitch[3];	// bytes
+	int shift;
+};
+
+template <class T, int DEPTH, int SX, int SY>
+struct PlanarLayout{
+	typedef T Sample;
+	static constexpr int bit_depth = DEPTH;
+	static constexpr int chroma_shift_x = SX;
+	static constexpr int chroma_shift_y = SY;
+	static constexpr int planes = 3;
+	static constexpr int pixel_bytes = sizeof(T);
+	static constexpr bool luma_plane = true;
+
+	static int LoadLuma(const FrameRef & f, int x, int y){
+		return ((const T*)(f.plane[0] + y * f.pitch[0]))[x];
+	}
+	static void StoreLuma(const FrameRef & f, int x, int y, int value){
+		((T*)(f.plane[0] + y * f.pitch[0]))[x] = (T)value;
+	}
+	static void LoadChroma(const FrameRef & f, int x, int y, int & u, int & v){
+		u = ((const T*)(f.plane[1] + y * f.pitch[1]))[x];
+		v = ((const T*)(f.plane[2] + y * f.pitch[2]))[x];
+	}
+	static void StoreChroma(const FrameRef & f, int x, int y, int u, int v){
+		((T*)(f.plane[1] + y * f.pitch[1]))[x] = (T)u;
+		((T*)(f.plane[2] + y * f.pitch[2]))[x] = (T)v;
+	}
+};
+
+// NV12, NV16, P010, P210: luma plane then interleaved UV
+template <class T, int DEPTH, int SY>
+struct SemiPlanarLayout{
+	typedef T Sample;
+	static constexpr int bit_depth = DEPTH;
+	static constexpr int chroma_shift_x = 1;
+	static constexpr int chroma_shift_y = SY;
+	static constexpr int planes = 2;
+	static constexpr int pixel_bytes = sizeof(T);
+	static constexpr bool luma_plane = true;
+	// folds away for 8 bit layouts
+	static int Shift(const FrameRef & f){ return DEPTH > 8 ? f.shift : 0; }
+
+	static int LoadLuma(const FrameRef & f, int x, int y){
+		return ((const T*)(f.plane[0] + y * f.pitch[0]))[x] >> Shift(f);
+	}
+	static void StoreLuma(const FrameRef & f, int x, int y, int value){
+		((T*)(f.plane[0] + y * f.pitch[0]))[x] = (T)(value << Shift(f));
+	}
+	static void LoadChroma(const FrameRef & f, int x, int y, int & u, int & v){
+		const T * row = (const T*)(f.plane[1] + y * f.pitch[1]);
+		u = row[x * 2] >> Shift(f);
+		v = row[x * 2 + 1] >> Shift(f);
+	}
+	static void StoreChroma(const FrameRef & f, int x, int y, int u, int v){
+		T * row = (T*)(f.plane[1] + y * f.pitch[1]);
+		row[x * 2] = (T)(u << Shift(f));
+		row[x * 2 + 1] = (T)(v << Shift(f));
+	}
+};
+
+// YUY2, Y210: Y0 U Y1 V per pixel pair
+template <class T, int DEPTH>
+struct PackedYUYVLayout{
+	typedef T Sample;
+	static constexpr int bit_depth = DEPTH;
+	static constexpr int chroma_shift_x = 1;
+	static constexpr int chroma_shift_y = 0;
+	static constexpr int planes = 1;
+	static constexpr int pixel_bytes = sizeof(T) * 2;
+	static constexpr bool luma_plane = false;
+	static int Shift(const FrameRef & f){ return DEPTH > 8 ? f.shift : 0; }
+
+	static int LoadLuma(const FrameRef & f, int x, int y){
+		return ((const T*)(f.plane[0] + y * f.pitch[0]))[x * 2] >> Shift(f);
+	}
+	static void StoreLuma(const FrameRef & f, int x, int y, int value){
+		((T*)(f.plane[0] + y * f.pitch[0]))[x * 2] = (T)(value << Shift(f));
+	}
+	static void LoadChroma(const FrameRef & f, int x, int y, int & u, int & v){
+		const T * row = (const T*)(f.plane[0] + y * f.pitch[0]);
+		u = row[x * 4 + 1] >> Shift(f);
+		v = row[x * 4 + 3] >> Shift(f);
+	}
+	static void StoreChroma(const FrameRef & f, int x, int y, int u, int v){
+		T * row = (T*)(f.plane[0] + y * f.pitch[0]);
+		row[x * 4 + 1] = (T)(u << Shift(f));
+		row[x * 4 + 3] = (T)(v << Shift(f));
+	}
+};
+
+// AYUV: V U Y A bytes per pixel, alpha is written opaque
+struct PackedAYUVLayout{
+	typedef mfxU8 Sample;
+	static constexpr int bit_depth = 8;
+	static constexpr int chroma_shift_x = 0;
+	static constexpr int chroma_shift_y = 0;
+	static constexpr int planes = 1;
+	static constexpr int pixel_bytes = 4;
+	static constexpr bool luma_plane = false;
+
+	static int LoadLuma(const FrameRef & f, int x, int y){
+		return (f.plane[0] + y * f.pitch[0])[x * 4 + 2];
+	}
+	static void StoreLuma(const FrameRef & f, int x, int y, int value){
+		mfxU8 * pixel = f.plane[0] + y * f.pitch[0] + x * 4;
+		pixel[2] = (mfxU8)value;
+		pixel[3] = 0xFF;
+	}
+	static void LoadChroma(const FrameRef & f, int x, int y, int & u, int & v){
+		const mfxU8 * pixel = f.plane[0] + y * f.pitch[0] + x * 4;
+		u = pixel[1];
+		v = pixel[0];
+	}
+	static void StoreChroma(const FrameRef & f, int x, int y, int u, int v){
+		mfxU8 * pixel = f.plane[0] + y * f.pitch[0] + x * 4;
+		pixel[1] = (mfxU8)u;
+		pixel[0] = (mfxU8)v;
+	}
+};
+
+// Y410: one 32 bit word per pixel, U bits 0-9, Y 10-19, V 20-29, A 30-31
+struct PackedY410Layout{
+	typedef mfxU32 Sample;
+	static constexpr int bit_depth = 10;
+	static constexpr int chroma_shift_x = 0;
+	static constexpr int chroma_shift_y = 0;
+	static constexpr int planes = 1;
+	static constexpr int pixel_bytes = 4;
+	static constexpr bool luma_plane = false;
+
+	static int LoadLuma(const FrameRef & f, int x, int y){
+		return (((const mfxU32*)(f.plane[0] + y * f.pitch[0]))[x] >> 10) & 0x3FF;
+	}
+	static void StoreLuma(const FrameRef & f, int x, int y, int value){
+		mfxU32 & pixel = ((mfxU32*)(f.plane[0] + y * f.pitch[0]))[x];
+		pixel = (pixel & 0x3FF003FF) | ((mfxU32)value << 10) | 0xC0000000;
+	}
+	static void LoadChroma(const FrameRef & f, int x, int y, int & u, int & v){
+		mfxU32 pixel = ((const mfxU32*)(f.plane[0] + y * f.pitch[0]))[x];
+		u = pixel & 0x3FF;
+		v = (pixel >> 20) & 0x3FF;
+	}
+	static void StoreChroma(const FrameRef & f, int x, int y, int u, int v){
+		mfxU32 & pixel = ((mfxU32*)(f.plane[0] + y * f.pitch[0]))[x];
+		pixel = (pixel & 0xC00FFC00) | (mfxU32)u | ((mfxU32)v << 20);
+	}
+};
+
+template <mfxU32 FOURCC> struct SurfaceFormat;
+
+template <> struct SurfaceFormat<MFX_FOURCC_NV12>{
+	typedef SemiPlanarLayout<mfxU8, 8, 1> Layout;
+	static constexpr VideoBaseBandFmt planar = VideoBaseBandFmt::YUV420P;
+};
+template <> struct SurfaceFormat<MFX_FOURCC_NV16>{
+	typedef SemiPlanarLayout<mfxU8, 8, 0> Layout;
+	static constexpr VideoBaseBandFmt planar = VideoBaseBandFmt::YUV422P;
+};
+template <> struct SurfaceFormat<MFX_FOURCC_P010>{
+	typedef SemiPlanarLayout<mfxU16, 10, 1> Layout;
+	static constexpr VideoBaseBandFmt planar = VideoBaseBandFmt::YUV420P10LE;
+};
+template <> struct SurfaceFormat<MFX_FOURCC_P210>{
+	typedef SemiPlanarLayout<mfxU16, 10, 0> Layout;
+	static constexpr VideoBaseBandFmt planar = VideoBaseBandFmt::YUV422P10LE;
+};
+template <> struct SurfaceFormat<MFX_FOURCC_YUY2>{
+	typedef PackedYUYVLayout<mfxU8, 8> Layout;
+	static constexpr VideoBaseBandFmt planar = VideoBaseBandFmt::YUV422P;
+};
+template <> struct SurfaceFormat<MFX_FOURCC_Y210>{
+	typedef PackedYUYVLayout<mfxU16, 10> Layout;
+	static constexpr VideoBaseBandFmt planar = VideoBaseBandFmt::YUV422P10LE;
+};
+template <> struct SurfaceFormat<MFX_FOURCC_AYUV>{
+	typedef PackedAYUVLayout Layout;
+	static constexpr VideoBaseBandFmt planar = VideoBaseBandFmt::YUV444P;
+};
+template <> struct SurfaceFormat<MFX_FOURCC_Y410>{
+	typedef PackedY410Layout Layout;
+	static constexpr VideoBaseBandFmt planar = VideoBaseBandFmt::YUV444P10LE;
+};
+
+template <VideoBaseBandFmt FMT> struct RawFormat;
+
+template <> struct RawFormat<VideoBaseBandFmt::YUV420P>{ typedef PlanarLayout<mfxU8, 8, 1, 1> Layout; static constexpr mfxU32 fourcc = 0; };
+template <> struct RawFormat<VideoBaseBandFmt::YUV420P10LE>{ typedef PlanarLayout<mfxU16, 10, 1, 1> Layout; static constexpr mfxU32 fourcc = 0; };
+template <> struct RawFormat<VideoBaseBandFmt::YUV422P>{ typedef PlanarLayout<mfxU8, 8, 1, 0> Layout; static constexpr mfxU32 fourcc = 0; };
+template <> struct RawFormat<VideoBaseBandFmt::YUV422P10LE>{ typedef PlanarLayout<mfxU16, 10, 1, 0> Layout; static constexpr mfxU32 fourcc = 0; };
+template <> struct RawFormat<VideoBaseBandFmt::YUV444P>{ typedef PlanarLayout<mfxU8, 8, 0, 0> Layout; static constexpr mfxU32 fourcc = 0; };
+template <> struct RawFormat<VideoBaseBandFmt::YUV444P10LE>{ typedef PlanarLayout<mfxU16, 10, 0, 0> Layout; static constexpr mfxU32 fourcc = 0; };
+// raw frames already in a surface layout, 16 bit samples msb aligned as the sdk produces them
+template <> struct RawFormat<VideoBaseBandFmt::NV12>{ typedef SurfaceFormat<MFX_FOURCC_NV12>::Layout Layout; static constexpr mfxU32 fourcc = MFX_FOURCC_NV12; };
+template <> struct RawFormat<VideoBaseBandFmt::P010LE>{ typedef SurfaceFormat<MFX_FOURCC_P010>::Layout Layout; static constexpr mfxU32 fourcc = MFX_FOURCC_P010; };
+template <> struct RawFormat<VideoBaseBandFmt::P210>{ typedef SurfaceFormat<MFX_FOURCC_P210>::Layout Layout; static constexpr mfxU32 fourcc = MFX_FOURCC_P210; };
+template <> struct RawFormat<VideoBaseBandFmt::Y210>{ typedef SurfaceFormat<MFX_FOURCC_Y210>::Layout Layout; static constexpr mfxU32 fourcc = MFX_FOURCC_Y210; };
+template <> struct RawFormat<VideoBaseBandFmt::AYUV>{ typedef SurfaceFormat<MFX_FOURCC_AYUV>::Layout Layout; static constexpr mfxU32 fourcc = MFX_FOURCC_AYUV; };
+template <> struct RawFormat<VideoBaseBandFmt::Y410>{ typedef SurfaceFormat<MFX_FOURCC_Y410>::Layout Layout; static constexpr mfxU32 fourcc = MFX_FOURCC_Y410; };
+
+/*
+runtime view of the traits for code that only knows the format at run time
+*/
+struct PixelFormatDesc{
+	mfxU32 fourcc;				// surface fourcc, 0 for planar raw formats
+	VideoBaseBandFmt planar;	// planar raw format with the same sampling
+	mfxU16 chroma_format;
+	int bit_depth;
+	int chroma_shift_x;
+	int chroma_shift_y;
+	int planes;
+	int pixel_bytes;			// bytes per pixel in the first plane
+	int sample_bytes;
+};
+
+template <class L>
+constexpr PixelFormatDesc DescribeLayout(mfxU32 fourcc, VideoBaseBandFmt planar){
+	return PixelFormatDesc{fourcc, planar,
+		(mfxU16)(L::chroma_shift_x == 0 ? MFX_CHROMAFORMAT_YUV444 :
+			L::chroma_shift_y == 0 ? MFX_CHROMAFORMAT_YUV422 : MFX_CHROMAFORMAT_YUV420),
+		L::bit_depth, L::chroma_shift_x, L::chroma_shift_y, L::planes, L::pixel_bytes,
+		(int)sizeof(typename L::Sample)};
+}
+
+bool GetSurfaceFormat(mfxU32 fourcc, PixelFormatDesc & desc);
+bool GetRawFormat(VideoBaseBandFmt fmt, PixelFormatDesc & desc);
+// surface fourcc the sdk uses for a chroma format and bit depth, 0 if there is none
+mfxU32 SurfaceFourCC(VideoChromaFormat chroma, int bit_depth);
+
+/*
+system memory surface planes, sized from Info.Width/Height aligned to 32.
+FreeSurfaceData releases what AllocSurfaceData allocated.
+*/
+bool AllocSurfaceData(mfxFrameSurface1 * surface);
+void FreeSurfaceData(mfxFrameSurface1 * surface);
+
+/*
+tightly packed raw frames, SetRawPlanes points pic.buffer/line_size into buffer
+*/
+int RawFrameSize(VideoBaseBandFmt fmt, int width, int height);
+bool SetRawPlanes(VideoRawData & pic, unsigned char * buffer);
+// copies the planes of src into dst of the same format and size, honoring both line sizes
+bool CopyRawFrame(const VideoRawData & src, VideoRawData & dst);
+
+/*
+per plane Crc32c of the visible bytes of a raw frame, rows concatenated without
+padding. CopyToSurface/CopyFromSurface fill it row by row inside the conversion
+while the rows are still in cache, HashRawFrame gives the same values in a pass
+of its own. Keep one per stream, the row tables are only rebuilt on a size change.
+*/
+struct FrameHash{
+	Crc32cRows rows[3];
+	uint32_t value[3];	// 0 for planes the format does not have
+};
+bool HashRawFrame(const VideoRawData & pic, FrameHash & hash);
+
+/*
+convert between a raw frame and a surface of the same bit depth and chroma
+sampling, pic.width/height pixels starting at the top left of the surface.
+hash, when given, receives the hash of the raw side, stats accumulates its
+luma statistics into frame_stats. CopyFromSurface compares against what pic
+held before, so SAD to the previous frame needs pic to reuse one buffer.
+*/
+bool CopyToSurface(const VideoRawData & pic, mfxFrameSurface1 * surface, FrameHash * hash = nullptr,
+		LumaStats * stats = nullptr, VideoFrameStats * frame_stats = nullptr);
+bool CopyFromSurface(const mfxFrameSurface1 * surface, VideoRawData & pic, FrameHash * hash = nullptr,
+		LumaStats * stats = nullptr, VideoFrameStats * frame_stats = nullptr);
+#endif
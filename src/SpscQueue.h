@@ -0,0 +1,70 @@
+#ifndef _H_SPSCQUEUE_
+#define _H_SPSCQUEUE_
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+/*
+Bounded lock-free queue for exactly one producer and one consumer thread.
+Slots are allocated once and reused in place: the producer fills Back() and
+publishes it with Push(), the consumer reads Front() and frees it with Pop(),
+so a slot holding a buffer keeps its capacity from one round to the next.
+Neither side blocks, waiting on an empty or full queue is left to the caller.
+*/
+template <class T>
+class SpscQueue {
+public:
+	// not thread safe, only while neither side is running
+	void Reset(size_t capacity){
+		m_slots.clear();
+		m_slots.resize(capacity ? capacity : 1);
+		m_head.store(0, std::memory_order_relaxed);
+		m_tail.store(0, std::memory_order_relaxed);
+		m_head_cache = 0;
+		m_tail_cache = 0;
+	}
+	size_t Capacity() const { return m_slots.size(); }
+	size_t Size() const {
+		return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+	}
+
+	// producer: the free slot to fill, nullptr while the queue is full
+	T * Back(){
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail - m_head_cache == m_slots.size()){
+			m_head_cache = m_head.load(std::memory_order_acquire);
+			if (tail - m_head_cache == m_slots.size())
+				return nullptr;
+		}
+		return &m_slots[tail % m_slots.size()];
+	}
+	void Push(){
+		m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+	}
+
+	// consumer: the oldest slot, nullptr while the queue is empty
+	T * Front(){
+		size_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail_cache){
+			m_tail_cache = m_tail.load(std::memory_order_acquire);
+			if (head == m_tail_cache)
+				return nullptr;
+		}
+		return &m_slots[head % m_slots.size()];
+	}
+	void Pop(){
+		m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+	}
+private:
+	std::vector<T> m_slots;
+	// producer and consumer indices on their own cache lines
+	char m_pad0[64];
+	std::atomic<size_t> m_head{0};
+	size_t m_tail_cache = 0;		// consumer's copy of m_tail
+	char m_pad1[64];
+	std::atomic<size_t> m_tail{0};
+	size_t m_head_cache = 0;		// producer's copy of m_head
+	char m_pad2[64];
+};
+#endif
@@ -0,0 +1,402 @@
+#include <string.h>
+
+#include "StreamIndex.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define STREAM_INDEX_MAGIC "SIDX"
+#define STREAM_INDEX_VERSION 1
+#define STREAM_INDEX_HEADER_LEN 8
+
+// sidecar records, little endian
+#define RECORD_PARAM_SET 'P'	// u32 size, the nals with 4 byte start codes
+#define RECORD_KEYFRAME 'K'		// u64 offset, u32 frame, u32 param set, u8 idr
+#define RECORD_TOTALS 'E'		// u64 bytes, u32 frames
+
+size_t FindStartCode(const unsigned char * data, size_t len){
+	size_t i = 0;
+#ifdef __SSE2__
+	// 16 candidate positions per step: a zero, a zero after it and a one after that
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+	for (; i + 18 <= len; i += 16){
+		__m128i first = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), zero);
+		__m128i second = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + 1)), zero);
+		__m128i third = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + 2)), one);
+		int mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(first, second), third));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i + 2 < len; i++){
+		if (!data[i] && !data[i + 1] && data[i + 2] == 1)
+			return i;
+	}
+	return len;
+}
+
+static int NalType(VideoCodec codec, unsigned char header){
+	return codec == VideoCodec::HEVC ? (header >> 1) & 0x3F : header & 0x1F;
+}
+
+// 0 VPS, 1 SPS, 2 PPS, -1 for other nals
+static int ParamSetKind(VideoCodec codec, int type){
+	if (codec == VideoCodec::HEVC)
+		return type >= 32 && type <= 34 ? type - 32 : -1;
+	return type == 7 ? 1 : type == 8 ? 2 : -1;
+}
+
+// nals that open a new access unit once the current one has its picture
+static bool IsPrefixNal(VideoCodec codec, int type){
+	if (codec == VideoCodec::HEVC)
+		return (type >= 32 && type <= 35) || type == 39;	// VPS SPS PPS AUD prefix-SEI
+	return type >= 6 && type <= 9;	// SEI SPS PPS AUD
+}
+
+static bool IsFirstSlice(VideoCodec codec, const unsigned char * nal, size_t len){
+	int type = NalType(codec, nal[0]);
+	if (codec == VideoCodec::HEVC)
+		return len > 2 && (type <= 9 || (type >= 16 && type <= 21)) && (nal[2] & 0x80);
+	return len > 1 && type >= 1 && type <= 5 && (nal[1] & 0x80);
+}
+
+// exp-golomb reader over a nal payload, emulation prevention bytes skipped
+struct NalBits{
+	const unsigned char * data;
+	size_t len;
+	size_t pos = 0;
+	int bit = 0;
+	int zeros = 0;
+
+	NalBits(const unsigned char * nal, size_t size) : data(nal), len(size) {}
+	int Bit(){
+		if (pos >= len)
+			return -1;
+		if (!bit){
+			if (zeros >= 2 && data[pos] == 3){
+				zeros = 0;
+				if (++pos >= len)
+					return -1;
+			}
+			zeros = data[pos] ? 0 : zeros + 1;
+		}
+		int value = (data[pos] >> (7 - bit)) & 1;
+		if (++bit == 8){
+			bit = 0;
+			pos++;
+		}
+		return value;
+	}
+	int64_t Ue(){
+		int leading = 0;
+		int b;
+		while ((b = Bit()) == 0 && leading < 32)
+			leading++;
+		if (b < 0 || leading >= 32)
+			return -1;
+		int64_t value = 0;
+		for (int i = 0; i < leading; i++){
+			if ((b = Bit()) < 0)
+				return -1;
+			value = (value << 1) | b;
+		}
+		return ((int64_t)1 << leading) - 1 + value;
+	}
+};
+
+// 2 for IDR/BLA, 1 for another picture decoding can start at, 0 otherwise
+static int KeyframeKind(VideoCodec codec, const unsigned char * nal, size_t len){
+	int type = NalType(codec, nal[0]);
+	if (codec == VideoCodec::HEVC)
+		return type >= 16 && type <= 20 ? 2 : type == 21 ? 1 : 0;
+	if (type == 5)
+		return 2;
+	if (type != 1)
+		return 0;
+	NalBits bits(nal + 1, len - 1);
+	if (bits.Ue() < 0)		// first_mb_in_slice
+		return 0;
+	int64_t slice_type = bits.Ue();
+	return slice_type >= 0 && (slice_type % 5 == 2 || slice_type % 5 == 4) ? 1 : 0;	// I, SI
+}
+
+static void PutU32(std::vector<unsigned char> & out, uint32_t value){
+	for (int i = 0; i < 4; i++)
+		out.push_back((unsigned char)(value >> (i * 8)));
+}
+
+static void PutU64(std::vector<unsigned char> & out, uint64_t value){
+	for (int i = 0; i < 8; i++)
+		out.push_back((unsigned char)(value >> (i * 8)));
+}
+
+static uint64_t GetLE(const unsigned char * data, int bytes){
+	uint64_t value = 0;
+	for (int i = bytes - 1; i >= 0; i--)
+		value = (value << 8) | data[i];
+	return value;
+}
+
+StreamIndex::~StreamIndex(){
+	CloseSidecar();
+}
+
+void StreamIndex::Reset(VideoCodec codec){
+	if (m_sidecar){
+		fclose(m_sidecar);
+		m_sidecar = nullptr;
+	}
+	m_codec = codec;
+	m_bytes = 0;
+	m_frames = 0;
+	m_complete = false;
+	m_keyframes.clear();
+	m_param_sets.clear();
+	for (auto & nal : m_current)
+		nal.clear();
+	m_params_changed = false;
+}
+
+void StreamIndex::AddParamSet(int kind, const unsigned char * nal, size_t len){
+	std::vector<unsigned char> & current = m_current[kind];
+	if (current.size() == len && !memcmp(current.data(), nal, len))
+		return;
+	current.assign(nal, nal + len);
+	m_params_changed = true;
+}
+
+/*
+one nal of the access unit starting at m_bytes, the first slice of its picture
+records a keyframe with the parameter sets seen up to it
+*/
+void StreamIndex::AddNal(const unsigned char * nal, size_t len, bool & picture){
+	// trailing zeros, including the leading zero of a 4 byte start code after it
+	while (len && !nal[len - 1])
+		len--;
+	if (!len)
+		return;
+	int kind = ParamSetKind(m_codec, NalType(m_codec, nal[0]));
+	if (kind >= 0){
+		AddParamSet(kind, nal, len);
+		return;
+	}
+	if (picture || !IsFirstSlice(m_codec, nal, len))
+		return;
+	picture = true;
+	int key = KeyframeKind(m_codec, nal, len);
+	if (!key)
+		return;
+	if (m_params_changed || m_param_sets.empty()){
+		std::vector<unsigned char> params;
+		for (auto & current : m_current){
+			if (current.empty())
+				continue;
+			static const unsigned char start_code[4] = {0, 0, 0, 1};
+			params.insert(params.end(), start_code, start_code + 4);
+			params.insert(params.end(), current.begin(), current.end());
+		}
+		m_param_sets.push_back(params);
+		m_params_changed = false;
+	}
+	StreamIndexKeyframe keyframe;
+	keyframe.offset = m_bytes;
+	keyframe.frame = m_frames;
+	keyframe.param_set = (uint32_t)m_param_sets.size() - 1;
+	keyframe.idr = key == 2;
+	m_keyframes.push_back(keyframe);
+}
+
+void StreamIndex::AddAccessUnit(const unsigned char * au, size_t len){
+	size_t keyframes = m_keyframes.size();
+	size_t param_sets = m_param_sets.size();
+	bool picture = false;
+	size_t pos = FindStartCode(au, len);
+	while (pos + 3 < len){
+		size_t nal = pos + 3;
+		size_t next = nal + FindStartCode(au + nal, len - nal);
+		AddNal(au + nal, next - nal, picture);
+		pos = next;
+	}
+	m_bytes += len;
+	if (picture)
+		m_frames++;
+	if (m_sidecar && m_keyframes.size() != keyframes){
+		WriteRecords(m_sidecar, keyframes, param_sets);
+		fflush(m_sidecar);
+	}
+}
+
+/*
+one pass: access units are cut at the first slice or prefix nal after a
+picture while the nals are classified
+*/
+bool StreamIndex::Build(VideoCodec codec, const unsigned char * es, size_t len){
+	if (codec != VideoCodec::AVC && codec != VideoCodec::HEVC)
+		return false;
+	Reset(codec);
+	uint64_t au_start = 0;
+	bool picture = false;
+	size_t pos = FindStartCode(es, len);
+	while (pos + 3 < len){
+		size_t nal = pos + 3;
+		size_t next = nal + FindStartCode(es + nal, len - nal);
+		if (picture && (IsFirstSlice(codec, es + nal, next - nal) || IsPrefixNal(codec, NalType(codec, es[nal])))){
+			size_t start = pos > 0 && !es[pos - 1] ? pos - 1 : pos;
+			m_bytes += start - au_start;
+			m_frames++;
+			au_start = start;
+			picture = false;
+		}
+		AddNal(es + nal, next - nal, picture);
+		pos = next;
+	}
+	m_bytes += len - au_start;
+	if (picture)
+		m_frames++;
+	m_complete = true;
+	return true;
+}
+
+bool StreamIndex::WriteRecords(FILE * file, size_t keyframes_from, size_t param_sets_from){
+	std::vector<unsigned char> out;
+	size_t param_set = param_sets_from;
+	for (size_t k = keyframes_from; k <= m_keyframes.size(); k++){
+		// a keyframe's parameter sets are always written ahead of it
+		size_t needed = k < m_keyframes.size() ? m_keyframes[k].param_set + 1 : m_param_sets.size();
+		for (; param_set < needed; param_set++){
+			out.push_back(RECORD_PARAM_SET);
+			PutU32(out, (uint32_t)m_param_sets[param_set].size());
+			out.insert(out.end(), m_param_sets[param_set].begin(), m_param_sets[param_set].end());
+		}
+		if (k == m_keyframes.size())
+			break;
+		const StreamIndexKeyframe & key = m_keyframes[k];
+		out.push_back(RECORD_KEYFRAME);
+		PutU64(out, key.offset);
+		PutU32(out, key.frame);
+		PutU32(out, key.param_set);
+		out.push_back(key.idr ? 1 : 0);
+	}
+	return out.empty() || fwrite(out.data(), 1, out.size(), file) == out.size();
+}
+
+bool StreamIndex::WriteTotals(FILE * file){
+	std::vector<unsigned char> out;
+	out.push_back(RECORD_TOTALS);
+	PutU64(out, m_bytes);
+	PutU32(out, m_frames);
+	return fwrite(out.data(), 1, out.size(), file) == out.size();
+}
+
+bool StreamIndex::OpenSidecar(const char * path){
+	CloseSidecar();
+	FILE * file = fopen(path, "wb");
+	if (!file){
+		printf("can not write stream index %s\n", path);
+		return false;
+	}
+	unsigned char header[STREAM_INDEX_HEADER_LEN] = {0};
+	memcpy(header, STREAM_INDEX_MAGIC, 4);
+	header[4] = STREAM_INDEX_VERSION;
+	header[5] = m_codec == VideoCodec::HEVC ? 2 : 1;
+	if (fwrite(header, 1, sizeof(header), file) != sizeof(header) || !WriteRecords(file, 0, 0)){
+		fclose(file);
+		return false;
+	}
+	fflush(file);
+	m_sidecar = file;
+	return true;
+}
+
+void StreamIndex::CloseSidecar(){
+	if (!m_sidecar)
+		return;
+	WriteRecords(m_sidecar, m_keyframes.size(), m_param_sets.size());
+	WriteTotals(m_sidecar);
+	fclose(m_sidecar);
+	m_sidecar = nullptr;
+}
+
+bool StreamIndex::Save(const char * path){
+	if (!OpenSidecar(path))
+		return false;
+	CloseSidecar();
+	return true;
+}
+
+bool StreamIndex::Load(const char * path){
+	FILE * file = fopen(path, "rb");
+	if (!file)
+		return false;
+	std::vector<unsigned char> data;
+	unsigned char buffer[64 * 1024];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		data.insert(data.end(), buffer, buffer + n);
+	fclose(file);
+	if (data.size() < STREAM_INDEX_HEADER_LEN || memcmp(data.data(), STREAM_INDEX_MAGIC, 4) ||
+			data[4] != STREAM_INDEX_VERSION || (data[5] != 1 && data[5] != 2)){
+		printf("%s is not a stream index\n", path);
+		return false;
+	}
+	Reset(data[5] == 2 ? VideoCodec::HEVC : VideoCodec::AVC);
+	// a record cut short is where the writer currently is
+	size_t pos = STREAM_INDEX_HEADER_LEN;
+	while (pos < data.size() && !m_complete){
+		const unsigned char * record = data.data() + pos + 1;
+		size_t left = data.size() - pos - 1;
+		if (data[pos] == RECORD_PARAM_SET && left >= 4 && left - 4 >= GetLE(record, 4)){
+			size_t size = GetLE(record, 4);
+			m_param_sets.push_back(std::vector<unsigned char>(record + 4, record + 4 + size));
+			pos += 1 + 4 + size;
+		}else if (data[pos] == RECORD_KEYFRAME && left >= 17){
+			StreamIndexKeyframe key;
+			key.offset = GetLE(record, 8);
+			key.frame = (uint32_t)GetLE(record + 8, 4);
+			key.param_set = (uint32_t)GetLE(record + 12, 4);
+			key.idr = record[16] != 0;
+			if (key.param_set >= m_param_sets.size())
+				break;
+			m_keyframes.push_back(key);
+			pos += 1 + 17;
+		}else if (data[pos] == RECORD_TOTALS && left >= 12){
+			m_bytes = GetLE(record, 8);
+			m_frames = (uint32_t)GetLE(record + 8, 4);
+			m_complete = true;
+			pos += 1 + 12;
+		}else
+			break;
+	}
+	if (!m_complete && !m_keyframes.empty()){
+		// unfinished: known up to the last keyframe
+		m_bytes = m_keyframes.back().offset;
+		m_frames = m_keyframes.back().frame;
+	}
+	return true;
+}
+
+const StreamIndexKeyframe * StreamIndex::Find(int64_t frame, bool idr_only) const{
+	size_t lo = 0;
+	size_t hi = m_keyframes.size();
+	while (lo < hi){
+		size_t mid = (lo + hi) / 2;
+		if ((int64_t)m_keyframes[mid].frame <= frame)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	while (lo > 0){
+		const StreamIndexKeyframe & key = m_keyframes[lo - 1];
+		if (key.idr || !idr_only)
+			return &key;
+		lo--;
+	}
+	return nullptr;
+}
+
+const std::vector<unsigned char> & StreamIndex::ParamSets(const StreamIndexKeyframe & key) const{
+	static const std::vector<unsigned char> none;
+	return key.param_set < m_param_sets.size() ? m_param_sets[key.param_set] : none;
+}
@@ -0,0 +1,72 @@
+#ifndef _H_STREAMINDEX_
+#define _H_STREAMINDEX_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include "Def.h"
+
+// offset of the first 00 00 01 in data, len if there is none (SSE2)
+size_t FindStartCode(const unsigned char * data, size_t len);
+
+struct StreamIndexKeyframe{
+	uint64_t offset = 0;		// first byte of the access unit, leading start code included
+	uint32_t frame = 0;			// access units before it
+	uint32_t param_set = 0;		// parameter sets in effect, see StreamIndex::ParamSets
+	bool idr = false;			// IDR or BLA, false for other I pictures and CRA
+};
+
+/*
+Random access index of an annex-b H.264/HEVC elementary stream: byte offset
+and frame number of every IDR/I picture (IRAP for HEVC) and the parameter
+sets in effect there, so a seek starts decoding at the keyframe before the
+target instead of at the start of the file. Build scans a whole stream once,
+AddAccessUnit extends the index by one access unit, e.g. every VideoEncoder
+packet as it is written (see VideoEncoder::SetStreamIndex).
+The sidecar is a header followed by records that are only ever appended:
+OpenSidecar writes each record as the index grows, so a recording that is
+still being written can already be seeked in, Load reads complete and
+unfinished sidecars. One SPS, PPS (and VPS) is tracked at a time, streams
+switching between several parameter sets by id are not indexed correctly.
+*/
+class StreamIndex {
+public:
+	StreamIndex() = default;
+	~StreamIndex();
+	void Reset(VideoCodec codec);
+	bool Build(VideoCodec codec, const unsigned char * es, size_t len);
+	void AddAccessUnit(const unsigned char * au, size_t len);
+	// writes what is indexed so far, then every record as it is added
+	bool OpenSidecar(const char * path);
+	// records the totals, a sidecar without them is read as unfinished
+	void CloseSidecar();
+	bool Save(const char * path);
+	bool Load(const char * path);
+	// last keyframe at or before frame, nullptr if there is none
+	const StreamIndexKeyframe * Find(int64_t frame, bool idr_only = false) const;
+	// annex-b parameter set nals in effect at key, to be decoded ahead of it
+	const std::vector<unsigned char> & ParamSets(const StreamIndexKeyframe & key) const;
+	VideoCodec Codec() const { return m_codec; }
+	uint32_t Frames() const { return m_frames; }
+	uint64_t Bytes() const { return m_bytes; }
+	bool Complete() const { return m_complete; }
+	const std::vector<StreamIndexKeyframe> & Keyframes() const { return m_keyframes; }
+	size_t ParamSetCount() const { return m_param_sets.size(); }
+private:
+	void AddParamSet(int kind, const unsigned char * nal, size_t len);
+	void AddNal(const unsigned char * nal, size_t len, bool & picture);
+	bool WriteRecords(FILE * file, size_t keyframes_from, size_t param_sets_from);
+	bool WriteTotals(FILE * file);
+private:
+	VideoCodec m_codec = VideoCodec::NONE;
+	uint64_t m_bytes = 0;
+	uint32_t m_frames = 0;
+	bool m_complete = false;	// totals known, not an unfinished sidecar
+	std::vector<StreamIndexKeyframe> m_keyframes;
+	std::vector<std::vector<unsigned char>> m_param_sets;
+	std::vector<unsigned char> m_current[3];	// last VPS, SPS, PPS nal seen
+	bool m_params_changed = false;
+	FILE * m_sidecar = nullptr;
+};
+#endif
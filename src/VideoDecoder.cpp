@@ -1,93 +1,40 @@
 #include <string.h>
 #include <stdlib.h>
-#include <fcntl.h>
-#include <unistd.h>
 
 #include "VideoDecoder.h"
-#include "va/va.h"
-#include "va/va_drm.h"
+#include "HardwareBackend.h"
+#include "PixelFormat.h"
+#include "FrameRing.h"
+#include "StreamIndex.h"
 
 
 #define INPUT_BUFFER_CACHE_LEN 1024*1024*20
 #define MSDK_DEC_WAIT_INTERVAL 1000
 #define MFX_ASYNCDEPTH 4
-#define MSDK_ALIGN32(X) (((mfxU32)((X)+31)) & (~ (mfxU32)31))
-
-template <class T>
-static void TransferToYUV(const T *psrc_y,const T * psrc_uv,T *pdst,
-	int width, int height, int pitch,
-	bool bitDepthMinus8 = true) {
-	T * pdst_Y = pdst;
-	T * pdst_U = pdst + width * height;
-	T * pdst_V = pdst + width * height * 5 /4;
-
-	int x, y, width_2, height_2;
-	int rsh = bitDepthMinus8 ? 0 : 6;
-
-	// luma
-	for (y = 0; y < height; y++){
-		for (int x = 0; x < width; x++) {
-			pdst_Y[y*width + x] = psrc_y[x] >> rsh;
-		}
-		psrc_y += pitch / sizeof(T);
-	}
-
-	// De-interleave chroma
-
-	width_2 = width >> 1;
-	height_2 = height >> 1;
-	for (y = 0; y < height_2; y++){
-		for (x = 0; x < width_2; x++){
-			pdst_U[y*width_2 + x] = psrc_uv[x * 2] >> rsh;
-			pdst_V[y*width_2 + x] = psrc_uv[x * 2 + 1] >> rsh;
-		}
-		psrc_uv += pitch / sizeof(T);
-	}
-
-}
 
 VideoDecoder::~VideoDecoder(){
 	Close();
+	delete m_frame_hash;
+	delete m_luma_stats;
 }
 
-bool VideoDecoder::InitVA(mfxSession m_Session){
-	UnInitVA();
-	m_device_fd = open("/dev/dri/renderD128", O_RDWR);
-	if(m_device_fd < 0)
-		return false;
-	m_va_dpy = vaGetDisplayDRM(m_device_fd);
-	if(!m_va_dpy)
-		return false;
-	int major_version,minor_version;
-	VAStatus va_status = vaInitialize(m_va_dpy, &major_version, &minor_version);
-	if(va_status != VA_STATUS_SUCCESS)
-		return false;
-	mfxStatus mfx_status = MFXVideoCORE_SetHandle(m_Session, MFX_HANDLE_VA_DISPLAY, m_va_dpy);
-	if(mfx_status < MFX_ERR_NONE)
-		return false;
-	return true;
-}
-
-void VideoDecoder::UnInitVA(){
-	if(m_va_dpy){
-		vaTerminate(m_va_dpy);
-		m_va_dpy = nullptr;
-	}
-	if(m_device_fd >= 0){
-		close(m_device_fd);
-		m_device_fd = -1;
+void VideoDecoder::SetBackend(CodecBackend * backend){
+	if (m_own_backend){
+		delete m_backend;
+		m_own_backend = false;
 	}
+	m_backend = backend;
 }
 
 bool VideoDecoder::Init(VideoCodec type){
-	mfxIMPL impl = MFX_IMPL_HARDWARE_ANY;
-	mfxVersion ver{ 0,1 };
-	mfxStatus ret = MFXInit(impl, &ver, &m_session);
-	if (ret != MFX_ERR_NONE)
-		return false;
-	if(!InitVA(m_session))
+	if (!m_backend){
+		m_backend = new HardwareBackend();
+		m_own_backend = true;
+	}
+	if (!m_backend->Open())
 		return false;
 	m_codec_type = type;
+	memset(&m_frame_info, 0, sizeof(mfxFrameInfo));
 	if (!m_input_buffer_cache)
 		m_input_buffer_cache = new unsigned char[INPUT_BUFFER_CACHE_LEN];
 	return true;
@@ -98,41 +45,43 @@ void VideoDecoder::SetFrameCB(VideoFrameCB cb, void * user_data){
 	m_user_data = user_data;
 }
 
+void VideoDecoder::SetTraceChannel(int channel){
+	m_trace_channel = channel;
+}
+
+void VideoDecoder::SetFrameHash(bool enable){
+	if (enable && !m_frame_hash)
+		m_frame_hash = new FrameHash();
+	else if (!enable){
+		delete m_frame_hash;
+		m_frame_hash = nullptr;
+	}
+}
+
+void VideoDecoder::SetOutputRing(FrameRingWriter * ring){
+	m_ring = ring;
+}
+
+void VideoDecoder::SetFrameStats(bool enable){
+	if (enable && !m_luma_stats)
+		m_luma_stats = new LumaStats();
+	else if (!enable){
+		delete m_luma_stats;
+		m_luma_stats = nullptr;
+	}
+}
+
 bool VideoDecoder::AllocSuface(mfxFrameInfo *info, int num){
 	FreeSurface();
 	for (int i = 0; i < num; i++){
 		mfxFrameSurface1 *surface = new mfxFrameSurface1();
 		memset(surface, 0, sizeof(mfxFrameSurface1));
 
-		mfxU32 width2 = (mfxU16)MSDK_ALIGN32(info->Width);
-		mfxU32 height2 = (mfxU16)MSDK_ALIGN32(info->Height);
-		mfxU32 frame_size = 0;
-		int factor = 0;
-
-		switch(info->FourCC){
-			case MFX_FOURCC_NV12: {
-				frame_size = width2*height2 + (width2 >> 1)*(height2 >> 1) + (width2 >> 1)*(height2 >> 1);
-				factor = 1;
-				break;
-			}
-			case MFX_FOURCC_P010: {
-				frame_size = (width2*height2 + (width2 >> 1)*(height2 >> 1) + (width2 >> 1)*(height2 >> 1)) << 1;
-				factor = 2;
-				break;
-			}
-			default:
-				return false;
-		}
-
-		mfxU8 *frame_data = (mfxU8*)calloc(frame_size + 32, 1);
-
-		surface->Data.Y = frame_data;
-		surface->Data.B = surface->Data.Y;
-		surface->Data.U = surface->Data.Y + width2 * height2 * factor;
-		surface->Data.V = surface->Data.U + 1*factor;
-		surface->Data.Pitch = width2 * factor;
-
 		surface->Info = *info;
+		if (!AllocSurfaceData(surface)){
+			delete surface;
+			return false;
+		}
 
 		MFXSurface * s = new MFXSurface();
 		s->surface = surface;
@@ -145,8 +94,7 @@ void VideoDecoder::FreeSurface(){
 	for (auto & s : m_surfaces){
 		if (s){
 			if (s->surface){
-				if (s->surface->Data.Y)
-					free(s->surface->Data.Y);
+				FreeSurfaceData(s->surface);
 				delete s->surface;
 			}
 			delete s;
@@ -172,14 +120,14 @@ bool VideoDecoder::InitCodec(){
 	bs.DataLength = m_current_buffer_cache_len;
 	bs.MaxLength = m_current_buffer_cache_len;
 
-	mfxStatus ret = MFXVideoDECODE_DecodeHeader(m_session, &bs , &par);
+	mfxStatus ret = m_backend->DecodeHeader(&bs, &par);
 	if (ret == MFX_ERR_MORE_DATA)
 		return true;
 	else if (ret == MFX_ERR_NONE){
 		par.IOPattern = MFX_IOPATTERN_OUT_SYSTEM_MEMORY;
 		par.AsyncDepth = MFX_ASYNCDEPTH;
 
-		ret = MFXVideoDECODE_Init(m_session, &par);
+		ret = m_backend->DecodeInit(&par);
 
 		if (ret != MFX_ERR_NONE)
 			return false;
@@ -187,7 +135,7 @@ bool VideoDecoder::InitCodec(){
 		mfxFrameAllocRequest request;
 		memset(&request, 0, sizeof(mfxFrameAllocRequest));
 
-		ret = MFXVideoDECODE_QueryIOSurf(m_session, &par, &request);
+		ret = m_backend->DecodeQueryIOSurf(&par, &request);
 		if (ret != MFX_ERR_NONE)
 			return false;
 
@@ -195,23 +143,15 @@ bool VideoDecoder::InitCodec(){
 			return false;
 
 		if (!m_raw_frame_buffer){
-			int framesize = 0;
-			switch(par.mfx.FrameInfo.FourCC){
-				case MFX_FOURCC_NV12: {
-					framesize = par.mfx.FrameInfo.Width * par.mfx.FrameInfo.Height * 3 / 2;
-					break;
-				}
-				case MFX_FOURCC_P010: {
-					framesize = par.mfx.FrameInfo.Width * par.mfx.FrameInfo.Height * 3 / 2 * 2;
-					break;
-				}
-				default:
-					return false;
-			}
+			PixelFormatDesc format;
+			if (!GetSurfaceFormat(par.mfx.FrameInfo.FourCC, format))
+				return false;
+			int framesize = RawFrameSize(format.planar, par.mfx.FrameInfo.Width, par.mfx.FrameInfo.Height);
 			m_raw_frame_buffer = new unsigned char[framesize];
 		}
 
 		memcpy(&m_frame_info, &par.mfx.FrameInfo, sizeof(mfxFrameInfo));
+		m_video_param = par;
 		return true;
 	}else
 		return false;
@@ -230,36 +170,12 @@ MFXSurface * VideoDecoder::GetSurface(){
 	mfxFrameSurface1 *surface = new mfxFrameSurface1();
 	memset(surface, 0, sizeof(mfxFrameSurface1));
 
-	mfxU32 width2 = (mfxU16)MSDK_ALIGN32(m_frame_info.Width);
-	mfxU32 height2 = (mfxU16)MSDK_ALIGN32(m_frame_info.Width);
-	mfxU32 frame_size = 0;
-	int factor = 0;
-
-	switch(m_frame_info.FourCC){
-		case MFX_FOURCC_NV12: {
-			frame_size = width2*height2 + (width2 >> 1)*(height2 >> 1) + (width2 >> 1)*(height2 >> 1);
-			factor = 1;
-			break;
-		}
-		case MFX_FOURCC_P010: {
-			frame_size = (width2*height2 + (width2 >> 1)*(height2 >> 1) + (width2 >> 1)*(height2 >> 1)) << 1;
-			factor = 2;
-			break;
-		}
-		default:
-			return nullptr;
+	surface->Info = m_frame_info;
+	if (!AllocSurfaceData(surface)){
+		delete surface;
+		return nullptr;
 	}
 
-	mfxU8 *pFrameData = (mfxU8*)calloc(frame_size + 32, 1);
-
-	surface->Data.Y = pFrameData;
-	surface->Data.B = surface->Data.Y;
-	surface->Data.U = surface->Data.Y + width2 * height2 * factor;
-	surface->Data.V = surface->Data.U + 1 * factor;
-	surface->Data.Pitch = width2 * factor;
-
-	surface->Info = m_frame_info;
-	
 	MFXSurface * s = new MFXSurface();
 	s->surface = surface;
 	m_surfaces.push_back(s);
@@ -267,53 +183,73 @@ MFXSurface * VideoDecoder::GetSurface(){
 }
 
 void VideoDecoder::OuputFrame(mfxFrameSurface1 *outsurf){
-	if(!m_frame_cb){
+	if(!m_frame_cb && !m_ring){
+		return;
+	}
+	/*
+	surfaces are handed out planar: NV12 -> YUV420P, P010 -> YUV420P10LE,
+	Y210/P210 -> YUV422P10LE, AYUV -> YUV444P, Y410 -> YUV444P10LE
+	*/
+	PixelFormatDesc format;
+	if (!GetSurfaceFormat(outsurf->Info.FourCC, format))
 		return;
+	VideoRawData pic;
+	if(!m_pts_queue.empty()){
+		pic.pts = m_pts_queue.front();
+		m_pts_queue.pop();
+	}else
+		pic.pts = 0;
+	// frames decoded only as references for the seek target are not converted
+	if (m_seeking){
+		if (pic.pts < m_seek_pts)
+			return;
+		m_seeking = false;
+	}
+	pic.width = outsurf->Info.CropW;
+	pic.height = outsurf->Info.CropH;
+	pic.fmt = format.planar;
+	VideoRawData * slot = m_ring ? m_ring->BeginFrame(pic.fmt, pic.width, pic.height, pic.pts) : nullptr;
+	if (slot){
+		SetRawPlanes(pic, slot->buffer[0]);
+		// a ring slot holds an older frame, not the previous one, and the raw buffer falls behind
+		if (m_luma_stats)
+			m_luma_stats->ForgetPrevious();
+	}else if (m_frame_cb)
+		SetRawPlanes(pic, m_raw_frame_buffer);
+	else
+		return;
+	{
+		TraceSpan span("convert", m_trace_channel, pic.pts);
+		// the raw buffer still holds the last frame handed out, the stats take their SAD from it
+		bool ok = CopyFromSurface(outsurf, pic, m_frame_hash, m_luma_stats, &m_frame_stats);
+		if (slot && m_luma_stats)
+			m_luma_stats->ForgetPrevious();
+		if (!ok){
+			if (slot)
+				m_ring->CancelFrame();
+			return;
+		}
+		if (m_frame_hash)
+			memcpy(pic.hash, m_frame_hash->value, sizeof(pic.hash));
+		if (m_luma_stats)
+			pic.stats = &m_frame_stats;
 	}
-	if(outsurf->Info.FourCC == MFX_FOURCC_NV12){
-		TransferToYUV((mfxU8*)outsurf->Data.Y,(mfxU8*)outsurf->Data.UV,(mfxU8*)m_raw_frame_buffer,outsurf->Info.CropW,outsurf->Info.CropH,outsurf->Data.Pitch,true);
-		VideoRawData pic;
-		pic.width = outsurf->Info.CropW;
-		pic.height = outsurf->Info.CropH;
-		pic.buffer[0] = m_raw_frame_buffer;
-		pic.line_size[0] = outsurf->Info.CropW;
-		pic.buffer[1] = m_raw_frame_buffer + outsurf->Info.CropW * outsurf->Info.CropH;
-		pic.line_size[1] = outsurf->Info.CropW / 2;
-		pic.buffer[2] = m_raw_frame_buffer + outsurf->Info.CropW * outsurf->Info.CropH * 5 / 4;
-		pic.line_size[2] = outsurf->Info.CropW / 2;
-		pic.fmt = VideoBaseBandFmt::YUV420P;
-		if(!m_pts_queue.empty()){
-			pic.pts = m_pts_queue.front();
-			m_pts_queue.pop();
-		}else
-			pic.pts = 0;
-		m_frame_cb(&pic,m_user_data);
-	}else if(outsurf->Info.FourCC == MFX_FOURCC_P010){
-		TransferToYUV((mfxU16*)outsurf->Data.Y,(mfxU16*)outsurf->Data.UV,(mfxU16*)m_raw_frame_buffer,outsurf->Info.CropW,outsurf->Info.CropH,outsurf->Data.Pitch,false);
-		VideoRawData pic;
-		pic.width = outsurf->Info.CropW;
-		pic.height = outsurf->Info.CropH;
-		pic.buffer[0] = m_raw_frame_buffer;
-		pic.line_size[0] = outsurf->Info.CropW * 2;
-		pic.buffer[1] = m_raw_frame_buffer + (outsurf->Info.CropW * outsurf->Info.CropH) * 2;
-		pic.line_size[1] = outsurf->Info.CropW / 2 * 2;
-		pic.buffer[2] = m_raw_frame_buffer + (outsurf->Info.CropW * outsurf->Info.CropH * 5 / 4) *2;
-		pic.line_size[2] = outsurf->Info.CropW / 2 * 2;
-		pic.fmt = VideoBaseBandFmt::YUV420P;
-		if(!m_pts_queue.empty()){
-			pic.pts = m_pts_queue.front();
-			m_pts_queue.pop();
-		}else
-			pic.pts = 0;
-		m_frame_cb(&pic,m_user_data);
+	if (slot){
+		memcpy(slot->hash, pic.hash, sizeof(slot->hash));
+		slot->stats = pic.stats;
+		m_ring->CommitFrame();
 	}
+	if (!m_frame_cb)
+		return;
+	TraceSpan span("callback", m_trace_channel, pic.pts);
+	m_frame_cb(&pic,m_user_data);
 }
 
 int VideoDecoder::Decode(bool dump){
 	mfxFrameSurface1 *insurf = nullptr;
 	mfxFrameSurface1 *outsurf = nullptr;
 
-	mfxSyncPoint sync;
+	mfxSyncPoint sync = nullptr;
 	mfxStatus ret = MFX_ERR_NONE;
 	int left_buffer_len = 0;
 	mfxBitstream bs = { 0 };
@@ -323,12 +259,16 @@ int VideoDecoder::Decode(bool dump){
 	bs.DataOffset = 0;
 	bs.MaxLength = m_current_buffer_cache_len;
 
+	int64_t input_pts = m_pts_queue.empty() ? 0 : m_pts_queue.back();
 	MFXSurface * surface = nullptr;
 	do {
 		surface = GetSurface();
 		insurf = surface->surface;
 
-		ret = MFXVideoDECODE_DecodeFrameAsync(m_session, bs.DataLength ? &bs : nullptr, insurf, &outsurf, &sync);
+		{
+			TraceSpan span("decode_async", m_trace_channel, input_pts);
+			ret = m_backend->DecodeFrameAsync(bs.DataLength ? &bs : nullptr, insurf, &outsurf, &sync);
+		}
 		if (ret == MFX_ERR_DEVICE_FAILED) {
 			printf("MFX_ERR_DEVICE_FAILED");
 		}
@@ -344,9 +284,12 @@ int VideoDecoder::Decode(bool dump){
 			mfxStatus ret_;
 			auto iter = m_output_surfaces.begin();
 			if ((*iter)->sync){
-				do{
-					ret_ = MFXVideoCORE_SyncOperation(m_session, (*iter)->sync, MSDK_DEC_WAIT_INTERVAL);
-				} while (ret_ == MFX_WRN_IN_EXECUTION);
+				{
+					TraceSpan span("sync", m_trace_channel, m_pts_queue.empty() ? 0 : m_pts_queue.front());
+					do{
+						ret_ = m_backend->SyncOperation((*iter)->sync, MSDK_DEC_WAIT_INTERVAL);
+					} while (ret_ == MFX_WRN_IN_EXECUTION);
+				}
 				
 				if (ret_ == MFX_ERR_DEVICE_FAILED) {
 					printf("MFX_ERR_DEVICE_FAILED");
@@ -368,9 +311,12 @@ int VideoDecoder::Decode(bool dump){
 			mfxStatus ret_;
 			auto iter = m_output_surfaces.begin();
 			if ((*iter)->sync){
-				do{
-					ret_ = MFXVideoCORE_SyncOperation(m_session, (*iter)->sync, MSDK_DEC_WAIT_INTERVAL);
-				} while (ret_ == MFX_WRN_IN_EXECUTION);
+				{
+					TraceSpan span("sync", m_trace_channel, m_pts_queue.empty() ? 0 : m_pts_queue.front());
+					do{
+						ret_ = m_backend->SyncOperation((*iter)->sync, MSDK_DEC_WAIT_INTERVAL);
+					} while (ret_ == MFX_WRN_IN_EXECUTION);
+				}
 
 				if (ret_ == MFX_ERR_DEVICE_FAILED) {
 					printf("MFX_ERR_DEVICE_FAILED");
@@ -391,21 +337,28 @@ int VideoDecoder::Decode(bool dump){
 
 
 bool VideoDecoder::SetInputStream(unsigned char * buffer, int len, int64_t pts){
-	if (m_current_buffer_cache_len >= INPUT_BUFFER_CACHE_LEN || len > INPUT_BUFFER_CACHE_LEN){
-		unsigned char * new_buffer = new unsigned char[INPUT_BUFFER_CACHE_LEN * 2];
-		memcpy(new_buffer, m_input_buffer_cache, m_current_buffer_cache_len);
-		delete [] m_input_buffer_cache;
-		m_input_buffer_cache = new_buffer;
-	}
+	{
+		TraceSpan span("receive", m_trace_channel, pts);
+		if (m_current_buffer_cache_len >= INPUT_BUFFER_CACHE_LEN || len > INPUT_BUFFER_CACHE_LEN){
+			unsigned char * new_buffer = new unsigned char[INPUT_BUFFER_CACHE_LEN * 2];
+			memcpy(new_buffer, m_input_buffer_cache, m_current_buffer_cache_len);
+			delete [] m_input_buffer_cache;
+			m_input_buffer_cache = new_buffer;
+		}
 
-	memcpy(m_input_buffer_cache + m_current_buffer_cache_len, buffer, len);
-	m_current_buffer_cache_len += len;
+		memcpy(m_input_buffer_cache + m_current_buffer_cache_len, buffer, len);
+		m_current_buffer_cache_len += len;
+	}
 
 	if (!m_inited){
 		if (!InitCodec())
 			return false;
-		else
-			m_inited = true;
+		if (!m_frame_info.FourCC){
+			// no sequence header yet, keep caching input
+			m_pts_queue.push(pts);
+			return true;
+		}
+		m_inited = true;
 	}
 	m_pts_queue.push(pts);
 	int remain = Decode(false);
@@ -425,13 +378,76 @@ bool VideoDecoder::Dump(){
 	
 }
 
+/*
+drops the frames still in the sdk, the cached input and the queued pts without
+handing them out. the session, surfaces and buffers are kept, so the next
+SetInputStream has to start at a random access point of the same stream.
+*/
+bool VideoDecoder::Flush(){
+	if (!m_input_buffer_cache)
+		return false;
+	m_current_buffer_cache_len = 0;
+	while(!m_pts_queue.empty()){
+		m_pts_queue.pop();
+	}
+	m_seeking = false;
+	if (!m_inited)
+		return true;
+
+	for (auto & s : m_output_surfaces){
+		s->used = false;
+		s->sync = nullptr;
+	}
+	m_output_surfaces.clear();
+	mfxStatus ret = m_backend->DecodeReset(&m_video_param);
+	if (ret < MFX_ERR_NONE){
+		printf("decoder reset failed %d\n", ret);
+		return false;
+	}
+	return true;
+}
+
+/*
+Flush, then frames before pts are decoded but not handed out: feed the stream
+from the random access point before pts and the first callback is the frame at pts.
+*/
+bool VideoDecoder::Seek(int64_t pts){
+	if (!Flush())
+		return false;
+	m_seeking = true;
+	m_seek_pts = pts;
+	return true;
+}
+
+bool VideoDecoder::Seek(int64_t pts, const StreamIndex & index, StreamIndexKeyframe & key){
+	// the index does not know whether a GOP is closed, pictures after an I or CRA may reference frames before it
+	const StreamIndexKeyframe * found = index.Find(pts, true);
+	if (!found || index.Codec() != m_codec_type)
+		return false;
+	const std::vector<unsigned char> & params = index.ParamSets(*found);
+	if (params.size() > INPUT_BUFFER_CACHE_LEN){
+		printf("parameter sets of %d bytes do not fit the input buffer\n", (int)params.size());
+		return false;
+	}
+	if (!Seek(pts))
+		return false;
+	key = *found;
+	// cached ahead of the keyframe, the pts goes with the keyframe's access unit
+	memcpy(m_input_buffer_cache, params.data(), params.size());
+	m_current_buffer_cache_len = (int)params.size();
+	return true;
+}
+
 void VideoDecoder::Close(){
-	UnInitVA();
-	if (m_session) {
+	if (m_backend) {
 		if(m_inited)
-			MFXVideoDECODE_Close(m_session);
-		MFXClose(m_session);
-		m_session = nullptr;
+			m_backend->DecodeClose();
+		m_backend->Close();
+		if (m_own_backend){
+			delete m_backend;
+			m_backend = nullptr;
+			m_own_backend = false;
+		}
 	}
 	memset(&m_frame_info, 0, sizeof(mfxFrameInfo));
 
@@ -445,10 +461,14 @@ void VideoDecoder::Close(){
 		delete[] m_raw_frame_buffer;
 		m_raw_frame_buffer = nullptr;
 	}
+	if (m_luma_stats)
+		m_luma_stats->ForgetPrevious();
 
 	FreeSurface();
 
 	m_inited = false;
+	m_seeking = false;
+	memset(&m_video_param, 0, sizeof(mfxVideoParam));
 	m_codec_type = VideoCodec::NONE;
 	m_frame_cb = nullptr;
 	m_user_data = nullptr;
@@ -6,35 +6,67 @@
 #include <queue>
 
 #include "Def.h"
+#include "CodecBackend.h"
+#include "FrameTrace.h"
+
+struct FrameHash;
+class LumaStats;
+class FrameRingWriter;
+class StreamIndex;
+struct StreamIndexKeyframe;
 
 class VideoDecoder {
 public:
 	VideoDecoder() = default;
 	~VideoDecoder();
+	void SetBackend(CodecBackend * backend);
 	bool Init(VideoCodec type);
 	void SetFrameCB(VideoFrameCB cb, void * user_data);
+	void SetTraceChannel(int channel);
+	void SetFrameHash(bool enable);
+	// luma histogram, mean/variance and SAD to the previous frame in VideoRawData::stats
+	void SetFrameStats(bool enable);
+	/*
+	frames are converted straight into the next slot of ring (not owned) and
+	published there, the frame callback is optional in this mode and sees the
+	slot. frames the ring skips go to the callback from the decoder's own buffer.
+	*/
+	void SetOutputRing(FrameRingWriter * ring);
 	bool SetInputStream(unsigned char * buffer, int len, int64_t pts);
 	bool Dump();
+	bool Flush();
+	bool Seek(int64_t pts);
+	/*
+	Seek(pts) from the IDR/BLA keyframe the index has before pts, with its parameter
+	sets queued: feed the stream from key.offset, pts counting on from key.frame.
+	Fails when the parameter sets do not fit the input buffer.
+	*/
+	bool Seek(int64_t pts, const StreamIndex & index, StreamIndexKeyframe & key);
 	void Close();
 private:
-	bool InitVA(mfxSession session);
-	void UnInitVA();
-	int m_device_fd = -1;
-	void * m_va_dpy = nullptr;
+	CodecBackend * m_backend = nullptr;
+	bool m_own_backend = false;
 private:
 	std::queue<int64_t> m_pts_queue;
 	VideoCodec m_codec_type = VideoCodec::NONE;
 	VideoFrameCB m_frame_cb = nullptr;
 	void * m_user_data = nullptr;
+	int m_trace_channel = FrameTrace::NewChannel();
+	FrameHash * m_frame_hash = nullptr;
+	LumaStats * m_luma_stats = nullptr;
+	VideoFrameStats m_frame_stats;
+	FrameRingWriter * m_ring = nullptr;
 	bool m_inited = false;
+	bool m_seeking = false;
+	int64_t m_seek_pts = 0;		// while seeking, frames before this pts are decoded but not handed out
 	unsigned char * m_input_buffer_cache = nullptr;
 	int m_current_buffer_cache_len = 0;
 	unsigned char * m_raw_frame_buffer = nullptr;
 	std::vector<MFXSurface*> m_surfaces;
 	std::vector<MFXSurface*> m_output_surfaces;
 private:
-	mfxSession m_session = nullptr;
 	mfxFrameInfo m_frame_info;
+	mfxVideoParam m_video_param;
 private:
 	bool AllocSuface(mfxFrameInfo *info, int num);
 	void FreeSurface();
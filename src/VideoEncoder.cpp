@@ -1,89 +1,67 @@
-#include <fcntl.h>
-#include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 
 #include "VideoEncoder.h"
-#include "va/va.h"
-#include "va/va_drm.h"
+#include "HardwareBackend.h"
+#include "PixelFormat.h"
+#include "StreamIndex.h"
 
 #define MSDK_ALIGN16(value)  (((value + 15) >> 4) << 4)
-#define MSDK_ALIGN32(X) (((mfxU32)((X)+31)) & (~ (mfxU32)31))
 
 #define MFX_BITSTREAM_BUFFER_LEN 1024*1024*10
 #define MSDK_ENC_WAIT_INTERVAL 1000
-
-template <class T>
-static void ConvertYUVpitchtoNV12(const T * psrc_y, const T * psrc_u, const T * psrc_v,
-								 T * pdst_y, T * pdst_uv,
-								 int width, int height , int srcStride, int dstStride){
-
-    if (srcStride == 0)
-        srcStride = width;
-    if (dstStride == 0)
-        dstStride = width;
-
-    for (int y = 0 ; y < height ; y++){
-        memcpy(pdst_y + (dstStride*y), psrc_y + (srcStride*y),width * sizeof(T));
-    }
-
-    for (int y = 0 ; y < height/2 ; y++){
-        for (int x= 0 ; x < width; x=x+2){
-        	pdst_uv[(y*dstStride) + x] =    psrc_u[((srcStride/2)*y) + (x >>1)];
-        	pdst_uv[(y*dstStride) +(x+1)] = psrc_v[((srcStride/2)*y) + (x >>1)];
-        }
-    }
-}
+#define MSDK_ENC_BUSY_WAIT_MS 1
+#define REF_LIST_UNUSED 0xFFFFFFFF	// MFX_FRAMEORDER_UNKNOWN
 
 VideoEncoder::~VideoEncoder(){
 	Close();
+	delete m_frame_hash;
 }
 
 
-bool VideoEncoder::InitVA(mfxSession m_Session){
-	m_device_fd = open("/dev/dri/renderD128", O_RDWR);
-	if(m_device_fd < 0)
-		return false;
-	m_va_dpy = vaGetDisplayDRM(m_device_fd);
-	if(!m_va_dpy)
-		return false;
-	int major_version,minor_version;
-	VAStatus va_status = vaInitialize(m_va_dpy, &major_version, &minor_version);
-	if(va_status != VA_STATUS_SUCCESS)
-		return false;
-	mfxStatus mfx_status = MFXVideoCORE_SetHandle(m_Session, MFX_HANDLE_VA_DISPLAY, m_va_dpy);
-	if(mfx_status < MFX_ERR_NONE)
-		return false;
-	return true;
+void VideoEncoder::SetBackend(CodecBackend * backend){
+	if (m_own_backend){
+		delete m_backend;
+		m_own_backend = false;
+	}
+	m_backend = backend;
 }
 
-void VideoEncoder::UnInitVA(){
-	if(m_va_dpy){
-		vaTerminate(m_va_dpy);
-		m_va_dpy = nullptr;
-	}
-	if(m_device_fd >= 0){
-		close(m_device_fd);
-		m_device_fd = -1;
+void VideoEncoder::SetTraceChannel(int channel){
+	m_trace_channel = channel;
+}
+
+void VideoEncoder::SetFrameHash(bool enable){
+	if (enable && !m_frame_hash)
+		m_frame_hash = new FrameHash();
+	else if (!enable){
+		delete m_frame_hash;
+		m_frame_hash = nullptr;
 	}
+}
 
+void VideoEncoder::SetStreamIndex(StreamIndex * index){
+	m_stream_index = index;
 }
 
 bool VideoEncoder::Init(VideoParams & param){
 	Close();
-	mfxIMPL impl = MFX_IMPL_HARDWARE_ANY;
-	mfxVersion ver{ 0,1 };
-	mfxStatus ret = MFXInit(impl, &ver, &m_session);
-	if (ret != MFX_ERR_NONE)
-		return false;
-	if(!InitVA(m_session))
+	if (!m_backend){
+		m_backend = new HardwareBackend();
+		m_own_backend = true;
+	}
+	if(!m_backend->Open())
 		return false;
-	if(!InitCodec(m_session,param))
+	if(!InitCodec(param))
 		return false;
+	m_params = param;
 	return true;
 }
 
-bool VideoEncoder::InitCodec(mfxSession session,VideoParams & param) {
+bool VideoEncoder::InitCodec(VideoParams & param) {
 	/*specifies the codec format identifier in the FOURCC code.
 	MFX_CODEC_AVC
 	MFX_CODEC_MPEG2
@@ -135,13 +113,23 @@ bool VideoEncoder::InitCodec(mfxSession session,VideoParams & param) {
 										/*
 										Rate control method.
 										*/
-	mfx_param.mfx.RateControlMethod = MFX_RATECONTROL_VBR;
-	/*
-	TargetKbps must be specified for encoding initialization.
-	*/
-	mfx_param.mfx.TargetKbps = param.bit_rate;
-	mfx_param.mfx.MaxKbps = param.bit_rate * 2;
-	mfx_param.mfx.BufferSizeInKB =param.bit_rate * 2 / 8;
+	if (param.qp > 0){
+		/*
+		constant qp, the only mode where mfxEncodeCtrl::QP is applied per frame.
+		*/
+		mfx_param.mfx.RateControlMethod = MFX_RATECONTROL_CQP;
+		mfx_param.mfx.QPI = param.qp;
+		mfx_param.mfx.QPP = param.qp;
+		mfx_param.mfx.QPB = param.qp;
+	}else{
+		mfx_param.mfx.RateControlMethod = MFX_RATECONTROL_VBR;
+		/*
+		TargetKbps must be specified for encoding initialization.
+		*/
+		mfx_param.mfx.TargetKbps = param.bit_rate;
+		mfx_param.mfx.MaxKbps = param.bit_rate * 2;
+		mfx_param.mfx.BufferSizeInKB =param.bit_rate * 2 / 8;
+	}
 	/*
 	*/
 	mfx_param.mfx.FrameInfo.FrameRateExtN = param.frame_rate_num;
@@ -152,19 +140,22 @@ bool VideoEncoder::InitCodec(mfxSession session,VideoParams & param) {
 	mfx_param.mfx.FrameInfo.CropW = param.width;
 	mfx_param.mfx.FrameInfo.CropH = param.height;
 
-	if(param.bit_depth == 10){
-		mfx_param.mfx.FrameInfo.FourCC = MFX_FOURCC_P010;
-		mfx_param.mfx.FrameInfo.ChromaFormat = MFX_CHROMAFORMAT_YUV420;
-		mfx_param.mfx.FrameInfo.BitDepthChroma = 10;
-		mfx_param.mfx.FrameInfo.BitDepthLuma = 10;
-		mfx_param.mfx.FrameInfo.Shift = 0;
-	}else{
-		mfx_param.mfx.FrameInfo.FourCC = MFX_FOURCC_NV12;
-		mfx_param.mfx.FrameInfo.ChromaFormat = MFX_CHROMAFORMAT_YUV420;
-		mfx_param.mfx.FrameInfo.BitDepthChroma = 8;
-		mfx_param.mfx.FrameInfo.BitDepthLuma = 8;
-		mfx_param.mfx.FrameInfo.Shift = 0;
+	/*
+	P010, Y210: 10 bit samples msb aligned in 16 bit words (Shift = 1),
+	Y410 packs them into bit fields and has no shift.
+	*/
+	PixelFormatDesc format;
+	if(!GetSurfaceFormat(SurfaceFourCC(param.chroma_format, param.bit_depth), format)){
+		printf("unsupported chroma format / bit depth %d\n", param.bit_depth);
+		return false;
 	}
+	mfx_param.mfx.FrameInfo.FourCC = format.fourcc;
+	mfx_param.mfx.FrameInfo.ChromaFormat = format.chroma_format;
+	mfx_param.mfx.FrameInfo.BitDepthChroma = format.bit_depth;
+	mfx_param.mfx.FrameInfo.BitDepthLuma = format.bit_depth;
+	mfx_param.mfx.FrameInfo.Shift = format.sample_bytes == 2 && format.bit_depth > 8 ? 1 : 0;
+	if(param.codec == VideoCodec::HEVC && format.chroma_format != MFX_CHROMAFORMAT_YUV420)
+		mfx_param.mfx.CodecProfile = MFX_PROFILE_HEVC_REXT;
 
 	mfx_param.mfx.FrameInfo.Height = MSDK_ALIGN16(param.height);
 	mfx_param.mfx.FrameInfo.Width = MSDK_ALIGN16(param.width);
@@ -174,14 +165,18 @@ bool VideoEncoder::InitCodec(mfxSession session,VideoParams & param) {
 	mfx_param.IOPattern = MFX_IOPATTERN_IN_SYSTEM_MEMORY;
 	mfx_param.AsyncDepth = 4;
 
-	mfxStatus sts = MFXVideoENCODE_Init(session, &mfx_param);
+	mfxStatus sts = m_backend->EncodeInit(&mfx_param);
 	if (sts != MFX_ERR_NONE) {
 		return false;
 	}
+	// GopRefDist 0 leaves b frames to the sdk, only the resolved value says whether it uses them
+	mfxVideoParam actual;
+	memset(&actual, 0, sizeof(mfxVideoParam));
+	m_gop_ref_dist = m_backend->EncodeGetVideoParam(&actual) == MFX_ERR_NONE ? actual.mfx.GopRefDist : 0;
 	m_frame_info = mfx_param.mfx.FrameInfo;
 	mfxFrameAllocRequest request;
 	memset(&request, 0, sizeof(mfxFrameAllocRequest));
-	sts = MFXVideoENCODE_QueryIOSurf(session, &mfx_param, &request);
+	sts = m_backend->EncodeQueryIOSurf(&mfx_param, &request);
 	if(sts == MFX_ERR_NONE){
 		AllocSuface(&mfx_param.mfx.FrameInfo,request.NumFrameSuggested);
 	}else{
@@ -196,25 +191,10 @@ void VideoEncoder::AllocSuface(mfxFrameInfo *info, int num){
 		mfxFrameSurface1 *surface = new mfxFrameSurface1;
 		memset(surface, 0, sizeof(mfxFrameSurface1));
 		surface->Info = *info;
-		mfxU32 width2 = (mfxU16)MSDK_ALIGN32(info->Width);
-		mfxU32 height2 = (mfxU16)MSDK_ALIGN32(info->Height);
-
-		if(info->FourCC == MFX_FOURCC_NV12){
-			mfxU32 frame_size = width2*height2 + (width2 >> 1)*(height2 >> 1) + (width2 >> 1)*(height2 >> 1);
-			mfxU8 *frame_data = (mfxU8*)calloc(frame_size + 32, 1);
-			surface->Data.Y = frame_data;
-			surface->Data.U = surface->Data.Y + width2 * height2;
-			surface->Data.V = surface->Data.U + 1;
-			surface->Data.Pitch = width2;
-		}else if(info->FourCC == MFX_FOURCC_P010){
-			mfxU32 frame_size = (width2*height2 + (width2 >> 1)*(height2 >> 1) + (width2 >> 1)*(height2 >> 1)) * 2;
-			mfxU8 *frame_data = (mfxU8*)calloc(frame_size + 32, 1);
-			surface->Data.Y = frame_data;
-			surface->Data.U = surface->Data.Y + width2 * height2 * 2;
-			surface->Data.V = surface->Data.U + 2;
-			surface->Data.Pitch = width2 * 2;
-		}else
+		if(!AllocSurfaceData(surface)){
+			delete surface;
 			return;
+		}
 
 		m_surfaces.push_back(surface);
 	}
@@ -234,16 +214,17 @@ void VideoEncoder::AllocSuface(mfxFrameInfo *info, int num){
 void VideoEncoder::FreeSurface(){
 	for (auto & s : m_surfaces){
 		if (s){
-			if(s->Data.Y){
-				free(s->Data.Y);
-			}
+			FreeSurfaceData(s);
 			delete s;
 		}
 	}
 	m_surfaces.clear();
+	m_acquired.clear();
 	for(auto & b : m_bitstreams){
 		if(b){
 			if(b->mfx_bit_stream){
+				if(b->mfx_bit_stream->Data)
+					delete [] b->mfx_bit_stream->Data;
 				delete b->mfx_bit_stream;
 			}
 			if(b->sync_p){
@@ -253,6 +234,8 @@ void VideoEncoder::FreeSurface(){
 		}
 	}
 	m_bitstreams.clear();
+	m_ctrls.clear();
+	m_pending.clear();
 }
 
 VideoBitStream *VideoEncoder::GetFreebitstream(){
@@ -275,96 +258,214 @@ VideoBitStream *VideoEncoder::GetFreebitstream(){
 
 mfxFrameSurface1* VideoEncoder::GetSuface(){
 	for (auto iter = m_surfaces.begin();iter != m_surfaces.end(); iter++){
-		if (!(*iter)->Data.Locked) {
+		if (!(*iter)->Data.Locked && std::find(m_acquired.begin(), m_acquired.end(), *iter) == m_acquired.end()) {
 			return *iter;
 		}
 	}
 	mfxFrameSurface1 *surface = new mfxFrameSurface1();
 	memset(surface, 0, sizeof(mfxFrameSurface1));
 	surface->Info = m_frame_info;
-	mfxU32 width2 = (mfxU16)MSDK_ALIGN32(m_frame_info.Width);
-	mfxU32 height2 = (mfxU16)MSDK_ALIGN32(m_frame_info.Height);
-	if(m_frame_info.FourCC == MFX_FOURCC_NV12){
-		mfxU32 frame_size = width2*height2 + (width2 >> 1)*(height2 >> 1) + (width2 >> 1)*(height2 >> 1);
-		mfxU8 *frame_data = (mfxU8*)calloc(frame_size + 32, 1);
-		surface->Data.Y = frame_data;
-		surface->Data.U = surface->Data.Y + width2 * height2;
-		surface->Data.V = surface->Data.U + 1;
-		surface->Data.Pitch = width2;
-	}else if(m_frame_info.FourCC == MFX_FOURCC_P010){
-		mfxU32 frame_size = (width2*height2 + (width2 >> 1)*(height2 >> 1) + (width2 >> 1)*(height2 >> 1)) * 2;
-		mfxU8 *frame_data = (mfxU8*)calloc(frame_size + 32, 1);
-		surface->Data.Y = frame_data;
-		surface->Data.U = surface->Data.Y + width2 * height2 * 2;
-		surface->Data.V = surface->Data.U + 2;
-		surface->Data.Pitch = width2 * 2;
-	}else
+	if(!AllocSurfaceData(surface)){
+		delete surface;
 		return nullptr;
-
-	surface->Info = m_frame_info;
+	}
 	m_surfaces.push_back(surface);
 	return surface;
 }
 
+/*
+fills the control kept for surface, nullptr when there is nothing to ask for.
+display order encoding ignores a non reference FrameType, so a non_reference
+frame is also put into the RejectedRefList of the frame after it, which takes
+it out of the dpb before anything could predict from it.
+*/
+mfxEncodeCtrl * VideoEncoder::SetEncodeCtrl(mfxFrameSurface1 *surface, const VideoEncodeCtrl * ctrl, uint32_t & requested){
+	requested = 0;
+	EncodeCtrl & entry = m_ctrls[surface];
+	mfxEncodeCtrl & mfx_ctrl = entry.ctrl;
+	memset(&mfx_ctrl, 0, sizeof(mfxEncodeCtrl));
+	bool reject = m_reject_pending;
+	if (reject){
+		mfxExtAVCRefListCtrl & ref_list = entry.ref_list;
+		memset(&ref_list, 0, sizeof(mfxExtAVCRefListCtrl));
+		ref_list.Header.BufferId = MFX_EXTBUFF_AVC_REFLIST_CTRL;
+		ref_list.Header.BufferSz = sizeof(mfxExtAVCRefListCtrl);
+		for (auto & ref : ref_list.PreferredRefList)
+			ref.FrameOrder = REF_LIST_UNUSED;
+		for (auto & ref : ref_list.RejectedRefList)
+			ref.FrameOrder = REF_LIST_UNUSED;
+		for (auto & ref : ref_list.LongTermRefList)
+			ref.FrameOrder = REF_LIST_UNUSED;
+		ref_list.RejectedRefList[0].FrameOrder = m_reject_frame;
+		ref_list.RejectedRefList[0].PicStruct = MFX_PICSTRUCT_PROGRESSIVE;
+		entry.ext_param[0] = &ref_list.Header;
+		mfx_ctrl.ExtParam = entry.ext_param;
+		mfx_ctrl.NumExtParam = 1;
+		m_reject_pending = false;
+	}
+	if (ctrl && ctrl->force_idr){
+		mfx_ctrl.FrameType = MFX_FRAMETYPE_I | MFX_FRAMETYPE_REF | MFX_FRAMETYPE_IDR;
+		requested |= VIDEO_CTRL_IDR;
+	}else if (ctrl && ctrl->non_reference){
+		mfx_ctrl.FrameType = MFX_FRAMETYPE_P;
+		requested |= VIDEO_CTRL_NON_REFERENCE;
+		m_reject_pending = true;
+		m_reject_frame = surface->Data.FrameOrder;
+	}
+	if (ctrl && ctrl->qp > 0){
+		mfx_ctrl.QP = ctrl->qp > 51 ? 51 : ctrl->qp;
+		requested |= VIDEO_CTRL_QP;
+	}
+	return requested || reject ? &mfx_ctrl : nullptr;
+}
+
+// matches the packet to its frame by the frame order in TimeStamp and puts the caller's pts back
+void VideoEncoder::ReportEncodeCtrl(VideoBitStream *bit_stream){
+	bit_stream->ctrl_requested = 0;
+	bit_stream->ctrl_honoured = 0;
+	auto iter = m_pending.find((mfxU32)bit_stream->mfx_bit_stream->TimeStamp);
+	if (iter == m_pending.end())
+		return;
+	bit_stream->mfx_bit_stream->TimeStamp = iter->second.pts;
+	mfxU16 type = bit_stream->mfx_bit_stream->FrameType;
+	uint32_t requested = iter->second.requested;
+	uint32_t honoured = 0;
+	if ((requested & VIDEO_CTRL_IDR) && (type & MFX_FRAMETYPE_IDR))
+		honoured |= VIDEO_CTRL_IDR;
+	// without b frames the frame after it is coded next, and its RejectedRefList holds this one
+	if ((requested & VIDEO_CTRL_NON_REFERENCE) && type && (!(type & MFX_FRAMETYPE_REF) || m_gop_ref_dist == 1))
+		honoured |= VIDEO_CTRL_NON_REFERENCE;
+	if ((requested & VIDEO_CTRL_QP) && m_params.qp > 0)
+		honoured |= VIDEO_CTRL_QP;
+	bit_stream->ctrl_requested = requested;
+	bit_stream->ctrl_honoured = honoured;
+	m_pending.erase(iter);
+}
+
 void VideoEncoder::Close(){
 	m_framenum = 0;
-	UnInitVA();
-	FreeSurface();
-	if (m_session) {
+	m_reject_pending = false;
+	m_gop_ref_dist = 0;
+	if (m_backend) {
 		if(m_inited_encoder)
-			MFXVideoENCODE_Close(m_session);
-		MFXClose(m_session);
-		m_session = nullptr;
+			m_backend->EncodeClose();
+		m_backend->Close();
+		if (m_own_backend){
+			delete m_backend;
+			m_backend = nullptr;
+			m_own_backend = false;
+		}
 	}
+	FreeSurface();
 	memset(&m_frame_info, 0, sizeof(mfxFrameInfo));
+	m_params = VideoParams();
 	m_codec_type = VideoCodec::NONE;
 	m_inited_encoder = false;
 }
 
-bool VideoEncoder::EncodeSync(VideoRawData & pic,VideoBitStream & stream){
+bool VideoEncoder::EncodeSync(VideoRawData & pic,VideoBitStream & stream, const VideoEncodeCtrl * ctrl){
 
-	if(!m_session || !m_inited_encoder)
+	if(!m_backend || !m_inited_encoder)
 		return false;
 
-	mfxStatus sts = MFX_ERR_NONE;
-	mfxFrameSurface1 *surface = GetSuface();
+	mfxFrameSurface1 *surface = nullptr;
+	{
+		TraceSpan span("acquire", m_trace_channel, pic.pts);
+		surface = GetSuface();
+	}
 
-	switch(pic.fmt){
-		case VideoBaseBandFmt::YUV420P:
-		case VideoBaseBandFmt::YUV420P10LE:{
-			if(surface->Info.FourCC == MFX_FOURCC_NV12){
-				ConvertYUVpitchtoNV12((mfxU8*)pic.buffer[0],(mfxU8*)pic.buffer[1],(mfxU8*)pic.buffer[2],(mfxU8*)surface->Data.Y,
-						(mfxU8*)surface->Data.UV,pic.width,pic.height,pic.width,surface->Info.Width);
-			}
-			else if(surface->Info.FourCC == MFX_FOURCC_P010){
-				ConvertYUVpitchtoNV12((mfxU16*)pic.buffer[0],(mfxU16*)pic.buffer[1],(mfxU16*)pic.buffer[2],(mfxU16*)surface->Data.Y,
-						(mfxU16*)surface->Data.UV,pic.width,pic.height,pic.width,surface->Info.Width);
-			}
-			break;
-		}
-		case VideoBaseBandFmt::NV12:
-		case VideoBaseBandFmt::P010LE:{
-			surface->Data.Y = pic.buffer[0];
-			surface->Data.UV =  pic.buffer[1];
-			break;
-		}
-		default:
+	if (!surface)
+		return false;
+
+	{
+		/*
+		planar input is converted into the surface layout, input already in the
+		surface layout is copied, a different bit depth or chroma sampling fails
+		*/
+		TraceSpan span("convert", m_trace_channel, pic.pts);
+		if (!CopyToSurface(pic, surface, m_frame_hash)){
+			printf("input format does not match the encoder surface\n");
 			return false;
+		}
+		if (m_frame_hash)
+			memcpy(pic.hash, m_frame_hash->value, sizeof(pic.hash));
 	}
+	return Submit(surface, pic.pts, stream, ctrl);
+}
+
+mfxFrameSurface1 * VideoEncoder::AcquireSurface(){
+	if(!m_backend || !m_inited_encoder)
+		return nullptr;
+	mfxFrameSurface1 *surface = GetSuface();
+	if (surface)
+		m_acquired.push_back(surface);
+	return surface;
+}
+
+void VideoEncoder::ReleaseSurface(mfxFrameSurface1 * surface){
+	auto iter = std::find(m_acquired.begin(), m_acquired.end(), surface);
+	if (iter != m_acquired.end())
+		m_acquired.erase(iter);
+}
+
+bool VideoEncoder::EncodeSurface(mfxFrameSurface1 * surface, int64_t pts, VideoBitStream & stream, const VideoEncodeCtrl * ctrl){
+	if (std::find(m_acquired.begin(), m_acquired.end(), surface) == m_acquired.end()){
+		printf("surface was not acquired from this encoder\n");
+		return false;
+	}
+	ReleaseSurface(surface);
+	return Submit(surface, pts, stream, ctrl);
+}
+
+bool VideoEncoder::Submit(mfxFrameSurface1 *surface, int64_t pts, VideoBitStream & stream, const VideoEncodeCtrl * ctrl){
+	if(!m_backend || !m_inited_encoder)
+		return false;
+
+	mfxStatus sts = MFX_ERR_NONE;
+	/*
+	the sdk carries the frame order as timestamp, so frames submitted with the
+	same pts can not take each other's packet report
+	*/
+	mfxU32 frame_order = m_framenum++;
+	surface->Data.FrameOrder = frame_order;
+	surface->Data.TimeStamp = frame_order;
+	PendingFrame & pending = m_pending[frame_order];
+	pending.pts = pts;
+	pending.requested = 0;
+	mfxEncodeCtrl *mfx_ctrl = nullptr;
+	if (ctrl || m_reject_pending)
+		mfx_ctrl = SetEncodeCtrl(surface, ctrl, pending.requested);
 
 	VideoBitStream *bit_stream = GetFreebitstream();
-	do {
-		sts = MFXVideoENCODE_EncodeFrameAsync(m_session, nullptr, surface, bit_stream->mfx_bit_stream, bit_stream->sync_p);
-	} while (sts == MFX_WRN_DEVICE_BUSY);
+	// the previous packet handed out from this bitstream is only valid until the next call
+	bit_stream->mfx_bit_stream->DataOffset = 0;
+	bit_stream->mfx_bit_stream->DataLength = 0;
+	{
+		TraceSpan span("submit", m_trace_channel, pts);
+		while (true){
+			sts = m_backend->EncodeFrameAsync(mfx_ctrl, surface, bit_stream->mfx_bit_stream, bit_stream->sync_p);
+			if (sts != MFX_WRN_DEVICE_BUSY)
+				break;
+			// the device queue is full, give it time to finish a frame instead of spinning
+			m_busy_retries++;
+			std::this_thread::sleep_for(std::chrono::milliseconds(MSDK_ENC_BUSY_WAIT_MS));
+		}
+	}
+	if (sts < MFX_ERR_NONE && sts != MFX_ERR_MORE_DATA)
+		m_pending.erase(frame_order);	// no packet will come for it
 
 	if (sts == MFX_ERR_NONE) {
 		if (*bit_stream->sync_p) {
-			sts = MFXVideoCORE_SyncOperation(m_session, *bit_stream->sync_p, MSDK_ENC_WAIT_INTERVAL);
+			TraceSpan span("sync", m_trace_channel, pts);
+			sts = m_backend->SyncOperation(*bit_stream->sync_p, MSDK_ENC_WAIT_INTERVAL);
 			if (sts == MFX_ERR_NONE) {
+				ReportEncodeCtrl(bit_stream);
+				mfxBitstream *bs = bit_stream->mfx_bit_stream;
+				if (m_stream_index && bs->DataLength)
+					m_stream_index->AddAccessUnit(bs->Data + bs->DataOffset, bs->DataLength);
 				stream = *bit_stream;
 
 			}
-			bit_stream->mfx_bit_stream->DataLength = 0;
 			*bit_stream->sync_p = nullptr;
 		}
 	}
@@ -2,36 +2,81 @@
 #define _H_VIDEOENCODER_
 
 #include <stdio.h>
+#include <map>
 #include <vector>
 
 #include "Def.h"
+#include "CodecBackend.h"
+#include "FrameTrace.h"
+
+struct FrameHash;
+class StreamIndex;
 
 class VideoEncoder{
 public:
 	VideoEncoder() = default;
 	~VideoEncoder();
+	void SetBackend(CodecBackend * backend);
 	bool Init(VideoParams & param);
-	bool EncodeSync(VideoRawData & pic,VideoBitStream & stream);
+	const VideoParams & GetParams() const { return m_params; }
+	bool EncodeSync(VideoRawData & pic,VideoBitStream & stream, const VideoEncodeCtrl * ctrl = nullptr);
+	/*
+	free pool surface reserved for the caller to fill in place, the encoder
+	does not hand it out again until EncodeSurface or ReleaseSurface
+	*/
+	mfxFrameSurface1 * AcquireSurface();
+	void ReleaseSurface(mfxFrameSurface1 * surface);
+	// encodes a surface from AcquireSurface as it stands, stream as from EncodeSync
+	bool EncodeSurface(mfxFrameSurface1 * surface, int64_t pts, VideoBitStream & stream, const VideoEncodeCtrl * ctrl = nullptr);
+	void SetTraceChannel(int channel);
+	void SetFrameHash(bool enable);
+	/*
+	every packet is added to index (not owned) as it comes out, Reset it for
+	the codec and open its sidecar before the first frame to index live
+	*/
+	void SetStreamIndex(StreamIndex * index);
+	// EncodeFrameAsync calls that found the device busy, each followed by a short sleep
+	uint64_t GetBusyRetries() const { return m_busy_retries; }
 	void Close();
 private:
-	bool InitVA(mfxSession m_session);
-	void UnInitVA();
-	int m_device_fd = -1;
-	void * m_va_dpy = nullptr;
+	CodecBackend * m_backend = nullptr;
+	bool m_own_backend = false;
 private:
 	VideoCodec m_codec_type = VideoCodec::NONE;
+	VideoParams m_params;
 	std::vector<mfxFrameSurface1*> m_surfaces;
+	std::vector<mfxFrameSurface1*> m_acquired;	// filled by the caller, skipped by GetSuface
 	std::vector<VideoBitStream*> m_bitstreams;
+	struct EncodeCtrl{
+		mfxEncodeCtrl ctrl;
+		mfxExtAVCRefListCtrl ref_list;
+		mfxExtBuffer * ext_param[1];
+	};
+	std::map<mfxFrameSurface1*, EncodeCtrl> m_ctrls;	// stays valid while the sdk holds the surface
+	bool m_reject_pending = false;	// the next frame drops m_reject_frame (FrameOrder of a non_reference frame) from its references
+	mfxU32 m_reject_frame = 0;
+	mfxU16 m_gop_ref_dist = 0;		// as the encoder resolved it, 1 without b frames, 0 if unknown
+	struct PendingFrame{
+		int64_t pts = 0;
+		uint32_t requested = 0;		// VIDEO_CTRL_*
+	};
+	std::map<mfxU32, PendingFrame> m_pending;	// by FrameOrder, the timestamp the sdk carries, until the packet is out
 	int m_framenum = 0;
+	uint64_t m_busy_retries = 0;
+	int m_trace_channel = FrameTrace::NewChannel();
+	FrameHash * m_frame_hash = nullptr;
+	StreamIndex * m_stream_index = nullptr;
 	bool m_inited_encoder = false;
 private:
-	mfxSession m_session = nullptr;
 	mfxFrameInfo m_frame_info;
 private:
 	void AllocSuface(mfxFrameInfo *info, int num);
 	void FreeSurface();
-	bool InitCodec(mfxSession session,VideoParams & param);
+	bool InitCodec(VideoParams & param);
 	mfxFrameSurface1 * GetSuface();
 	VideoBitStream *GetFreebitstream();
+	bool Submit(mfxFrameSurface1 *surface, int64_t pts, VideoBitStream & stream, const VideoEncodeCtrl * ctrl);
+	mfxEncodeCtrl * SetEncodeCtrl(mfxFrameSurface1 *surface, const VideoEncodeCtrl * ctrl, uint32_t & requested);
+	void ReportEncodeCtrl(VideoBitStream *bit_stream);
 };
 #endif
@@ -0,0 +1,1099 @@
+/*
+ * imsdk_perf.cpp
+ *
+ * Throughput/latency benchmark for VideoDecoder and VideoEncoder.
+ * Runs N concurrent decode, encode, transcode, seek or video wall instances and prints JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "VideoDecoder.h"
+#include "VideoEncoder.h"
+#include "EncodeQueue.h"
+#include "AsyncDecoder.h"
+#include "FrameRing.h"
+#include "Compositor.h"
+#include "StreamIndex.h"
+#include "PacketSink.h"
+#include "HardwareBackend.h"
+#include "LoopbackBackend.h"
+#include "FrameTrace.h"
+#include "PixelFormat.h"
+
+typedef std::chrono::steady_clock Clock;
+typedef std::vector<std::vector<unsigned char>> AccessUnits;
+
+struct PerfOptions{
+	std::string mode = "decode";
+	VideoCodec codec = VideoCodec::AVC;
+	std::string input;
+	std::string output;
+	std::string trace;
+	int width = 1920;
+	int height = 1080;
+	int fps = 60;
+	int bit_rate = 8000;
+	int gop_size = 60;
+	int b_frames = 0;
+	int qp = 0;
+	int force_idr = 0;	// encode: request an IDR every N frames through VideoEncodeCtrl
+	int bit_depth = 8;
+	VideoChromaFormat chroma_format = VideoChromaFormat::YUV420;
+	int frames = 600;
+	int seeks = 100;
+	int instances = 1;
+	bool realtime = false;
+	bool hash = false;
+	bool stats = false;
+	bool loopback = false;
+	int latency_us = 2000;
+	int queue_depth = 0;	// encode: 0 calls EncodeSync inline, otherwise frames go through an EncodeQueue
+	QueuePolicy queue_policy = QueuePolicy::BLOCK;
+	bool async = false;		// decode/transcode: run the decoder through an AsyncDecoder
+	AsyncDecoderParams async_params;
+	int ring_slots = 0;		// decode/transcode: publish frames into a shared memory ring of N slots
+	int ring_readers = 1;
+	RingPolicy ring_policy = RingPolicy::BLOCK;
+	int reader_delay_us = 0;	// simulated work per frame in each ring reader
+	int tiles = 16;			// wall: decoded sources composed into one encoded picture
+	bool index = false;		// seek: jump to keyframes through a StreamIndex instead of scanning the access units
+	std::string sidecar;	// index written to and read back from this file
+	std::string output_es;	// encode/transcode: packets written through a PacketSink, FILE.N for channel N > 0
+};
+
+struct Instance{
+	int id = 0;
+	const PerfOptions * opt = nullptr;
+	const AccessUnits * aus = nullptr;
+	std::vector<Clock::time_point> submit;
+	std::vector<double> latency_ms;
+	int frames = 0;
+	bool ok = true;
+	VideoEncoder * encoder = nullptr;
+	bool encoder_inited = false;
+	EncodeQueueStats queue;
+	AsyncDecoderStats async;
+	FrameRingStats ring;
+	CompositorStats wall;
+	PacketSink * sink = nullptr;
+	PacketSinkStats sink_stats;
+	int idr_requested = 0;
+	int idr_honoured = 0;
+	double luma_mean = 0;		// --stats: sums over the frames that carried stats
+	double luma_sad = 0;
+	int stats_frames = 0;
+	int sad_frames = 0;
+	int static_frames = 0;
+	const StreamIndex * index = nullptr;
+	int64_t seek_target = -1;
+	bool seek_done = false;
+};
+
+static void Usage(){
+	fprintf(stderr,
+		"usage: imsdk_perf [options]\n"
+		"  --mode decode|encode|transcode|seek|wall  workload (decode)\n"
+		"  --codec avc|hevc                 codec (avc)\n"
+		"  --input FILE                     annex-b elementary stream, synthetic frames if omitted\n"
+		"  --instances N                    concurrent channels (1)\n"
+		"  --frames N                       frames per channel for synthetic input (600)\n"
+		"  --seeks N                        seek: random seeks per channel (100)\n"
+		"  --width W --height H             synthetic picture size (1920x1080)\n"
+		"  --fps N                          frame rate (60)\n"
+		"  --bitrate KBPS --gop N           encoder settings (8000, 60)\n"
+		"  --b-frames N                     encoder GopRefDist (0)\n"
+		"  --qp N                           constant qp instead of --bitrate (0 = off)\n"
+		"  --force-idr N                    encode: request an IDR every N frames (0 = off)\n"
+		"  --bit-depth 8|10                 synthetic bit depth (8)\n"
+		"  --chroma 420|422|444             synthetic chroma sampling (420)\n"
+		"  --realtime                       pace input at --fps instead of as fast as possible\n"
+		"  --hash                           crc32c every decoded frame and encoder input\n"
+		"  --stats                          luma histogram/mean/variance/sad of every decoded frame\n"
+		"  --backend hw|loopback            codec backend (hw)\n"
+		"  --latency-us N                   loopback simulated latency (2000)\n"
+		"  --queue-depth N                  encode through a bounded input queue of N frames (0 = off)\n"
+		"  --queue-policy P                 block|drop-oldest|drop-non-ref|degrade (block)\n"
+		"  --async                          decode on a worker thread, frames delivered on another\n"
+		"  --packet-queue N --frame-queue N async queue depths (64, 4)\n"
+		"  --ring N                         decode into a shared memory ring of N slots (0 = off)\n"
+		"  --ring-readers N                 reader threads attached through the fd handoff (1)\n"
+		"  --ring-policy P                  block|drop-new|overwrite for slow readers (block)\n"
+		"  --reader-delay-us N              work per frame in each ring reader (0)\n"
+		"  --tiles N                        wall: decoders composed into a grid and encoded (16)\n"
+		"  --index                          seek: start at the keyframe from a stream index\n"
+		"  --sidecar FILE                   seek: write the index to FILE and seek with it read back\n"
+		"  --output FILE                    write the json report to FILE instead of stdout\n"
+		"  --output-es FILE                 encode/transcode: write the stream to FILE (FILE.N for channel N)\n"
+		"  --trace FILE                     write per-frame spans as chrome trace json to FILE\n");
+}
+
+static bool ParseArgs(int argc, char ** argv, PerfOptions & opt){
+	for (int i = 1; i < argc; i++){
+		const char * arg = argv[i];
+		const char * value = i + 1 < argc ? argv[i + 1] : nullptr;
+		if (!strcmp(arg, "--realtime")){
+			opt.realtime = true;
+			continue;
+		}
+		if (!strcmp(arg, "--hash")){
+			opt.hash = true;
+			continue;
+		}
+		if (!strcmp(arg, "--stats")){
+			opt.stats = true;
+			continue;
+		}
+		if (!strcmp(arg, "--async")){
+			opt.async = true;
+			continue;
+		}
+		if (!strcmp(arg, "--index")){
+			opt.index = true;
+			continue;
+		}
+		if (!strcmp(arg, "--help") || !strcmp(arg, "-h") || !value)
+			return false;
+		i++;
+		if (!strcmp(arg, "--mode"))
+			opt.mode = value;
+		else if (!strcmp(arg, "--codec")){
+			if (!strcmp(value, "avc"))
+				opt.codec = VideoCodec::AVC;
+			else if (!strcmp(value, "hevc"))
+				opt.codec = VideoCodec::HEVC;
+			else
+				return false;
+		}else if (!strcmp(arg, "--input"))
+			opt.input = value;
+		else if (!strcmp(arg, "--output"))
+			opt.output = value;
+		else if (!strcmp(arg, "--output-es"))
+			opt.output_es = value;
+		else if (!strcmp(arg, "--trace"))
+			opt.trace = value;
+		else if (!strcmp(arg, "--instances"))
+			opt.instances = atoi(value);
+		else if (!strcmp(arg, "--frames"))
+			opt.frames = atoi(value);
+		else if (!strcmp(arg, "--seeks"))
+			opt.seeks = atoi(value);
+		else if (!strcmp(arg, "--width"))
+			opt.width = atoi(value);
+		else if (!strcmp(arg, "--height"))
+			opt.height = atoi(value);
+		else if (!strcmp(arg, "--fps"))
+			opt.fps = atoi(value);
+		else if (!strcmp(arg, "--bitrate"))
+			opt.bit_rate = atoi(value);
+		else if (!strcmp(arg, "--gop"))
+			opt.gop_size = atoi(value);
+		else if (!strcmp(arg, "--b-frames"))
+			opt.b_frames = atoi(value);
+		else if (!strcmp(arg, "--qp"))
+			opt.qp = atoi(value);
+		else if (!strcmp(arg, "--force-idr"))
+			opt.force_idr = atoi(value);
+		else if (!strcmp(arg, "--bit-depth"))
+			opt.bit_depth = atoi(value);
+		else if (!strcmp(arg, "--chroma")){
+			if (!strcmp(value, "420"))
+				opt.chroma_format = VideoChromaFormat::YUV420;
+			else if (!strcmp(value, "422"))
+				opt.chroma_format = VideoChromaFormat::YUV422;
+			else if (!strcmp(value, "444"))
+				opt.chroma_format = VideoChromaFormat::YUV444;
+			else
+				return false;
+		}else if (!strcmp(arg, "--latency-us"))
+			opt.latency_us = atoi(value);
+		else if (!strcmp(arg, "--queue-depth"))
+			opt.queue_depth = atoi(value);
+		else if (!strcmp(arg, "--tiles"))
+			opt.tiles = atoi(value);
+		else if (!strcmp(arg, "--sidecar")){
+			opt.sidecar = value;
+			opt.index = true;
+		}
+		else if (!strcmp(arg, "--ring"))
+			opt.ring_slots = atoi(value);
+		else if (!strcmp(arg, "--ring-readers"))
+			opt.ring_readers = atoi(value);
+		else if (!strcmp(arg, "--reader-delay-us"))
+			opt.reader_delay_us = atoi(value);
+		else if (!strcmp(arg, "--ring-policy")){
+			if (!strcmp(value, "block"))
+				opt.ring_policy = RingPolicy::BLOCK;
+			else if (!strcmp(value, "drop-new"))
+				opt.ring_policy = RingPolicy::DROP_NEW;
+			else if (!strcmp(value, "overwrite"))
+				opt.ring_policy = RingPolicy::OVERWRITE;
+			else
+				return false;
+		}
+		else if (!strcmp(arg, "--packet-queue"))
+			opt.async_params.packet_depth = atoi(value);
+		else if (!strcmp(arg, "--frame-queue"))
+			opt.async_params.frame_depth = atoi(value);
+		else if (!strcmp(arg, "--queue-policy")){
+			if (!strcmp(value, "block"))
+				opt.queue_policy = QueuePolicy::BLOCK;
+			else if (!strcmp(value, "drop-oldest"))
+				opt.queue_policy = QueuePolicy::DROP_OLDEST;
+			else if (!strcmp(value, "drop-non-ref"))
+				opt.queue_policy = QueuePolicy::DROP_NON_REFERENCE;
+			else if (!strcmp(value, "degrade"))
+				opt.queue_policy = QueuePolicy::DEGRADE;
+			else
+				return false;
+		}
+		else if (!strcmp(arg, "--backend")){
+			if (!strcmp(value, "loopback"))
+				opt.loopback = true;
+			else if (!strcmp(value, "hw"))
+				opt.loopback = false;
+			else
+				return false;
+		}else
+			return false;
+	}
+	if (opt.mode != "decode" && opt.mode != "encode" && opt.mode != "transcode" && opt.mode != "seek" && opt.mode != "wall")
+		return false;
+	if (opt.bit_depth != 8 && opt.bit_depth != 10)
+		return false;
+	if (opt.async_params.packet_depth <= 0 || opt.async_params.frame_depth <= 0)
+		return false;
+	if (opt.tiles < 1)
+		return false;
+	if (opt.ring_slots < 0 || opt.ring_slots == 1 || opt.ring_readers < 1 || opt.ring_readers > FRAME_RING_MAX_READERS)
+		return false;
+	return opt.instances > 0 && opt.frames > 0 && opt.seeks > 0 && opt.fps > 0 && opt.width > 0 && opt.height > 0;
+}
+
+static CodecBackend * CreateBackend(const PerfOptions & opt){
+	if (opt.loopback){
+		LoopbackParams params;
+		params.latency_us = opt.latency_us;
+		params.width = opt.width;
+		params.height = opt.height;
+		params.bit_depth = opt.bit_depth;
+		params.chroma_format = opt.chroma_format;
+		return new LoopbackBackend(params);
+	}
+	return new HardwareBackend();
+}
+
+static void MakeParams(const PerfOptions & opt, int width, int height, VideoBaseBandFmt fmt, VideoParams & param){
+	PixelFormatDesc format;
+	GetRawFormat(fmt, format);
+	param.codec = opt.codec;
+	param.width = width;
+	param.height = height;
+	param.frame_rate_num = opt.fps;
+	param.frame_rate_den = 1;
+	param.gop_size = opt.gop_size;
+	param.b_frames = opt.b_frames;
+	param.qp = opt.qp;
+	param.bit_rate = opt.bit_rate;
+	param.bit_depth = format.bit_depth;
+	param.chroma_format = format.chroma_format == MFX_CHROMAFORMAT_YUV444 ? VideoChromaFormat::YUV444 :
+			format.chroma_format == MFX_CHROMAFORMAT_YUV422 ? VideoChromaFormat::YUV422 : VideoChromaFormat::YUV420;
+}
+
+// planar format of the synthetic input, YUV420P by default
+static VideoBaseBandFmt SyntheticFormat(const PerfOptions & opt){
+	PixelFormatDesc format;
+	if (!GetSurfaceFormat(SurfaceFourCC(opt.chroma_format, opt.bit_depth), format))
+		return VideoBaseBandFmt::NONE;
+	return format.planar;
+}
+
+/*
+synthetic planar picture, 10 bit samples lsb aligned, the buffers stay owned by planes
+*/
+static void MakePicture(const PerfOptions & opt, std::vector<unsigned char> & planes, VideoRawData & pic){
+	pic.width = opt.width;
+	pic.height = opt.height;
+	pic.fmt = SyntheticFormat(opt);
+	planes.assign(RawFrameSize(pic.fmt, pic.width, pic.height), 0);
+	SetRawPlanes(pic, planes.data());
+	int sample = opt.bit_depth == 10 ? 2 : 1;
+	for (int p = 0; p < 3; p++){
+		int width = pic.line_size[p] / sample;
+		int rows = p == 0 || opt.chroma_format != VideoChromaFormat::YUV420 ? opt.height : (opt.height + 1) / 2;
+		for (int y = 0; y < rows; y++){
+			for (int x = 0; x < width; x++){
+				int value = p == 0 ? (x + y) & 0xFF : 128;
+				if (sample == 2)
+					((uint16_t*)(pic.buffer[p] + y * pic.line_size[p]))[x] = value << 2;
+				else
+					pic.buffer[p][y * pic.line_size[p] + x] = (unsigned char)value;
+			}
+		}
+	}
+}
+
+static int NalType(VideoCodec codec, unsigned char header){
+	return codec == VideoCodec::HEVC ? (header >> 1) & 0x3F : header & 0x1F;
+}
+
+static bool IsPrefixNal(VideoCodec codec, int type){
+	if (codec == VideoCodec::HEVC)
+		return (type >= 32 && type <= 35) || type == 39;	// VPS SPS PPS AUD prefix-SEI
+	return type >= 6 && type <= 9;	// SEI SPS PPS AUD
+}
+
+static bool IsFirstSlice(VideoCodec codec, const unsigned char * nal, int len){
+	if (codec == VideoCodec::HEVC){
+		int type = NalType(codec, nal[0]);
+		return len > 2 && (type <= 9 || (type >= 16 && type <= 21)) && (nal[2] & 0x80);
+	}
+	int type = NalType(codec, nal[0]);
+	return len > 1 && type >= 1 && type <= 5 && (nal[1] & 0x80);
+}
+
+/*
+cut an annex-b stream into access units so every SetInputStream gets one picture
+*/
+static void SplitAccessUnits(const std::vector<unsigned char> & es, VideoCodec codec, AccessUnits & aus){
+	int len = es.size();
+	int au_start = 0;
+	bool has_picture = false;
+	int i = FindStartCode(es.data(), len);
+	while (i + 3 < len){
+		int nal = i + 3;
+		int sc = (i > 0 && !es[i - 1]) ? i - 1 : i;
+		int type = NalType(codec, es[nal]);
+		bool first_slice = IsFirstSlice(codec, &es[nal], len - nal);
+		if (has_picture && (first_slice || IsPrefixNal(codec, type))){
+			aus.push_back(std::vector<unsigned char>(es.begin() + au_start, es.begin() + sc));
+			au_start = sc;
+			has_picture = false;
+		}
+		if (first_slice)
+			has_picture = true;
+		i = nal + FindStartCode(&es[nal], len - nal);
+	}
+	if (au_start < len)
+		aus.push_back(std::vector<unsigned char>(es.begin() + au_start, es.end()));
+}
+
+static bool ReadFile(const std::string & path, std::vector<unsigned char> & data){
+	FILE * fp = fopen(path.c_str(), "rb");
+	if (!fp)
+		return false;
+	unsigned char buffer[64 * 1024];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+		data.insert(data.end(), buffer, buffer + n);
+	fclose(fp);
+	return true;
+}
+
+/*
+encode synthetic frames once up front so decode runs without an input file,
+index (if any) is built by the encoder as the packets come out
+*/
+static bool MakeSyntheticStream(const PerfOptions & opt, AccessUnits & aus, StreamIndex * index){
+	std::unique_ptr<CodecBackend> backend(CreateBackend(opt));
+	VideoEncoder encoder;
+	encoder.SetBackend(backend.get());
+	VideoParams param;
+	MakeParams(opt, opt.width, opt.height, SyntheticFormat(opt), param);
+	bool ok = encoder.Init(param);
+	if (ok && index){
+		index->Reset(opt.codec);
+		if (!opt.sidecar.empty())
+			ok = index->OpenSidecar(opt.sidecar.c_str());
+		encoder.SetStreamIndex(index);
+	}
+	if (ok){
+		std::vector<unsigned char> planes;
+		VideoRawData pic;
+		MakePicture(opt, planes, pic);
+		for (int i = 0; i < opt.frames; i++){
+			pic.pts = i;
+			VideoBitStream stream;
+			if (!encoder.EncodeSync(pic, stream)){
+				ok = false;
+				break;
+			}
+			if (stream.mfx_bit_stream && stream.mfx_bit_stream->DataLength){
+				unsigned char * data = stream.mfx_bit_stream->Data + stream.mfx_bit_stream->DataOffset;
+				aus.push_back(std::vector<unsigned char>(data, data + stream.mfx_bit_stream->DataLength));
+			}
+		}
+	}
+	encoder.Close();
+	if (index)
+		index->CloseSidecar();
+	return ok && !aus.empty();
+}
+
+static void RecordLatency(Instance * inst, int64_t pts, Clock::time_point now){
+	if (pts >= 0 && pts < (int64_t)inst->submit.size())
+		inst->latency_ms.push_back(std::chrono::duration<double, std::milli>(now - inst->submit[pts]).count());
+}
+
+/*
+--output-es: the channel's packets are written from the PacketSink worker,
+the encoding thread only copies them into its queue
+*/
+static bool OpenSink(Instance * inst, PacketSink & sink){
+	const PerfOptions & opt = *inst->opt;
+	if (opt.output_es.empty())
+		return true;
+	std::string path = opt.output_es;
+	if (inst->id > 0)
+		path += "." + std::to_string(inst->id);
+	if (!sink.Open(path.c_str())){
+		fprintf(stderr, "imsdk_perf: cannot write %s\n", path.c_str());
+		return false;
+	}
+	inst->sink = &sink;
+	return true;
+}
+
+static void CloseSink(Instance * inst){
+	if (!inst->sink)
+		return;
+	inst->sink->Flush();
+	inst->sink->GetStats(inst->sink_stats);
+	inst->sink->Close();
+	inst->sink = nullptr;
+	if (inst->sink_stats.failed_packets)
+		inst->ok = false;
+}
+
+static void WritePacket(Instance * inst, const VideoBitStream & stream){
+	if (inst->sink && stream.mfx_bit_stream && stream.mfx_bit_stream->DataLength && !inst->sink->Write(stream))
+		inst->ok = false;
+}
+
+static void OnFrame(VideoRawData *data, void * user_data){
+	Instance * inst = (Instance*)user_data;
+	if (inst->encoder){
+		if (!inst->encoder_inited){
+			// transcode: the encoder follows whatever the decoder produced
+			VideoParams param;
+			MakeParams(*inst->opt, data->width, data->height, data->fmt, param);
+			inst->encoder_inited = true;
+			if (!inst->encoder->Init(param))
+				inst->ok = false;
+		}
+		if (inst->ok){
+			VideoBitStream stream;
+			if (!inst->encoder->EncodeSync(*data, stream))
+				inst->ok = false;
+			WritePacket(inst, stream);
+		}
+	}
+	if (data->stats){
+		inst->stats_frames++;
+		inst->luma_mean += data->stats->mean;
+		if (data->stats->has_sad){
+			inst->sad_frames++;
+			inst->luma_sad += data->stats->sad;
+			if (data->stats->sad == 0)
+				inst->static_frames++;
+		}
+	}
+	RecordLatency(inst, data->pts, Clock::now());
+	inst->frames++;
+}
+
+static void CountEncodeCtrl(Instance * inst, const VideoBitStream & stream){
+	if (stream.ctrl_requested & VIDEO_CTRL_IDR)
+		inst->idr_requested++;
+	if (stream.ctrl_honoured & VIDEO_CTRL_IDR)
+		inst->idr_honoured++;
+}
+
+// runs on the EncodeQueue worker, the only thread touching inst while the queue is open
+static void OnPacket(VideoBitStream *stream, void * user_data){
+	Instance * inst = (Instance*)user_data;
+	RecordLatency(inst, stream->mfx_bit_stream->TimeStamp, Clock::now());
+	CountEncodeCtrl(inst, *stream);
+	WritePacket(inst, *stream);
+	inst->frames++;
+}
+
+// consumes frames in place from its own mapping of the ring until the writer closes it
+static void RunRingReader(FrameRingReader * reader, int delay_us){
+	VideoRawData pic;
+	for (;;){
+		if (!reader->Acquire(pic, 100)){
+			if (reader->Closed())
+				break;
+			continue;
+		}
+		volatile unsigned char sample = pic.buffer[0][(pic.height / 2) * pic.line_size[0] + pic.width / 2];
+		(void)sample;
+		if (delay_us)
+			std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+		reader->Release();
+	}
+}
+
+static void RunDecode(Instance * inst){
+	const PerfOptions & opt = *inst->opt;
+	std::unique_ptr<CodecBackend> backend(CreateBackend(opt));
+	std::unique_ptr<CodecBackend> encoder_backend(CreateBackend(opt));
+	VideoDecoder decoder;
+	decoder.SetBackend(backend.get());
+	VideoEncoder encoder;
+	encoder.SetBackend(encoder_backend.get());
+	if (opt.mode == "transcode"){
+		// one trace row per channel, decode and encode spans side by side
+		int channel = FrameTrace::NewChannel();
+		decoder.SetTraceChannel(channel);
+		encoder.SetTraceChannel(channel);
+		inst->encoder = &encoder;
+	}
+	PacketSink sink;
+	if (!decoder.Init(opt.codec) || (inst->encoder && !OpenSink(inst, sink))){
+		inst->ok = false;
+		return;
+	}
+	decoder.SetFrameHash(opt.hash);
+	decoder.SetFrameStats(opt.stats);
+	encoder.SetFrameHash(opt.hash);
+	FrameRingWriter ring;
+	std::vector<std::unique_ptr<FrameRingReader>> readers;
+	std::vector<std::thread> reader_threads;
+	if (opt.ring_slots > 0){
+		FrameRingParams params;
+		params.slots = opt.ring_slots;
+		params.slot_bytes = RawFrameSize(SyntheticFormat(opt), opt.width, opt.height);
+		params.max_readers = opt.ring_readers;
+		params.policy = opt.ring_policy;
+		if (!ring.Create(params)){
+			inst->ok = false;
+			return;
+		}
+		// the same fd handoff a reader in another process would go through
+		for (int i = 0; i < opt.ring_readers; i++){
+			int sv[2];
+			readers.push_back(std::unique_ptr<FrameRingReader>(new FrameRingReader()));
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+				continue;
+			if (ring.SendFds(sv[0]) && readers.back()->Open(sv[1]))
+				reader_threads.push_back(std::thread(RunRingReader, readers.back().get(), opt.reader_delay_us));
+			close(sv[0]);
+			close(sv[1]);
+		}
+		decoder.SetOutputRing(&ring);
+	}
+	// async: OnFrame runs on the delivery thread, inst is only read back here after Dump
+	AsyncDecoder async;
+	if (opt.async){
+		async.SetFrameCB(OnFrame, inst);
+		async.Open(&decoder, opt.async_params);
+	}else
+		decoder.SetFrameCB(OnFrame, inst);
+
+	const AccessUnits & aus = *inst->aus;
+	inst->submit.resize(aus.size());
+	bool ok = true;
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < aus.size() && ok; i++){
+		if (opt.realtime)
+			std::this_thread::sleep_until(start + std::chrono::microseconds(1000000LL * i / opt.fps));
+		inst->submit[i] = Clock::now();
+		std::vector<unsigned char> & au = const_cast<std::vector<unsigned char>&>(aus[i]);
+		if (opt.async)
+			ok = async.SetInputStream(au.data(), au.size(), i);
+		else
+			ok = decoder.SetInputStream(au.data(), au.size(), i) && inst->ok;
+	}
+	if (opt.async){
+		async.Dump();
+		async.GetStats(inst->async);
+		async.Close();
+		if (inst->async.decode_errors)
+			ok = false;
+	}else
+		decoder.Dump();
+	if (!ok)
+		inst->ok = false;
+	if (opt.ring_slots > 0){
+		// let the readers catch up before the ring closes
+		Clock::time_point deadline = Clock::now() + std::chrono::seconds(2);
+		for (;;){
+			ring.GetStats(inst->ring);
+			bool behind = false;
+			for (auto & reader : inst->ring.readers)
+				behind = behind || reader.lag > 0;
+			if (!behind || Clock::now() > deadline)
+				break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		ring.Close();
+		for (auto & t : reader_threads)
+			t.join();
+	}
+	decoder.Close();
+	encoder.Close();
+	inst->encoder = nullptr;
+	CloseSink(inst);
+}
+
+/*
+video wall: every tile decodes the input on a thread of its own straight into
+the compositor, this thread composes and encodes at --fps under --realtime and
+back to back otherwise, until the sources are done
+*/
+static void RunWall(Instance * inst){
+	const PerfOptions & opt = *inst->opt;
+	std::unique_ptr<CodecBackend> backend(CreateBackend(opt));
+	VideoEncoder encoder;
+	encoder.SetBackend(backend.get());
+	VideoParams param;
+	MakeParams(opt, opt.width, opt.height, VideoBaseBandFmt::YUV420P, param);
+	if (!encoder.Init(param)){
+		inst->ok = false;
+		return;
+	}
+	CompositorParams params;
+	params.columns = (int)ceil(sqrt((double)opt.tiles));
+	params.rows = (opt.tiles + params.columns - 1) / params.columns;
+	Compositor wall;
+	if (!wall.Open(&encoder, params)){
+		inst->ok = false;
+		return;
+	}
+
+	const AccessUnits & aus = *inst->aus;
+	std::atomic<int> running(opt.tiles);
+	std::atomic<bool> sources_ok(true);
+	std::vector<std::thread> sources;
+	for (int i = 0; i < opt.tiles; i++){
+		sources.push_back(std::thread([&, i](){
+			std::unique_ptr<CodecBackend> source_backend(CreateBackend(opt));
+			VideoDecoder decoder;
+			decoder.SetBackend(source_backend.get());
+			if (decoder.Init(opt.codec)){
+				decoder.SetFrameCB(Compositor::FrameCB, wall.TileUserData(i));
+				Clock::time_point start = Clock::now();
+				for (size_t n = 0; n < aus.size(); n++){
+					if (opt.realtime)
+						std::this_thread::sleep_until(start + std::chrono::microseconds(1000000LL * n / opt.fps));
+					std::vector<unsigned char> & au = const_cast<std::vector<unsigned char>&>(aus[n]);
+					if (!decoder.SetInputStream(au.data(), au.size(), n))
+						sources_ok = false;
+				}
+				decoder.Dump();
+				decoder.Close();
+			}else
+				sources_ok = false;
+			running--;
+		}));
+	}
+
+	Clock::time_point start = Clock::now();
+	for (int64_t i = 0; inst->ok; i++){
+		bool last = running == 0;
+		if (opt.realtime)
+			std::this_thread::sleep_until(start + std::chrono::microseconds(1000000LL * i / opt.fps));
+		inst->submit.push_back(Clock::now());
+		VideoBitStream stream;
+		if (!wall.Compose(i, stream)){
+			inst->ok = false;
+			break;
+		}
+		RecordLatency(inst, i, Clock::now());
+		inst->frames++;
+		if (last)
+			break;
+	}
+	for (auto & t : sources)
+		t.join();
+	if (!sources_ok)
+		inst->ok = false;
+	wall.GetStats(inst->wall);
+	wall.Close();
+	encoder.Close();
+}
+
+static bool IsRandomAccess(VideoCodec codec, const std::vector<unsigned char> & au){
+	for (size_t i = 0; i + 3 < au.size(); i++){
+		if (!au[i] && !au[i + 1] && au[i + 2] == 1){
+			int type = NalType(codec, au[i + 3]);
+			if (codec == VideoCodec::HEVC ? type == 33 : type == 7)
+				return true;
+		}
+	}
+	return false;
+}
+
+static void OnSeekFrame(VideoRawData *data, void * user_data){
+	Instance * inst = (Instance*)user_data;
+	if (inst->seek_done || data->pts != inst->seek_target)
+		return;
+	RecordLatency(inst, data->pts, Clock::now());
+	inst->seek_done = true;
+	inst->frames++;
+}
+
+/*
+scrubbing: seek to a random frame, feed from the random access point before it
+and measure Seek() to the callback of the target frame. with --index the decoder
+takes the keyframe and parameter sets from the index, otherwise the access units
+are scanned for sequence headers first.
+*/
+static void RunSeek(Instance * inst){
+	const PerfOptions & opt = *inst->opt;
+	std::unique_ptr<CodecBackend> backend(CreateBackend(opt));
+	VideoDecoder decoder;
+	decoder.SetBackend(backend.get());
+	if (!decoder.Init(opt.codec)){
+		inst->ok = false;
+		return;
+	}
+	decoder.SetFrameCB(OnSeekFrame, inst);
+
+	const AccessUnits & aus = *inst->aus;
+	std::vector<int> rap;
+	if (!inst->index){
+		rap.resize(aus.size(), 0);
+		for (size_t i = 0; i < aus.size(); i++)
+			rap[i] = IsRandomAccess(opt.codec, aus[i]) || i == 0 ? i : rap[i - 1];
+	}
+	inst->submit.resize(aus.size());
+	uint32_t seed = 1;
+	for (int s = 0; s < opt.seeks && inst->ok; s++){
+		seed = seed * 1103515245 + 12345;
+		int target = (seed >> 8) % aus.size();
+		inst->seek_target = target;
+		inst->seek_done = false;
+		inst->submit[target] = Clock::now();
+		StreamIndexKeyframe key;
+		if (inst->index ? !decoder.Seek(target, *inst->index, key) : !decoder.Seek(target)){
+			inst->ok = false;
+			break;
+		}
+		size_t from = inst->index ? key.frame : rap[target];
+		for (size_t i = from; i < aus.size() && !inst->seek_done; i++){
+			std::vector<unsigned char> & au = const_cast<std::vector<unsigned char>&>(aus[i]);
+			if (!decoder.SetInputStream(au.data(), au.size(), i))
+				inst->ok = false;
+		}
+		if (!inst->seek_done)
+			decoder.Dump();
+		if (!inst->seek_done)
+			inst->ok = false;
+	}
+	decoder.Close();
+}
+
+static void RunEncode(Instance * inst){
+	const PerfOptions & opt = *inst->opt;
+	std::unique_ptr<CodecBackend> backend(CreateBackend(opt));
+	VideoEncoder encoder;
+	encoder.SetBackend(backend.get());
+	encoder.SetFrameHash(opt.hash);
+	VideoParams param;
+	MakeParams(opt, opt.width, opt.height, SyntheticFormat(opt), param);
+	PacketSink sink;
+	if (!encoder.Init(param) || !OpenSink(inst, sink)){
+		inst->ok = false;
+		return;
+	}
+	std::vector<unsigned char> planes;
+	VideoRawData pic;
+	MakePicture(opt, planes, pic);
+
+	inst->submit.resize(opt.frames);
+	Clock::time_point start = Clock::now();
+	if (opt.queue_depth > 0){
+		// frames dropped by the queue policy never produce a packet and have no latency sample
+		EncodeQueueParams queue_params;
+		queue_params.depth = opt.queue_depth;
+		queue_params.policy = opt.queue_policy;
+		EncodeQueue queue;
+		queue.Open(&encoder, queue_params);
+		queue.SetPacketCB(OnPacket, inst);
+		for (int i = 0; i < opt.frames; i++){
+			if (opt.realtime)
+				std::this_thread::sleep_until(start + std::chrono::microseconds(1000000LL * i / opt.fps));
+			inst->submit[i] = Clock::now();
+			pic.pts = i;
+			VideoEncodeCtrl ctrl;
+			ctrl.force_idr = opt.force_idr > 0 && i > 0 && i % opt.force_idr == 0;
+			if (!queue.Push(pic, &ctrl)){
+				inst->ok = false;
+				break;
+			}
+		}
+		queue.Flush();
+		queue.GetStats(inst->queue);
+		queue.Close();
+		if (inst->queue.encode_errors)
+			inst->ok = false;
+		encoder.Close();
+		CloseSink(inst);
+		return;
+	}
+	for (int i = 0; i < opt.frames; i++){
+		if (opt.realtime)
+			std::this_thread::sleep_until(start + std::chrono::microseconds(1000000LL * i / opt.fps));
+		inst->submit[i] = Clock::now();
+		pic.pts = i;
+		VideoEncodeCtrl ctrl;
+		ctrl.force_idr = opt.force_idr > 0 && i > 0 && i % opt.force_idr == 0;
+		VideoBitStream stream;
+		if (!encoder.EncodeSync(pic, stream, &ctrl)){
+			inst->ok = false;
+			break;
+		}
+		// with b frames the packet belongs to an earlier input, or there is none yet
+		if (!stream.mfx_bit_stream || !stream.mfx_bit_stream->DataLength)
+			continue;
+		RecordLatency(inst, stream.mfx_bit_stream->TimeStamp, Clock::now());
+		CountEncodeCtrl(inst, stream);
+		WritePacket(inst, stream);
+		inst->frames++;
+	}
+	encoder.Close();
+	CloseSink(inst);
+}
+
+static double Percentile(const std::vector<double> & sorted, double p){
+	if (sorted.empty())
+		return 0;
+	size_t index = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+	return sorted[std::min(index, sorted.size() - 1)];
+}
+
+static double CpuSeconds(){
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char ** argv){
+	PerfOptions opt;
+	if (!ParseArgs(argc, argv, opt)){
+		Usage();
+		return 1;
+	}
+
+	AccessUnits aus;
+	StreamIndex index;
+	bool use_index = opt.index && opt.mode == "seek";
+	double index_build_ms = 0;
+	long sidecar_bytes = 0;
+	if (opt.mode != "encode"){
+		if (!opt.input.empty()){
+			std::vector<unsigned char> es;
+			if (!ReadFile(opt.input, es)){
+				fprintf(stderr, "imsdk_perf: cannot read %s\n", opt.input.c_str());
+				return 1;
+			}
+			SplitAccessUnits(es, opt.codec, aus);
+			if (use_index){
+				Clock::time_point build_start = Clock::now();
+				index.Build(opt.codec, es.data(), es.size());
+				index_build_ms = std::chrono::duration<double, std::milli>(Clock::now() - build_start).count();
+				if (!opt.sidecar.empty() && !index.Save(opt.sidecar.c_str())){
+					fprintf(stderr, "imsdk_perf: cannot write %s\n", opt.sidecar.c_str());
+					return 1;
+				}
+			}
+		}else if (!MakeSyntheticStream(opt, aus, use_index ? &index : nullptr)){
+			fprintf(stderr, "imsdk_perf: cannot create a synthetic stream\n");
+			return 1;
+		}
+	}
+	if (use_index && !opt.sidecar.empty()){
+		// seek with what a later run would read, not what was built in memory
+		if (!index.Load(opt.sidecar.c_str())){
+			fprintf(stderr, "imsdk_perf: cannot read %s\n", opt.sidecar.c_str());
+			return 1;
+		}
+		std::vector<unsigned char> file;
+		ReadFile(opt.sidecar, file);
+		sidecar_bytes = file.size();
+	}
+	if (use_index && index.Frames() != aus.size())
+		fprintf(stderr, "imsdk_perf: index has %u frames, stream %zu\n", index.Frames(), aus.size());
+
+	if (!opt.trace.empty())
+		FrameTrace::Enable();
+
+	std::vector<Instance> instances(opt.instances);
+	std::vector<std::thread> threads;
+	double cpu_start = CpuSeconds();
+	Clock::time_point start = Clock::now();
+	for (auto & inst : instances){
+		inst.id = &inst - &instances[0];
+		inst.opt = &opt;
+		inst.aus = &aus;
+		inst.index = use_index ? &index : nullptr;
+		threads.push_back(std::thread(opt.mode == "encode" ? RunEncode : opt.mode == "seek" ? RunSeek :
+				opt.mode == "wall" ? RunWall : RunDecode, &inst));
+	}
+	for (auto & t : threads)
+		t.join();
+	double wall = std::chrono::duration<double>(Clock::now() - start).count();
+	double cpu = CpuSeconds() - cpu_start;
+	if (!opt.trace.empty() && !FrameTrace::Export(opt.trace.c_str()))
+		fprintf(stderr, "imsdk_perf: cannot write %s\n", opt.trace.c_str());
+
+	std::vector<double> latency;
+	int frames = 0;
+	bool ok = true;
+	EncodeQueueStats queue;
+	AsyncDecoderStats async;
+	FrameRingStats ring;
+	ring.readers.resize(opt.ring_readers);
+	CompositorStats composed;
+	PacketSinkStats sink;
+	int64_t sink_latency_us = 0;
+	int idr_requested = 0;
+	int idr_honoured = 0;
+	double luma_mean = 0;
+	double luma_sad = 0;
+	int stats_frames = 0;
+	int sad_frames = 0;
+	int static_frames = 0;
+	for (auto & inst : instances){
+		sink.packets += inst.sink_stats.packets;
+		sink.bytes += inst.sink_stats.bytes;
+		sink.batches += inst.sink_stats.batches;
+		sink.write_errors += inst.sink_stats.write_errors;
+		sink.failed_packets += inst.sink_stats.failed_packets;
+		sink.max_queue_depth = std::max(sink.max_queue_depth, inst.sink_stats.max_queue_depth);
+		sink.max_write_latency_us = std::max(sink.max_write_latency_us, inst.sink_stats.max_write_latency_us);
+		sink_latency_us += inst.sink_stats.avg_write_latency_us * (int64_t)inst.sink_stats.packets;
+		sink.io_uring = sink.io_uring || inst.sink_stats.io_uring;
+		composed.frames += inst.wall.frames;
+		composed.replaced += inst.wall.replaced;
+		composed.stale_skipped += inst.wall.stale_skipped;
+		composed.stale_copied += inst.wall.stale_copied;
+		composed.scale_us += inst.wall.scale_us;
+		composed.compose_us += inst.wall.compose_us;
+		ring.frames += inst.ring.frames;
+		ring.skipped += inst.ring.skipped;
+		ring.blocked_us += inst.ring.blocked_us;
+		for (size_t i = 0; i < inst.ring.readers.size() && i < ring.readers.size(); i++){
+			ring.readers[i].frames += inst.ring.readers[i].frames;
+			ring.readers[i].dropped += inst.ring.readers[i].dropped;
+			ring.readers[i].max_lag = std::max(ring.readers[i].max_lag, inst.ring.readers[i].max_lag);
+		}
+		luma_mean += inst.luma_mean;
+		luma_sad += inst.luma_sad;
+		stats_frames += inst.stats_frames;
+		sad_frames += inst.sad_frames;
+		static_frames += inst.static_frames;
+		idr_requested += inst.idr_requested;
+		idr_honoured += inst.idr_honoured;
+		latency.insert(latency.end(), inst.latency_ms.begin(), inst.latency_ms.end());
+		frames += inst.frames;
+		ok = ok && inst.ok;
+		queue.dropped += inst.queue.dropped;
+		queue.degraded += inst.queue.degraded;
+		queue.busy_retries += inst.queue.busy_retries;
+		queue.max_queue_depth = std::max(queue.max_queue_depth, inst.queue.max_queue_depth);
+		queue.avg_queue_latency_us += inst.queue.avg_queue_latency_us / opt.instances;
+		queue.max_queue_latency_us = std::max(queue.max_queue_latency_us, inst.queue.max_queue_latency_us);
+		async.max_packet_queue = std::max(async.max_packet_queue, inst.async.max_packet_queue);
+		async.max_frame_queue = std::max(async.max_frame_queue, inst.async.max_frame_queue);
+		async.input_blocked_us += inst.async.input_blocked_us;
+		async.decode_busy_us += inst.async.decode_busy_us;
+		async.decode_blocked_us += inst.async.decode_blocked_us;
+		async.deliver_busy_us += inst.async.deliver_busy_us;
+		async.parallelism += inst.async.parallelism / opt.instances;
+	}
+	std::sort(latency.begin(), latency.end());
+	double avg = 0;
+	for (auto l : latency)
+		avg += l;
+	if (!latency.empty())
+		avg /= latency.size();
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	FILE * out = stdout;
+	if (!opt.output.empty()){
+		out = fopen(opt.output.c_str(), "w");
+		if (!out){
+			fprintf(stderr, "imsdk_perf: cannot write %s\n", opt.output.c_str());
+			return 1;
+		}
+	}
+	fprintf(out, "{\n");
+	fprintf(out, "  \"mode\": \"%s\",\n", opt.mode.c_str());
+	fprintf(out, "  \"codec\": \"%s\",\n", opt.codec == VideoCodec::HEVC ? "hevc" : "avc");
+	fprintf(out, "  \"backend\": \"%s\",\n", opt.loopback ? "loopback" : "hw");
+	fprintf(out, "  \"instances\": %d,\n", opt.instances);
+	fprintf(out, "  \"ok\": %s,\n", ok ? "true" : "false");
+	fprintf(out, "  \"frames\": %d,\n", frames);
+	fprintf(out, "  \"wall_s\": %.3f,\n", wall);
+	fprintf(out, "  \"fps\": %.2f,\n", wall > 0 ? frames / wall : 0);
+	fprintf(out, "  \"fps_per_instance\": %.2f,\n", wall > 0 ? frames / wall / opt.instances : 0);
+	fprintf(out, "  \"latency_ms\": {\"avg\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f},\n",
+			avg, Percentile(latency, 50), Percentile(latency, 90), Percentile(latency, 99),
+			latency.empty() ? 0 : latency.back());
+	if (opt.mode == "encode" && opt.queue_depth > 0)
+		fprintf(out, "  \"queue\": {\"depth\": %d, \"dropped\": %llu, \"degraded\": %llu, \"busy_retries\": %llu, \"max_depth\": %d, "
+				"\"avg_latency_ms\": %.3f, \"max_latency_ms\": %.3f},\n",
+				opt.queue_depth, (unsigned long long)queue.dropped, (unsigned long long)queue.degraded,
+				(unsigned long long)queue.busy_retries, queue.max_queue_depth, queue.avg_queue_latency_us / 1000.0, queue.max_queue_latency_us / 1000.0);
+	if (opt.async && (opt.mode == "decode" || opt.mode == "transcode"))
+		fprintf(out, "  \"async\": {\"packet_queue\": %d, \"frame_queue\": %d, \"max_packet_queue\": %d, \"max_frame_queue\": %d, "
+				"\"input_blocked_ms\": %.3f, \"decode_busy_ms\": %.3f, \"decode_blocked_ms\": %.3f, \"deliver_busy_ms\": %.3f, "
+				"\"parallelism\": %.2f},\n",
+				opt.async_params.packet_depth, opt.async_params.frame_depth, async.max_packet_queue, async.max_frame_queue,
+				async.input_blocked_us / 1000.0, async.decode_busy_us / 1000.0, async.decode_blocked_us / 1000.0,
+				async.deliver_busy_us / 1000.0, async.parallelism);
+	if (opt.ring_slots > 0 && (opt.mode == "decode" || opt.mode == "transcode")){
+		fprintf(out, "  \"ring\": {\"slots\": %d, \"frames\": %llu, \"skipped\": %llu, \"blocked_ms\": %.3f, \"readers\": [",
+				opt.ring_slots, (unsigned long long)ring.frames, (unsigned long long)ring.skipped, ring.blocked_us / 1000.0);
+		for (size_t i = 0; i < ring.readers.size(); i++)
+			fprintf(out, "%s{\"frames\": %llu, \"dropped\": %llu, \"max_lag\": %llu}", i ? ", " : "",
+					(unsigned long long)ring.readers[i].frames, (unsigned long long)ring.readers[i].dropped,
+					(unsigned long long)ring.readers[i].max_lag);
+		fprintf(out, "]},\n");
+	}
+	if (opt.mode == "wall")
+		fprintf(out, "  \"wall\": {\"tiles\": %d, \"source_frames\": %llu, \"replaced\": %llu, \"stale_skipped\": %llu, "
+				"\"stale_copied\": %llu, \"scale_ms_per_frame\": %.3f, \"compose_ms\": %.3f},\n",
+				opt.tiles, (unsigned long long)composed.frames, (unsigned long long)composed.replaced,
+				(unsigned long long)composed.stale_skipped, (unsigned long long)composed.stale_copied,
+				composed.frames ? composed.scale_us / 1000.0 / composed.frames : 0, frames ? composed.compose_us / 1000.0 / frames : 0);
+	if (!opt.output_es.empty() && (opt.mode == "encode" || opt.mode == "transcode"))
+		fprintf(out, "  \"sink\": {\"packets\": %llu, \"bytes\": %llu, \"batches\": %llu, \"failed_packets\": %llu, \"write_errors\": %llu, "
+				"\"max_queue_depth\": %d, \"avg_write_latency_ms\": %.3f, \"max_write_latency_ms\": %.3f, \"io_uring\": %s},\n",
+				(unsigned long long)sink.packets, (unsigned long long)sink.bytes, (unsigned long long)sink.batches,
+				(unsigned long long)sink.failed_packets, (unsigned long long)sink.write_errors, sink.max_queue_depth,
+				sink.packets ? sink_latency_us / 1000.0 / sink.packets : 0, sink.max_write_latency_us / 1000.0,
+				sink.io_uring ? "true" : "false");
+	if (use_index)
+		fprintf(out, "  \"index\": {\"keyframes\": %zu, \"param_sets\": %zu, \"frames\": %u, \"build_ms\": %.3f, \"sidecar_bytes\": %ld},\n",
+				index.Keyframes().size(), index.ParamSetCount(), index.Frames(), index_build_ms, sidecar_bytes);
+	if (opt.stats && opt.mode != "encode")
+		fprintf(out, "  \"stats\": {\"frames\": %d, \"avg_luma\": %.2f, \"avg_sad\": %.3f, \"static_frames\": %d},\n",
+				stats_frames, stats_frames ? luma_mean / stats_frames : 0, sad_frames ? luma_sad / sad_frames : 0, static_frames);
+	if (opt.mode == "encode" && opt.force_idr > 0)
+		fprintf(out, "  \"forced_idr\": {\"requested\": %d, \"honoured\": %d},\n", idr_requested, idr_honoured);
+	fprintf(out, "  \"cpu_ms_per_frame\": %.3f,\n", frames ? cpu * 1000 / frames : 0);
+	fprintf(out, "  \"peak_rss_kb\": %ld\n", usage.ru_maxrss);
+	fprintf(out, "}\n");
+	if (out != stdout)
+		fclose(out);
+	return ok ? 0 : 2;
+}